@@ -1,4 +1,6 @@
 #include "archive.h"
+#include "metrics.h"
+#include "hazard.h"
 
 /*
    En este archivo, implementamos todas las estructuras de datos y operaciones relacionadas con los archivos de chat.
@@ -36,20 +38,382 @@ int parse_message(uint8_t *msg)
   return count;
 }
 
+/* Máscara de los bytes del hash que deben ser nulos. El protocolo exige los 2 primeros (0xFFFF),
+   solo las pruebas de rendimiento la cambian con set_difficulty */
+static uint32_t zero_mask = 0xFFFF;
+
+/* Configura cuántos bytes nulos (0, 1 o 2) debe tener al comienzo el hash de cada mensaje */
+void set_difficulty(unsigned zero_bytes)
+{
+  zero_mask = (zero_bytes >= 2) ? 0xFFFF : (zero_bytes == 1) ? 0xFF : 0;
+}
+
+/* Devuelve el número de hilos a usar para una configuración dada, donde 0 significa
+   uno por núcleo disponible */
+static unsigned thread_count(unsigned configured)
+{
+  if (configured == 0)
+  {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cores > 0) ? (unsigned)cores : 1;
+  }
+  return configured;
+}
+
+/* Inicializa el midstate para la secuencia dada. Hasheamos todos los bloques completos de 64 bytes
+   y armamos los bloques finales con el resto de la secuencia, el espacio del código y el relleno,
+   que no cambia porque la longitud total siempre es la misma */
+void midstate_init(struct md5_midstate *ms, const uint8_t *prefix, uint32_t len)
+{
+  uint32_t full = len & ~63u;
+  uint8_t rest[80];
+  unsigned b, l;
+
+  md5x_init(ms->st);
+  md5x_blocks(ms->st, prefix, full / 64);
+
+  ms->tail_len = len - full;
+  memcpy(rest, prefix + full, ms->tail_len);
+  memset(rest + ms->tail_len, 0, 16);
+  ms->tail_blocks = md5x_pad(ms->tail, rest, ms->tail_len + 16, (uint64_t)len + 16);
+
+  /* Copia los bloques finales en todos los carriles */
+  for (b = 0; b < ms->tail_blocks; b++)
+  {
+    for (l = 0; l < MD5X_MAX_LANES; l++)
+    {
+      md5x_load_lane(ms->w[b], l, ms->tail + b * 64);
+    }
+  }
+}
+
+/* Calcula el MD5 de la secuencia completa con el código dado. Partimos de una copia del estado
+   guardado, así que solo procesamos los bloques finales */
+void midstate_hash(struct md5_midstate *ms, const uint8_t *code, uint8_t *md5)
+{
+  uint32_t st[4];
+
+  memcpy(st, ms->st, sizeof(st));
+  memcpy(ms->tail + ms->tail_len, code, 16);
+  md5x_blocks(st, ms->tail, ms->tail_blocks);
+  md5x_digest(st, md5);
+}
+
+/* Prueba varios códigos consecutivos a la vez, uno por carril de md5x. Todos los carriles parten
+   del mismo estado y tienen los mismos bloques finales, salvo las (a lo sumo 5) palabras que
+   contienen el código, así que solo reescribimos esas palabras en cada carril */
+int midstate_try_lanes(struct md5_midstate *ms, unsigned __int128 nonce, uint8_t *md5)
+{
+  uint32_t st[4][MD5X_MAX_LANES];
+  unsigned lanes = md5x_lanes();
+  unsigned first = ms->tail_len / 4, last = (ms->tail_len + 15) / 4;
+  unsigned l, i, j;
+
+  for (l = 0; l < lanes; l++, nonce++)
+  {
+    /* Palabras de la cola que contienen el código, con el código de este carril escrito encima */
+    uint8_t words[24];
+    memcpy(words, ms->tail + first * 4, (last - first + 1) * 4);
+    memcpy(words + (ms->tail_len - first * 4), &nonce, 16);
+
+    for (j = first; j <= last; j++)
+    {
+      memcpy(&ms->w[j / 16][j % 16][l], words + (j - first) * 4, 4);
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+      st[i][l] = ms->st[i];
+    }
+  }
+
+  for (i = 0; i < ms->tail_blocks; i++)
+  {
+    md5x_compress_lanes(st, ms->w[i]);
+  }
+
+  /* Los primeros 2 bytes del hash son los 2 bytes bajos de la primera palabra del estado */
+  for (l = 0; l < lanes; l++)
+  {
+    if ((st[0][l] & zero_mask) == 0)
+    {
+      md5x_digest_lane(st, l, md5);
+      return l;
+    }
+  }
+
+  return -1;
+}
+
+/* Número de hilos mineros, 0 significa uno por núcleo disponible */
+static unsigned miner_threads = 0;
+
+/* Configura el número de hilos que add_message utiliza para minar el código de cada mensaje */
+void set_miner_threads(unsigned n)
+{
+  miner_threads = n;
+}
+
+/* Estado de cada hilo minero. Todos comparten la secuencia de entrada, la bandera 'found' y la
+   bandera de cancelación (si la hay), pero cada uno recorre su propia porción del espacio de
+   códigos de 128 bits y cuenta los hashes que calculó en 'hashes' */
+struct miner_worker
+{
+  const uint8_t *prefix;
+  uint32_t len;
+  unsigned __int128 start;
+  atomic_int *found;
+  const atomic_int *cancel;
+  uint8_t *code, *md5;
+  uint64_t hashes;
+};
+
+/* Trabajo de cada hilo minero. Prepara su propio midstate de la secuencia (los bloques que no
+   cambian se hashean una sola vez) y prueba códigos consecutivos a partir de su inicio, tantos
+   a la vez como carriles tenga el núcleo de md5x, hasta encontrar uno válido, hasta que otro
+   hilo lo encuentre primero o hasta que se cancele la búsqueda */
+static void *miner_thread(void *arg)
+{
+  struct miner_worker *w = (struct miner_worker *)arg;
+  struct md5_midstate ms;
+  uint8_t md5[16];
+  unsigned lanes = md5x_lanes();
+
+  midstate_init(&ms, w->prefix, w->len);
+
+  unsigned __int128 nonce = w->start;
+  uint64_t hashes = 0;
+  while (!atomic_load_explicit(w->found, memory_order_relaxed) &&
+         (w->cancel == NULL || !atomic_load_explicit(w->cancel, memory_order_relaxed)))
+  {
+    int lane = midstate_try_lanes(&ms, nonce, md5);
+    hashes += lanes;
+
+    /* Si algún carril dio un hash con los primeros 2 bytes en 0, hemos encontrado un código
+       válido. Solo el primer hilo en marcar la bandera escribe el resultado, los demás lo ven
+       y terminan */
+    if (lane >= 0)
+    {
+      nonce += lane;
+      int expected = 0;
+      if (atomic_compare_exchange_strong(w->found, &expected, 1))
+      {
+        memcpy(w->code, &nonce, 16);
+        memcpy(w->md5, md5, 16);
+      }
+      break;
+    }
+    nonce += lanes;
+  }
+
+  w->hashes = hashes;
+  return NULL;
+}
+
+/* Busca un código de 16 bytes tal que el MD5 de 'prefix' seguido del código comience con dos
+   bytes nulos, repartiendo el espacio de códigos entre los hilos mineros */
+int mine_code(const uint8_t *prefix, uint32_t len, uint8_t *code, uint8_t *md5, const atomic_int *cancel)
+{
+  unsigned n = thread_count(miner_threads);
+  uint64_t start = metrics_now();
+
+  atomic_int found = 0;
+  struct miner_worker *workers = (struct miner_worker *)malloc(n * sizeof(struct miner_worker));
+  pthread_t *threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+
+  /* Cada hilo comienza en el inicio de su porción del espacio de 128 bits. El primero comienza
+     en 0, así que con un solo hilo obtenemos el mismo código que la búsqueda secuencial */
+  unsigned __int128 step = ((unsigned __int128)-1) / n;
+  unsigned i, launched = 0;
+  for (i = 0; i < n; i++)
+  {
+    workers[i].prefix = prefix;
+    workers[i].len = len;
+    workers[i].start = step * i;
+    workers[i].found = &found;
+    workers[i].cancel = cancel;
+    workers[i].code = code;
+    workers[i].md5 = md5;
+    workers[i].hashes = 0;
+  }
+
+  for (i = 1; i < n; i++)
+  {
+    if (pthread_create(&threads[launched], NULL, miner_thread, &workers[i]) != 0)
+    {
+      fprintf(stderr, "No se pudo lanzar el hilo minero %u, continuamos con menos hilos\n", i);
+      continue;
+    }
+    launched++;
+  }
+
+  /* El hilo que llama también mina (la primera porción), así nunca nos quedamos sin mineros */
+  miner_thread(&workers[0]);
+
+  for (i = 0; i < launched; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  /* Métricas: hashes calculados entre todos los hilos, y tiempo y velocidad del minado si terminó */
+  uint64_t hashes = 0, elapsed = metrics_now() - start;
+  for (i = 0; i < n; i++)
+  {
+    hashes += workers[i].hashes;
+  }
+  metrics_add(METRIC_HASHES, hashes);
+  if (atomic_load(&found))
+  {
+    metrics_observe(METRIC_MINE_TIME, elapsed, 1);
+    metrics_set(METRIC_HASH_RATE, elapsed > 0 ? (uint64_t)(hashes * 1e9 / elapsed) : 0);
+  }
+  else
+  {
+    metrics_add(METRIC_MINE_CANCELLED, 1);
+  }
+
+  free(threads);
+  free(workers);
+  return atomic_load(&found);
+}
+
+/* Devuelve el segmento que contiene el mensaje número 'i' (comenzando en 1) */
+static inline struct archive_seg *seg_of(const struct archive *arch, uint32_t i)
+{
+  return arch->segs[(i - 1) / ARCHIVE_SEG_MSGS];
+}
+
+/* Devuelve la posición del mensaje número 'i' en la tabla de offsets de su segmento */
+static inline uint32_t seg_index(const struct archive_seg *seg, uint32_t i)
+{
+  return seg->lead + (i - 1) % ARCHIVE_SEG_MSGS;
+}
+
+/* Devuelve la capacidad a la que crece un búfer de 'cap' bytes que necesita 'need': el doble (al
+   menos 1024 bytes), o lo necesario si no alcanza */
+static uint32_t seg_grown_cap(uint32_t cap, uint32_t need)
+{
+  cap = (cap < 1024) ? 1024 : cap * 2;
+  return (cap < need) ? need : cap;
+}
+
+/* Devuelve los bytes de la ventana que un segmento nuevo copia del anterior 'prev' (los últimos 19
+   mensajes), y en 'cap' la capacidad con la que se reserva para recibir además 'mlen' bytes: lo que
+   ocupa el anterior, porque los segmentos suelen tener tamaños parecidos */
+static uint32_t seg_lead_bytes(const struct archive_seg *prev, uint32_t mlen, uint32_t *cap)
+{
+  uint32_t end = prev->lead + prev->count;
+  uint32_t bytes = prev->offs[end] - prev->offs[end - (ARCHIVE_WINDOW - 1)];
+  *cap = (prev->offs[end] > bytes + mlen) ? prev->offs[end] : bytes + mlen;
+  return bytes;
+}
+
+/* Prepara el segmento que recibe el siguiente mensaje del archivo, con espacio para 'mlen' bytes más,
+   y lo devuelve. Si el último segmento está lleno, crea uno nuevo que comienza con una copia de los
+   últimos 19 mensajes del anterior. Solo crece el último segmento, que nunca se comparte, así que los
+   mensajes anteriores no se mueven ni se copian */
+static struct archive_seg *seg_reserve(struct archive *arch, uint32_t mlen)
+{
+  uint32_t k = arch->size / ARCHIVE_SEG_MSGS;
+  struct archive_seg *seg;
+
+  if (k == arch->nsegs)
+  {
+    seg = (struct archive_seg *)malloc(sizeof(struct archive_seg));
+    atomic_init(&seg->refs, 1);
+    seg->base = arch->len;
+    seg->lead = 0;
+    seg->count = 0;
+    seg->offs[0] = 0;
+    seg->data = NULL;
+    seg->cap = 0;
+    seg->map = NULL;
+
+    if (k > 0)
+    {
+      struct archive_seg *prev = arch->segs[k - 1];
+      uint32_t from = prev->lead + prev->count - (ARCHIVE_WINDOW - 1), j;
+      uint32_t bytes = seg_lead_bytes(prev, mlen, &seg->cap);
+      seg->data = (uint8_t *)malloc(seg->cap);
+      memcpy(seg->data, prev->data + prev->offs[from], bytes);
+      seg->lead = ARCHIVE_WINDOW - 1;
+      for (j = 0; j <= seg->lead; j++)
+      {
+        seg->offs[j] = prev->offs[from + j] - prev->offs[from];
+      }
+    }
+
+    if (arch->nsegs == arch->cap)
+    {
+      arch->cap = arch->cap ? arch->cap * 2 : 4;
+      arch->segs = (struct archive_seg **)realloc(arch->segs, arch->cap * sizeof(struct archive_seg *));
+    }
+    arch->segs[arch->nsegs++] = seg;
+  }
+
+  seg = arch->segs[k];
+  uint32_t used = seg->offs[seg->lead + seg->count];
+  if (used + mlen > seg->cap)
+  {
+    seg->cap = seg_grown_cap(seg->cap, used + mlen);
+    seg->data = (uint8_t *)realloc(seg->data, seg->cap);
+  }
+  return seg;
+}
+
+/* Confirma los 'n' mensajes escritos al final del segmento devuelto por seg_reserve, registrando sus
+   offsets y actualizando el tamaño y la longitud del archivo */
+static void seg_commit(struct archive *arch, struct archive_seg *seg, uint32_t n)
+{
+  uint32_t k = seg->lead + seg->count, j;
+
+  for (j = k; j < k + n; j++)
+  {
+    seg->offs[j + 1] = seg->offs[j] + seg->data[seg->offs[j]] + 33;
+  }
+  seg->count += n;
+  arch->size += n;
+  arch->len += seg->offs[k + n] - seg->offs[k];
+
+  arch->hdr[1] = (arch->size >> 24) & 0xFF;
+  arch->hdr[2] = (arch->size >> 16) & 0xFF;
+  arch->hdr[3] = (arch->size >> 8) & 0xFF;
+  arch->hdr[4] = arch->size & 0xFF;
+}
+
+/* Suelta una referencia a un segmento, liberándolo si era la última */
+static void seg_unref(struct archive_seg *seg)
+{
+  if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1)
+  {
+    if (seg->map != NULL)
+    {
+      archive_mapping_unref(seg->map);
+    }
+    else
+    {
+      free(seg->data);
+    }
+    free(seg);
+  }
+}
+
 /*
    Intentamos insertar el mensaje 'msg' en el archivo de chat proporcionado. Para ello,
    verificamos si el mensaje es válido y luego extraemos un código de 16 bytes que genera
    un hash MD5 válido para la cadena. Posteriormente, formateamos la cadena con el mensaje
    completo y los metadatos de manera adecuada e incluimos esto en la estructura del archivo,
    actualizándolo en consecuencia.
-   Devolvemos 1 si el mensaje se agregó correctamente, 0 en caso contrario.
+   Devolvemos 1 si el mensaje se agregó correctamente, 0 en caso contrario, o -1 si la bandera
+   'cancel' (si no es NULL) se activó antes de encontrar el código; en ese caso el archivo
+   no cambia.
 
    Cabe destacar que no validamos el archivo antes de intentar agregar el mensaje,
    simplemente asumimos que ya es válido, ya que todos los archivos se validan
    al ser recibidos inicialmente.
 */
 
-int add_message(struct archive *arch, uint8_t *msg)
+int add_message_cancellable(struct archive *arch, uint8_t *msg, const atomic_int *cancel)
 {
   uint16_t len;
   uint8_t *code, *md5;
@@ -70,30 +434,24 @@ int add_message(struct archive *arch, uint8_t *msg)
   }
   fprintf(stdout, "\n");
 
-  /* Reasigna la cadena de archivo para que se ajuste al nuevo mensaje y luego concatenarlo */
-  arch->str = realloc(arch->str, arch->len + len + 33);
-  *(arch->str + arch->len) = len;
-  memcpy(arch->str + arch->len + 1, msg, len);
+  /* Escribe el mensaje al final del último segmento, todavía sin agregarlo al archivo */
+  struct archive_seg *seg = seg_reserve(arch, len + 33);
+  uint32_t k = seg->lead + seg->count;
+  uint8_t *slot = seg->data + seg->offs[k];
+  slot[0] = len;
+  memcpy(slot + 1, msg, len);
 
   /* Obtiene punteros al comienzo del código y secciones de hash MD5 */
-  code = arch->str + arch->len + len + 1;
+  code = slot + len + 1;
   md5 = code + 16;
 
-  /* Puntero de 128 bits para la comparación del hash, puntero de 16 bits para verificar los primeros 2 bytes */
-  unsigned __int128 *mineptr = (unsigned __int128 *)code;
-  uint16_t *check = (uint16_t *)md5;
-
-  /* Extrae un código que genera un hash MD5 válido */
-  *mineptr = (unsigned __int128)0;
-  while (1)
+  /* Extrae un código que genera un hash MD5 válido para la secuencia que comienza en la ventana del
+     mensaje (los últimos 19 mensajes más el nuevo), que siempre es contigua dentro del segmento */
+  uint32_t wfirst = (k >= ARCHIVE_WINDOW - 1) ? k - (ARCHIVE_WINDOW - 1) : 0;
+  if (!mine_code(seg->data + seg->offs[wfirst], seg->offs[k] - seg->offs[wfirst] + len + 1, code, md5, cancel))
   {
-    MD5(arch->str + arch->offset, (arch->len - arch->offset + len + 17), md5);
-    /* Si los primeros 2 bytes son 0, hemos encontrado el hash válido */
-    if (*check == 0)
-    {
-      break;
-    }
-    *mineptr += 1;
+    fprintf(stdout, "Minado interrumpido.\n");
+    return -1;
   }
 
   /* Imprime el código extraído y el hash del mensaje */
@@ -109,23 +467,185 @@ int add_message(struct archive *arch, uint8_t *msg)
   }
   fprintf(stdout, "\n\n");
 
-  /* Actualiza el tamaño y la longitud del archivo, ajusta el offset si es necesario */
-  arch->size += 1;
-  arch->len += len + 33;
-  if (arch->size >= 20)
+  /* Agrega el mensaje, actualizando el tamaño y la longitud del archivo */
+  seg_commit(arch, seg, 1);
+  return 1;
+}
+
+int add_message(struct archive *arch, uint8_t *msg)
+{
+  return add_message_cancellable(arch, msg, NULL);
+}
+
+/* Número de hilos de validación, 0 significa uno por núcleo disponible */
+static unsigned validator_threads = 0;
+
+/* Configura el número de hilos que reparten la verificación de hashes de un archivo */
+void set_validator_threads(unsigned n)
+{
+  validator_threads = n;
+}
+
+/* Por debajo de esta cantidad de mensajes a verificar no vale la pena lanzar hilos,
+   la validación secuencial termina antes de que los hilos arranquen */
+#define VALIDATION_PARALLEL_MIN 2048
+
+/* Cada hilo de validación toma bloques de esta cantidad de mensajes consecutivos */
+#define VALIDATION_CHUNK 512
+
+/* Trabajo de validación compartido por todos los hilos: verificar los mensajes 'first' a 'last'
+   del archivo. Los hilos toman bloques de mensajes con el contador 'next' y marcan 'failed' al
+   encontrar un hash incorrecto, lo que detiene a todos los demás */
+struct validation_job
+{
+  struct archive *arch;
+  uint32_t first, last;
+  atomic_uint next;
+  atomic_int failed;
+};
+
+/* Verifica los hashes de los mensajes 'from' a 'to' (inclusive) de un trabajo de validación,
+   en lotes del ancho del núcleo de md5x. Devuelve 1 si todos son correctos, 0 en caso contrario */
+static int check_hashes(struct validation_job *job, uint32_t from, uint32_t to)
+{
+  const uint8_t *inputs[MD5X_MAX_LANES];
+  uint32_t lens[MD5X_MAX_LANES];
+  uint8_t md5[MD5X_MAX_LANES][16];
+  unsigned pending = 0, lanes = md5x_lanes(), j;
+  uint32_t i;
+
+  for (i = from; i <= to; i++)
   {
-    arch->offset += *(arch->str + arch->offset) + 33;
+    /* La ventana del mensaje i termina justo antes de su hash */
+    inputs[pending] = archive_window(job->arch, i, &lens[pending]);
+    pending++;
+
+    /* Con el lote lleno (o en el último mensaje), calcula los hashes y compáralos con los originales */
+    if (pending == lanes || i == to)
+    {
+      md5x_many(inputs, lens, md5, pending);
+
+      for (j = 0; j < pending; j++)
+      {
+        if (memcmp(md5[j], inputs[j] + lens[j], 16) != 0)
+        {
+          return 0;
+        }
+      }
+      pending = 0;
+
+      /* Si otro hilo ya encontró un error, no tiene sentido seguir */
+      if (atomic_load_explicit(&job->failed, memory_order_relaxed))
+      {
+        return 1;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/* Trabajo de cada hilo de validación: toma bloques de mensajes hasta que no queden más o hasta
+   que algún hilo encuentre un hash incorrecto */
+static void *validator_thread(void *arg)
+{
+  struct validation_job *job = (struct validation_job *)arg;
+
+  while (!atomic_load_explicit(&job->failed, memory_order_relaxed))
+  {
+    uint32_t from = job->first + atomic_fetch_add(&job->next, VALIDATION_CHUNK);
+    if (from > job->last || from < job->first)
+    {
+      break;
+    }
+
+    uint32_t to = (job->last - from >= VALIDATION_CHUNK) ? from + VALIDATION_CHUNK - 1 : job->last;
+    if (!check_hashes(job, from, to))
+    {
+      atomic_store(&job->failed, 1);
+    }
   }
 
-  /* Actualiza la representación de bytes del tamaño del archivo */
-  uint8_t *aux = arch->str + 1;
-  uint32_t old_size = ((aux[0] << 24) | (aux[1] << 16) | (aux[2] << 8) | aux[3]);
-  old_size++;
-  aux[0] = (old_size >> 24) & 0xFF;
-  aux[1] = (old_size >> 16) & 0xFF;
-  aux[2] = (old_size >> 8) & 0xFF;
-  aux[3] = old_size & 0xFF;
+  return NULL;
+}
 
+/*
+   Valida los hashes de los mensajes 'first' a arch->size del archivo. Los mensajes anteriores a 'first'
+   no se vuelven a verificar, se asumen válidos.
+
+   Primero verificamos los 2 bytes nulos del hash de cada mensaje, que es muy barato. Como cada hash
+   solo depende de bytes que ya están en el archivo, y la ventana de cada mensaje se encuentra
+   directamente en su segmento, las verificaciones son independientes entre sí: para archivos grandes
+   las repartimos entre varios hilos, que se detienen en cuanto alguno encuentra un hash incorrecto.
+   Devolvemos 1 si todos los mensajes verificados son válidos, 0 en caso contrario.
+*/
+static int validate_range(struct archive *arch, uint32_t first)
+{
+  struct validation_job job;
+  uint32_t i;
+
+  job.arch = arch;
+  job.first = first;
+  job.last = arch->size;
+  atomic_init(&job.next, 0);
+  atomic_init(&job.failed, 0);
+
+  /* Verifica los primeros 2 bytes del hash, usamos un puntero de 2 bytes para simplificar */
+  for (i = first; i <= arch->size; i++)
+  {
+    const uint16_t *f2bytes = (const uint16_t *)archive_md5(arch, i);
+    if ((*f2bytes & zero_mask) != 0)
+    {
+      fprintf(stderr, "Bytes no nulos en el hash MD5. ¡Archivo inválido!\n");
+      return 0;
+    }
+  }
+
+  /* Verifica los hashes, en paralelo si hay suficientes mensajes */
+  if (first <= arch->size)
+  {
+    unsigned n = thread_count(validator_threads);
+    uint64_t start = metrics_now();
+    if (arch->size - first + 1 < VALIDATION_PARALLEL_MIN || n == 1)
+    {
+      if (!check_hashes(&job, first, arch->size))
+      {
+        atomic_store(&job.failed, 1);
+      }
+    }
+    else
+    {
+      pthread_t *threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+      unsigned launched = 0;
+
+      for (i = 1; i < n; i++)
+      {
+        if (pthread_create(&threads[launched], NULL, validator_thread, &job) == 0)
+        {
+          launched++;
+        }
+      }
+
+      /* El hilo que llama también valida, así nunca nos quedamos sin hilos */
+      validator_thread(&job);
+
+      for (i = 0; i < launched; i++)
+      {
+        pthread_join(threads[i], NULL);
+      }
+      free(threads);
+    }
+
+    /* Métricas: el tiempo de la verificación, repartido entre los mensajes verificados */
+    uint32_t checked = arch->size - first + 1;
+    metrics_observe(METRIC_VALIDATE_TIME, (metrics_now() - start) / checked, checked);
+  }
+
+  if (atomic_load(&job.failed))
+  {
+    fprintf(stderr, "¡Desajuste de hash! Archivo inválido.\n");
+    return 0;
+  }
   return 1;
 }
 
@@ -137,86 +657,428 @@ int add_message(struct archive *arch, uint8_t *msg)
 
 int is_valid(struct archive *arch)
 {
-  uint8_t *begin, *end, md5[16];
-  unsigned __int128 *calc_hash, *orig_hash;
+  return validate_range(arch, 1);
+}
+
+/*
+   Validamos un archivo recibido confiando en el prefijo que comparte con 'trusted', un archivo
+   que ya fue validado (normalmente el activo). Buscamos el prefijo más largo de mensajes idénticos
+   byte a byte en ambos archivos (los segmentos que comparten son idénticos, así que los saltamos
+   enteros), y solo verificamos los hashes de los mensajes que siguen, con la ventana de 20 mensajes
+   que les corresponde. Si el archivo recibido es el activo más algunos mensajes nuevos, el costo
+   depende solo de los mensajes nuevos y no de la longitud del archivo.
+   Devolvemos 1 si el archivo es válido, y 0 en caso contrario.
+*/
+int is_valid_from(struct archive *arch, struct archive *trusted)
+{
+  uint32_t k = 0, limit;
+
+  limit = (arch->size < trusted->size) ? arch->size : trusted->size;
+  while (k < limit)
+  {
+    if (k % ARCHIVE_SEG_MSGS == 0 && limit - k >= ARCHIVE_SEG_MSGS &&
+        arch->segs[k / ARCHIVE_SEG_MSGS] == trusted->segs[k / ARCHIVE_SEG_MSGS])
+    {
+      k += ARCHIVE_SEG_MSGS;
+      continue;
+    }
 
-  /* Omite bytes de tipo/tamaño de mensaje */
-  begin = arch->str + 5;
-  end = arch->str + 5;
+    const uint8_t *a = archive_message(arch, k + 1), *t = archive_message(trusted, k + 1);
+    if (a[0] != t[0] || memcmp(a, t, a[0] + 33) != 0)
+    {
+      break;
+    }
+    k++;
+  }
 
-  /* Nuestro hash calculado siempre está en la misma dirección de memoria */
-  calc_hash = (unsigned __int128 *)md5;
+  /* El primer mensaje a verificar es el k + 1 */
+  return validate_range(arch, k + 1);
+}
 
-  /* Ahora repetimos el proceso para cada mensaje en el archivo */
-  uint32_t i, md5len = 0;
-  for (i = 1; i <= arch->size; i++)
+/* Inicializa un archivo en recepción, inicialmente vacío y confiando en el archivo de referencia */
+void stream_init(struct archive_stream *st, struct archive *trusted)
+{
+  st->arch = init_archive();
+  st->trusted = (trusted != NULL) ? archive_ref(trusted) : NULL;
+  st->matched = 0;
+  st->held = 0;
+  st->npending = 0;
+}
+
+/* Memoria que ocupa el último segmento del archivo: su estructura y su búfer (0 si no tiene ninguno) */
+static size_t last_seg_memory(const struct archive *arch)
+{
+  return arch->nsegs ? sizeof(struct archive_seg) + arch->segs[arch->nsegs - 1]->cap : 0;
+}
+
+/* Deja de confiar en la referencia: el archivo en recepción pasa a ser el prefijo de los mensajes
+   que coincidieron, compartiendo los segmentos de la referencia en lugar de copiarlos */
+static void stream_untrust(struct archive_stream *st)
+{
+  if (st->matched > 0)
   {
-    /* Primero calcula la longitud del mensaje actual */
-    uint8_t len = *end;
+    archive_unref(st->arch);
+    st->arch = archive_prefix(st->trusted, st->matched);
 
-    /* Itera hasta el final del mensaje y realiza un seguimiento de cuántos bytes se harán hash */
-    end += len + 17;
-    md5len += len + 17;
+    /* Los segmentos llenos se comparten con la referencia, pero el último se copió */
+    if (st->matched % ARCHIVE_SEG_MSGS != 0)
+    {
+      st->held += last_seg_memory(st->arch);
+    }
+  }
+  archive_unref(st->trusted);
+  st->trusted = NULL;
+}
 
-    /* Verifica los primeros 2 bytes del hash, usamos un puntero de 2 bytes para simplificar */
-    uint16_t *f2bytes = (uint16_t *)end;
-    if (*f2bytes != 0)
+/* Verifica los hashes de los mensajes pendientes del archivo en recepción, todos de una vez
+   con md5x. Devuelve 1 si todos son correctos, 0 en caso contrario */
+static int stream_flush(struct archive_stream *st)
+{
+  const uint8_t *inputs[MD5X_MAX_LANES];
+  uint32_t lens[MD5X_MAX_LANES];
+  uint8_t md5[MD5X_MAX_LANES][16];
+  uint32_t j;
+  uint64_t start = metrics_now();
+
+  /* Las ventanas se buscan recién ahora, porque el último segmento pudo moverse al crecer */
+  for (j = 0; j < st->npending; j++)
+  {
+    inputs[j] = archive_window(st->arch, st->pending[j], &lens[j]);
+  }
+  md5x_many(inputs, lens, md5, st->npending);
+  metrics_observe(METRIC_VALIDATE_TIME, (metrics_now() - start) / st->npending, st->npending);
+
+  for (j = 0; j < st->npending; j++)
+  {
+    if (memcmp(md5[j], inputs[j] + lens[j], 16) != 0)
     {
-      fprintf(stderr, "Bytes no nulos en el hash MD5. ¡Archivo inválido!\n");
+      fprintf(stderr, "¡Desajuste de hash! Archivo inválido.\n");
       return 0;
     }
+  }
+
+  st->npending = 0;
+  return 1;
+}
+
+/* Agrega un mensaje recibido al archivo en recepción. Mientras coincida con el archivo de referencia
+   solo lo contamos; si no, lo copiamos, verificamos sus bytes nulos de inmediato y dejamos su hash
+   pendiente, para calcularlo junto con los de los siguientes mensajes */
+int stream_push(struct archive_stream *st, uint8_t len, const uint8_t *data)
+{
+  uint32_t mlen = len + 33;
+
+  /* ¿Sigue coincidiendo con el archivo de referencia? Una vez que difiere (o que la referencia se
+     termina), no volvemos a confiar en ella */
+  if (st->trusted != NULL)
+  {
+    const uint8_t *ref = (st->matched < st->trusted->size) ? archive_message(st->trusted, st->matched + 1) : NULL;
+    if (ref != NULL && ref[0] == len && memcmp(ref + 1, data, len + 32) == 0)
+    {
+      st->matched++;
+      return 1;
+    }
+    stream_untrust(st);
+  }
+
+  struct archive *arch = st->arch;
+  uint32_t nsegs = arch->nsegs;
+  size_t last = last_seg_memory(arch);
+  struct archive_seg *seg = seg_reserve(arch, mlen);
+
+  /* Contamos la memoria que realmente ocupa la recepción: cada segmento nuevo entero (su estructura y
+     su búfer, con la copia de la ventana anterior) y lo que crece el último */
+  st->held += last_seg_memory(arch) - ((arch->nsegs == nsegs) ? last : 0);
+
+  uint8_t *slot = seg->data + seg->offs[seg->lead + seg->count];
+  slot[0] = len;
+  memcpy(slot + 1, data, len + 32);
+
+  /* Verifica los primeros 2 bytes del hash */
+  uint16_t *f2bytes = (uint16_t *)(slot + len + 17);
+  if ((*f2bytes & zero_mask) != 0)
+  {
+    fprintf(stderr, "Bytes no nulos en el hash MD5. ¡Archivo inválido!\n");
+    return 0;
+  }
+  st->pending[st->npending++] = arch->size + 1;
+
+  seg_commit(arch, seg, 1);
+
+  /* Con un lote completo, verifica los hashes pendientes */
+  if (st->npending == md5x_lanes())
+  {
+    return stream_flush(st);
+  }
+  return 1;
+}
+
+/* Memoria que sumaría copiar el siguiente mensaje, con la misma política de reserva que seg_reserve */
+size_t stream_cost(const struct archive_stream *st, uint8_t len)
+{
+  const struct archive *arch = st->arch;
+  uint32_t mlen = len + 33, k = arch->size / ARCHIVE_SEG_MSGS, cap = 0, used = 0;
+
+  if (k < arch->nsegs)
+  {
+    const struct archive_seg *seg = arch->segs[k];
+    used = seg->offs[seg->lead + seg->count];
+    return (used + mlen > seg->cap) ? seg_grown_cap(seg->cap, used + mlen) - seg->cap : 0;
+  }
+  if (k > 0)
+  {
+    used = seg_lead_bytes(arch->segs[k - 1], mlen, &cap);
+  }
+  if (used + mlen > cap)
+  {
+    cap = seg_grown_cap(cap, used + mlen);
+  }
+  return sizeof(struct archive_seg) + cap;
+}
+
+/* Cada ARCHIVE_SEG_MSGS mensajes empieza seguro un segmento nuevo, con su estructura y su ventana */
+size_t stream_min_cost(uint32_t n)
+{
+  size_t segs = n / ARCHIVE_SEG_MSGS;
+  return segs * (sizeof(struct archive_seg) + (ARCHIVE_WINDOW - 1) * 33) + (size_t)n * 33;
+}
+
+/* Comienza el archivo en recepción con los primeros mensajes de un archivo ya validado, que comparte
+   con él sus segmentos llenos */
+void stream_prefill(struct archive_stream *st, struct archive *base, uint32_t n)
+{
+  archive_unref(st->arch);
+  st->arch = archive_prefix(base, n);
+  if (n % ARCHIVE_SEG_MSGS != 0)
+  {
+    st->held += last_seg_memory(st->arch);
+  }
+  if (st->trusted != NULL)
+  {
+    archive_unref(st->trusted);
+    st->trusted = NULL;
+  }
+}
+
+/* Termina la recepción de un archivo, verificando los hashes pendientes */
+struct archive *stream_finish(struct archive_stream *st)
+{
+  if (st->trusted != NULL)
+  {
+    stream_untrust(st);
+  }
+
+  struct archive *arch = st->arch;
+  if (st->npending > 0 && !stream_flush(st))
+  {
+    stream_abort(st);
+    return NULL;
+  }
+
+  st->arch = NULL;
+  return arch;
+}
+
+/* Descarta un archivo en recepción */
+void stream_abort(struct archive_stream *st)
+{
+  if (st->arch != NULL)
+  {
+    archive_unref(st->arch);
+    st->arch = NULL;
+  }
+  if (st->trusted != NULL)
+  {
+    archive_unref(st->trusted);
+    st->trusted = NULL;
+  }
+}
+
+/* Devuelve el offset del mensaje número 'i' del archivo, a partir del offset de su segmento */
+uint32_t message_offset(const struct archive *arch, uint32_t i)
+{
+  if (i > arch->size)
+  {
+    return arch->len;
+  }
+
+  struct archive_seg *seg = seg_of(arch, i);
+  return seg->base + seg->offs[seg_index(seg, i)] - seg->offs[seg->lead];
+}
+
+const uint8_t *archive_message(const struct archive *arch, uint32_t i)
+{
+  struct archive_seg *seg = seg_of(arch, i);
+  return seg->data + seg->offs[seg_index(seg, i)];
+}
+
+const uint8_t *archive_md5(const struct archive *arch, uint32_t i)
+{
+  const uint8_t *msg = archive_message(arch, i);
+  return msg + msg[0] + 17;
+}
+
+/* Gracias a los mensajes copiados al comienzo de cada segmento, los 19 mensajes anteriores a
+   cualquier mensaje (o todos, si hay menos) están en su mismo segmento, justo antes que él */
+const uint8_t *archive_window(const struct archive *arch, uint32_t i, uint32_t *len)
+{
+  struct archive_seg *seg = seg_of(arch, i);
+  uint32_t k = seg_index(seg, i);
+  uint32_t first = (k >= ARCHIVE_WINDOW - 1) ? k - (ARCHIVE_WINDOW - 1) : 0;
+
+  *len = seg->offs[k + 1] - 16 - seg->offs[first];
+  return seg->data + seg->offs[first];
+}
 
-    /* Actualiza el desplazamiento a partir del mensaje 20 */
-    if (i > 19)
+/* Los mensajes se copian de a un segmento por vez, con una sola copia por segmento */
+void archive_append(struct archive *arch, const uint8_t *msgs, uint32_t n)
+{
+  while (n > 0)
+  {
+    /* Cuántos mensajes caben en el último segmento, y cuántos bytes ocupan */
+    uint32_t room = ARCHIVE_SEG_MSGS - arch->size % ARCHIVE_SEG_MSGS;
+    uint32_t take = (n < room) ? n : room, bytes = 0, j;
+    for (j = 0; j < take; j++)
     {
-      arch->offset += ((*begin) + 33);
+      bytes += msgs[bytes] + 33;
     }
 
-    /* Si la secuencia tiene más de 20 mensajes, elimina el primer mensaje de la cadena de entrada del MD5
-       y vuelve a calcular su longitud */
-    if (i > 20)
+    struct archive_seg *seg = seg_reserve(arch, bytes);
+    memcpy(seg->data + seg->offs[seg->lead + seg->count], msgs, bytes);
+    seg_commit(arch, seg, take);
+
+    msgs += bytes;
+    n -= take;
+  }
+}
+
+struct archive_mapping *archive_mapping_new(void *addr, size_t len)
+{
+  struct archive_mapping *map = (struct archive_mapping *)malloc(sizeof(struct archive_mapping));
+  atomic_init(&map->refs, 1);
+  map->addr = addr;
+  map->len = len;
+  return map;
+}
+
+void archive_mapping_unref(struct archive_mapping *map)
+{
+  if (atomic_fetch_sub_explicit(&map->refs, 1, memory_order_acq_rel) == 1)
+  {
+    munmap(map->addr, map->len);
+    free(map);
+  }
+}
+
+/* Cada segmento lleno es una ventana de los mensajes del fichero: sus mensajes propios precedidos de
+   los 19 anteriores, que en el fichero ya están justo antes, así que el segmento puede apuntar a
+   ellos sin copiarlos. Sus offsets salen de 'offsets', sin leer los mensajes */
+struct archive *archive_map(struct archive_mapping *map, const uint8_t *msgs, const uint32_t *offsets,
+                            uint32_t n, uint32_t len)
+{
+  struct archive *arch = init_archive();
+  uint32_t full = n / ARCHIVE_SEG_MSGS, k, j;
+
+  arch->cap = full + 1;
+  arch->segs = (struct archive_seg **)malloc(arch->cap * sizeof(struct archive_seg *));
+  for (k = 0; k < full; k++)
+  {
+    struct archive_seg *seg = (struct archive_seg *)malloc(sizeof(struct archive_seg));
+    uint32_t lead = k ? ARCHIVE_WINDOW - 1 : 0, first = k * ARCHIVE_SEG_MSGS - lead;
+    uint32_t next = (k + 1) * ARCHIVE_SEG_MSGS, start = offsets[first];
+
+    atomic_init(&seg->refs, 1);
+    seg->base = arch->len;
+    seg->lead = lead;
+    seg->count = ARCHIVE_SEG_MSGS;
+    for (j = 0; j < lead + ARCHIVE_SEG_MSGS; j++)
     {
-      md5len -= ((*begin) + 33);
-      begin += ((*begin) + 33);
+      seg->offs[j] = offsets[first + j] - start;
     }
+    seg->offs[j] = ((next < n) ? offsets[next] : len) - start;
+    seg->data = (uint8_t *)msgs + start;
+    seg->cap = 0;
+    seg->map = map;
+    atomic_fetch_add_explicit(&map->refs, 1, memory_order_relaxed);
 
-    /* Calcula el hash para la secuencia de bytes y compáralo con el hash original */
-    MD5(begin, md5len, md5);
+    arch->segs[arch->nsegs++] = seg;
+    arch->size += ARCHIVE_SEG_MSGS;
+    arch->len += seg->offs[j] - seg->offs[lead];
+  }
 
-    orig_hash = (unsigned __int128 *)end;
+  arch->hdr[1] = (arch->size >> 24) & 0xFF;
+  arch->hdr[2] = (arch->size >> 16) & 0xFF;
+  arch->hdr[3] = (arch->size >> 8) & 0xFF;
+  arch->hdr[4] = arch->size & 0xFF;
+  if (n > arch->size)
+  {
+    archive_append(arch, msgs + offsets[arch->size], n - arch->size);
+  }
+  return arch;
+}
+
+/* Cada segmento aporta un vector con sus mensajes propios a partir del mensaje pedido, sin los
+   copiados del segmento anterior */
+uint32_t archive_iov(const struct archive *arch, uint32_t from, struct iovec *iov)
+{
+  uint32_t n = 0, i = from ? from : 1;
 
-    if (*calc_hash != *orig_hash)
+  if (from == 0)
+  {
+    if (iov != NULL)
     {
-      fprintf(stderr, "¡Desajuste de hash! Archivo inválido.\n");
-      return 0;
+      iov[n].iov_base = (void *)arch->hdr;
+      iov[n].iov_len = 5;
     }
+    n++;
+  }
+
+  while (i <= arch->size)
+  {
+    struct archive_seg *seg = seg_of(arch, i);
+    uint32_t k = seg_index(seg, i), end = seg->lead + seg->count;
 
-    /* Actualiza el puntero final después del hash MD5 y actualiza la longitud de la cadena de entrada del MD5 */
-    end += 16;
-    md5len += 16;
+    if (iov != NULL)
+    {
+      iov[n].iov_base = seg->data + seg->offs[k];
+      iov[n].iov_len = seg->offs[end] - seg->offs[k];
+    }
+    n++;
+    i += end - k;
   }
-  return 1;
+
+  return n;
 }
 
-/* Imprime un archivo en el flujo dado, para depuración o actualización del archivo */
-void print_archive(struct archive *arch, FILE *stream)
+uint8_t *archive_flatten(const struct archive *arch)
 {
-  uint8_t *ptr;
-  uint32_t size;
+  uint8_t *str = (uint8_t *)malloc(arch->len);
+  uint32_t n = archive_iov(arch, 0, NULL), i, off = 0;
+  struct iovec *iov = (struct iovec *)malloc(n * sizeof(struct iovec));
+
+  archive_iov(arch, 0, iov);
+  for (i = 0; i < n; i++)
+  {
+    memcpy(str + off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
 
-  ptr = arch->str;
-  size = arch->size;
+  free(iov);
+  return str;
+}
 
+/* Imprime un archivo en el flujo dado, para depuración o actualización del archivo */
+void print_archive(struct archive *arch, FILE *stream)
+{
   fprintf(stream, "\n---------- INICIO DEL ARCHIVO ----------\n");
   /* Bytes de tipo y tamaño de mensaje */
   fprintf(stream, "tamaño: %u, longitud: %u\n", arch->size, arch->len);
 
-  ptr += 5;
-
   /* Itera sobre los mensajes */
   uint32_t i, j;
-  for (i = 0; i < size; i++)
+  for (i = 1; i <= arch->size; i++)
   {
+    const uint8_t *ptr = archive_message(arch, i);
     uint8_t len;
     len = *ptr++;
 
@@ -250,9 +1112,8 @@ void print_archive(struct archive *arch, FILE *stream)
 /* Inicializa una nueva estructura de archivo y la devuelve. Los archivos nuevos tienen tamaño 0,
    de modo que cualquier archivo nuevo y válido puede sobrescribirlos. Su representación en cadena es
    inicialmente de 5 caracteres de longitud, conteniendo solo el tipo de mensaje y los 4 bytes
-   que indican la cantidad de mensajes (que obviamente es 0).
-   El desplazamiento es inicialmente 5, ya que no hay mensajes en el archivo (obviamente), y
-   ignoramos los bytes de tipo y tamaño.
+   que indican la cantidad de mensajes (que obviamente es 0). Los segmentos se crean a medida que
+   se agregan mensajes.
 */
 struct archive *init_archive()
 {
@@ -260,14 +1121,152 @@ struct archive *init_archive()
 
   newarchive = (struct archive *)malloc(sizeof(struct archive));
 
-  uint8_t *str = (uint8_t *)malloc(5);
-  str[0] = 4;
-  str[1] = str[2] = str[3] = str[4] = 0;
-  newarchive->str = str;
-  newarchive->offset = 5;
+  newarchive->hdr[0] = 4;
+  newarchive->hdr[1] = newarchive->hdr[2] = newarchive->hdr[3] = newarchive->hdr[4] = 0;
+  newarchive->segs = NULL;
+  newarchive->nsegs = newarchive->cap = 0;
 
   newarchive->len = 5;
   newarchive->size = 0;
+  atomic_init(&newarchive->refs, 1);
 
   return newarchive;
 }
+
+struct archive *archive_ref(struct archive *arch)
+{
+  atomic_fetch_add_explicit(&arch->refs, 1, memory_order_relaxed);
+  return arch;
+}
+
+void archive_unref(struct archive *arch)
+{
+  if (atomic_fetch_sub_explicit(&arch->refs, 1, memory_order_acq_rel) == 1)
+  {
+    uint32_t k;
+    for (k = 0; k < arch->nsegs; k++)
+    {
+      seg_unref(arch->segs[k]);
+    }
+    free(arch->segs);
+    free(arch);
+  }
+}
+
+struct archive *archive_clone(const struct archive *arch)
+{
+  return archive_prefix(arch, arch->size);
+}
+
+/* Los segmentos llenos del prefijo se comparten tomando una referencia; los mensajes que quedan
+   (menos de ARCHIVE_SEG_MSGS, consecutivos en un mismo segmento) se copian a un segmento propio de
+   la copia */
+struct archive *archive_prefix(const struct archive *arch, uint32_t n)
+{
+  struct archive *copy = init_archive();
+  uint32_t full = n / ARCHIVE_SEG_MSGS, k;
+
+  copy->cap = full + 1;
+  copy->segs = (struct archive_seg **)malloc(copy->cap * sizeof(struct archive_seg *));
+  for (k = 0; k < full; k++)
+  {
+    copy->segs[k] = arch->segs[k];
+    atomic_fetch_add_explicit(&copy->segs[k]->refs, 1, memory_order_relaxed);
+  }
+  copy->nsegs = full;
+  copy->size = full * ARCHIVE_SEG_MSGS;
+  copy->len = message_offset(arch, copy->size + 1);
+
+  if (n > copy->size)
+  {
+    archive_append(copy, archive_message(arch, copy->size + 1), n - copy->size);
+  }
+
+  copy->hdr[1] = (n >> 24) & 0xFF;
+  copy->hdr[2] = (n >> 16) & 0xFF;
+  copy->hdr[3] = (n >> 8) & 0xFF;
+  copy->hdr[4] = n & 0xFF;
+  return copy;
+}
+
+void snapshot_init(struct snapshot *snap, struct archive *arch)
+{
+  atomic_init(&snap->arch, arch);
+  atomic_init(&snap->changed, 0);
+}
+
+/* Entre leer el puntero y tomar la referencia, el archivo podría ser reemplazado y liberado por otro
+   hilo. Por eso el lector lo anota como puntero de riesgo y vuelve a leerlo: si no cambió, quien lo
+   reemplace verá la anotación y no soltará el archivo hasta que el lector tenga su referencia */
+struct archive *snapshot_get(struct snapshot *snap)
+{
+  int slot = hazard_claim();
+  struct archive *arch = atomic_load(&snap->arch), *again;
+  for (;;)
+  {
+    hazard_set(slot, arch);
+    again = atomic_load(&snap->arch);
+    if (again == arch)
+    {
+      break;
+    }
+    arch = again;
+  }
+  archive_ref(arch);
+  hazard_release(slot);
+  return arch;
+}
+
+/* Suelta la referencia de un snapshot a un archivo retirado, ver hazard_retire */
+static void release_retired(void *arch)
+{
+  archive_unref((struct archive *)arch);
+}
+
+int snapshot_publish(struct snapshot *snap, struct archive *expected, struct archive *arch)
+{
+  struct archive *current = expected;
+
+  archive_ref(arch);
+  if (!atomic_compare_exchange_strong(&snap->arch, &current, arch))
+  {
+    archive_unref(arch);
+    return 0;
+  }
+
+  /* Interrumpe el minado que estuviera en curso sobre el archivo anterior */
+  atomic_store(&snap->changed, 1);
+
+  hazard_retire(expected, release_retired);
+  return 1;
+}
+
+/* Mina el mensaje sobre una copia del archivo publicado, sin bloquear a nadie, y publica la copia solo
+   si el archivo publicado sigue siendo el mismo. Cualquier publicación durante el minado lo interrumpe
+   (el código ya no serviría, porque la ventana de los últimos 20 mensajes cambió), y el mensaje se
+   vuelve a minar sobre el archivo nuevo. La bandera se baja antes de tomar el archivo, así que una
+   publicación entre ambos pasos a lo sumo provoca un reintento de más */
+struct archive *snapshot_add_message(struct snapshot *snap, uint8_t *msg)
+{
+  for (;;)
+  {
+    atomic_store(&snap->changed, 0);
+    struct archive *base = snapshot_get(snap);
+    struct archive *next = archive_clone(base);
+
+    int added = add_message_cancellable(next, msg, &snap->changed);
+    if (added == 1 && snapshot_publish(snap, base, next))
+    {
+      archive_unref(base);
+      return next;
+    }
+
+    archive_unref(base);
+    archive_unref(next);
+    if (added == 0)
+    {
+      return NULL;
+    }
+    fprintf(stdout, "El archivo activo cambió mientras se minaba, minando de nuevo...\n");
+  }
+}
@@ -2,24 +2,84 @@
 #include <stdlib.h>      //funciones para gestión de memoria como malloc, calloc, free y similares
 #include <stdio.h>       //impresión, principalmente para depuración e informes de errores
 #include <string.h>      //funciones de manipulación de memoria como memset, memcpy y otras
-#include <openssl/md5.h> //hashing MD5
+#include "md5x.h"         //hashing MD5 con núcleos de múltiples carriles
+#include <pthread.h>     //hilos para la minería en paralelo
+#include <stdatomic.h>   //bandera atómica compartida entre los hilos mineros
+#include <unistd.h>      //sysconf, para conocer el número de núcleos disponibles
+#include <sys/uio.h>     //struct iovec, para exportar el archivo sin copiarlo
+#include <sys/mman.h>    //munmap, para soltar los ficheros mapeados a los que apuntan los segmentos
+
+/* Cantidad de mensajes propios de cada segmento de un archivo */
+#define ARCHIVE_SEG_MSGS 256
+
+/* Cantidad de mensajes de la ventana de hash de cada mensaje: él mismo y los 19 anteriores */
+#define ARCHIVE_WINDOW 20
+
+/* Segmento de un archivo: un bloque contiguo con hasta ARCHIVE_SEG_MSGS mensajes consecutivos, en el
+   formato en que se envían. Descripción breve de sus campos:
+   refs  -> número de archivos que comparten el segmento. Un segmento lleno no se modifica nunca
+            más, así que las copias de un archivo lo comparten en lugar de copiarlo
+   base  -> offset de su primer mensaje propio en la representación en cadena del archivo
+   lead  -> mensajes copiados del final del segmento anterior (19, o 0 en el primer segmento) al
+            comienzo de 'data', para que la ventana de hash de cualquier mensaje propio sea contigua
+   count -> número de mensajes propios, que siguen a los copiados
+   offs  -> offset en 'data' de cada mensaje (los copiados y luego los propios), y al final el del
+            fin de los datos
+   data  -> los mensajes, en un búfer de capacidad 'cap' que crece mientras el segmento se llena
+   map   -> si no es NULL, 'data' no es un búfer propio sino que apunta dentro de este fichero mapeado
+            (ver archive_map); el segmento está lleno y 'cap' es 0 */
+struct archive_seg
+{
+  atomic_uint refs;
+  uint32_t base;
+  uint32_t lead, count;
+  uint32_t offs[ARCHIVE_WINDOW + ARCHIVE_SEG_MSGS];
+  uint8_t *data;
+  uint32_t cap;
+  struct archive_mapping *map;
+};
+
+/* Fichero mapeado en memoria ('len' bytes desde 'addr') con mensajes a los que apuntan los segmentos
+   de los archivos cargados, en lugar de copiarlos. Se desmapea cuando su contador de referencias
+   'refs' (una por segmento, más la de quien lo creó) llega a 0 */
+struct archive_mapping
+{
+  atomic_uint refs;
+  void *addr;
+  size_t len;
+};
 
 /* Estructura que almacena un archivo de chat. Descripción breve de sus campos:
+   hdr    -> el tipo de mensaje y el número de mensajes (en bytes de red), que preceden a los mensajes
+             en la representación en cadena del archivo, es decir, en el formato que se envía a otros
    size   -> número de mensajes de chat en el archivo
-   str    -> representación en cadena de todo el archivo, en el formato que se envía a otros
-             (en bytes de red y demás)
    len    -> longitud de la representación en cadena del archivo, en bytes
-   offset -> almacena un desplazamiento desde el puntero base hasta donde se encuentra el mensaje 19
-             desde el final del archivo, para que podamos acceder fácilmente a la secuencia que
-             necesitamos hashear para agregar nuevos mensajes.
-             Este desplazamiento se define por primera vez al validar un archivo por primera vez,
-             y se actualiza si se agregan mensajes. */
+   segs   -> los segmentos con los mensajes: el mensaje i (comenzando en 1) está en el segmento
+             (i - 1) / ARCHIVE_SEG_MSGS, así que tanto el mensaje como su ventana de hash se encuentran
+             sin recorrer el archivo. Agregar un mensaje nunca mueve los anteriores: solo crece el
+             último segmento, y cuando se llena se empieza otro ('nsegs' segmentos, capacidad 'cap')
+   refs   -> número de referencias al archivo; se libera cuando llega a 0. Los archivos publicados
+             en un snapshot no se modifican nunca más, así que cualquier hilo que tenga una
+             referencia puede leerlos sin bloquearlos */
 struct archive
 {
-  uint8_t *str;
-  uint32_t offset;
+  uint8_t hdr[5];
   uint32_t size;
   uint32_t len;
+  struct archive_seg **segs;
+  uint32_t nsegs, cap;
+  atomic_uint refs;
+};
+
+/* Archivo compartido entre hilos: un puntero al archivo publicado, que se reemplaza de forma atómica
+   por otro archivo completo en lugar de modificarse. Los lectores protegen el puntero con un puntero
+   de riesgo mientras toman su referencia (ver hazard.h), así que quien reemplaza el archivo retira
+   el anterior en lugar de esperarlos. 'changed' se activa con cada publicación, para interrumpir el
+   minado de un mensaje sobre el archivo anterior */
+struct snapshot
+{
+  _Atomic(struct archive *) arch;
+  atomic_int changed;
 };
 
 /* Analiza el mensaje, verificando si todos los caracteres son válidos (imprimibles).
@@ -39,18 +99,212 @@ int parse_message(uint8_t *msg);
    al ser recibidos inicialmente. */
 int add_message(struct archive *arch, uint8_t *msg);
 
+/* Igual que add_message, pero el minado se interrumpe en cuanto la bandera 'cancel' se activa
+   (si no es NULL). Devuelve 1 si el mensaje se agregó, 0 si es inválido, o -1 si se interrumpió,
+   en cuyo caso el archivo no cambia */
+int add_message_cancellable(struct archive *arch, uint8_t *msg, const atomic_int *cancel);
+
+/* Estado intermedio ("midstate") del MD5 de una secuencia a minar. Los bloques completos de 64 bytes
+   que preceden al código no cambian entre intentos, así que se hashean una sola vez y guardamos el
+   estado resultante. Cada intento solo procesa la cola: los bytes restantes de la secuencia más
+   los 16 bytes del código (uno o dos bloques finales, contando el relleno de MD5).
+   st          -> estado MD5 tras procesar los bloques completos
+   tail        -> bloques finales con el relleno ya aplicado, y el espacio del código en cero
+   tail_len    -> número de bytes de la secuencia en 'tail' (siempre menor que 64)
+   tail_blocks -> número de bloques finales (1 o 2)
+   w           -> los bloques finales copiados en todos los carriles de md5x, para probar
+                  varios códigos a la vez reemplazando solo las palabras del código */
+struct md5_midstate
+{
+  uint32_t st[4];
+  uint8_t tail[128];
+  uint32_t tail_len;
+  uint32_t tail_blocks;
+  uint32_t w[2][16][MD5X_MAX_LANES];
+};
+
+/* Inicializa el midstate para la secuencia 'prefix' de longitud 'len', hasheando sus bloques completos */
+void midstate_init(struct md5_midstate *ms, const uint8_t *prefix, uint32_t len);
+
+/* Calcula el MD5 de la secuencia del midstate seguida del código de 16 bytes 'code' */
+void midstate_hash(struct md5_midstate *ms, const uint8_t *code, uint8_t *md5);
+
+/* Configura la dificultad de la prueba de trabajo: cuántos bytes nulos (0, 1 o 2) debe tener al comienzo
+   el hash de cada mensaje. El protocolo exige 2, que es el valor por defecto; las pruebas de rendimiento
+   la reducen para poder generar archivos sintéticos de millones de mensajes */
+void set_difficulty(unsigned zero_bytes);
+
+/* Configura el número de hilos que reparten la verificación de hashes de los archivos grandes.
+   Con 0 (el valor por defecto) se lanza un hilo por cada núcleo disponible. */
+void set_validator_threads(unsigned n);
+
+/* Prueba md5x_lanes() códigos consecutivos a partir de 'nonce' de una sola vez, uno por carril.
+   Devuelve el índice del primer código cuyo MD5 comienza con dos bytes nulos (y copia su hash
+   en 'md5'), o -1 si ninguno lo hace */
+int midstate_try_lanes(struct md5_midstate *ms, unsigned __int128 nonce, uint8_t *md5);
+
+/* Configura el número de hilos que add_message utiliza para minar el código de cada mensaje.
+   Con 0 (el valor por defecto) se lanza un hilo por cada núcleo disponible. */
+void set_miner_threads(unsigned n);
+
+/* Busca un código de 16 bytes tal que el MD5 de 'prefix' (de longitud 'len') seguido del código
+   comience con dos bytes nulos. El espacio de códigos de 128 bits se reparte entre los hilos
+   mineros configurados, y todos se detienen en cuanto uno encuentra un código válido.
+   El código encontrado se copia en 'code' y su hash en 'md5'. Si 'cancel' no es NULL, todos los
+   hilos abandonan la búsqueda en cuanto se activa. Devuelve 1 si encontró un código, o 0 si la
+   búsqueda se canceló antes */
+int mine_code(const uint8_t *prefix, uint32_t len, uint8_t *code, uint8_t *md5, const atomic_int *cancel);
+
 /* Dado un archivo de entrada, validamos los hashes MD5 de todos sus mensajes y
    determinamos si el archivo completo es válido o no. Devolvemos 1 si el archivo es válido,
    y 0 en caso contrario. */
 int is_valid(struct archive *arch);
 
+/* Valida un archivo de entrada confiando en el prefijo de mensajes idénticos (byte a byte) que comparte
+   con 'trusted', un archivo ya validado, de modo que solo se verifican los hashes de los mensajes
+   que siguen a ese prefijo. Devolvemos 1 si el archivo es válido, y 0 en caso contrario. */
+int is_valid_from(struct archive *arch, struct archive *trusted);
+
+/* Estado de un archivo que se recibe de un par y se valida mensaje a mensaje, a medida que llega,
+   en lugar de esperar a tenerlo completo. Descripción breve de sus campos:
+   arch    -> archivo en construcción, con los mensajes recibidos hasta ahora (salvo los que
+              coinciden con los de la referencia, mientras coinciden)
+   trusted -> archivo de referencia ya validado, o NULL si no hay ninguno o si un mensaje ya difirió
+   matched -> mensajes recibidos que coinciden con los primeros de 'trusted'. No se copian: al primer
+              mensaje distinto (o al terminar) el archivo comienza con un prefijo de 'trusted' que
+              comparte sus segmentos llenos
+   held    -> memoria de los segmentos propios del archivo en construcción (sus estructuras y búferes,
+              no solo los bytes de los mensajes), es decir, la memoria que ocupa la recepción hasta
+              ahora
+   pending -> los mensajes cuyo hash todavía no se verificó. Los hashes se verifican en lotes del
+              ancho del núcleo de md5x, así que a lo sumo quedan MD5X_MAX_LANES - 1 mensajes sin
+              verificar */
+struct archive_stream
+{
+  struct archive *arch;
+  struct archive *trusted;
+  uint32_t matched;
+  size_t held;
+  uint32_t pending[MD5X_MAX_LANES];
+  uint32_t npending;
+};
+
+/* Inicializa un archivo en recepción, inicialmente vacío. Mientras los mensajes recibidos coincidan
+   byte a byte con los de 'trusted' (un archivo ya validado del que se toma una referencia, o NULL si
+   no hay ninguno confiable) se aceptan sin calcular su hash */
+void stream_init(struct archive_stream *st, struct archive *trusted);
+
+/* Agrega al archivo en recepción el mensaje de 'len' caracteres, donde 'data' contiene el mensaje
+   seguido de sus 32 bytes de código y hash. A partir del primero que difiera de la referencia, se
+   valida cada mensaje con los 19 anteriores como ventana.
+   Devuelve 1 si el mensaje es válido (hasta donde se pudo verificar), 0 en caso contrario */
+int stream_push(struct archive_stream *st, uint8_t len, const uint8_t *data);
+
+/* Devuelve cuánto crecería 'held' si stream_push copiara un mensaje de 'len' caracteres: un segmento
+   nuevo entero, o lo que crezca el búfer del último. Si el mensaje coincide con la referencia no se
+   copia, así que esto es lo más que puede crecer */
+size_t stream_cost(const struct archive_stream *st, uint8_t len);
+
+/* Devuelve lo mínimo que crecería 'held' al recibir 'n' mensajes más, todos del tamaño mínimo (33
+   bytes) y copiados: sus bytes, más la estructura y la ventana copiada de cada segmento que
+   seguro llenan. Sirve para rechazar un encabezado que anuncia más mensajes de los que caben */
+size_t stream_min_cost(uint32_t n);
+
+/* Comienza el archivo en recepción con los primeros 'n' mensajes de 'base', un archivo ya validado,
+   sin verificarlos (compartiendo sus segmentos llenos). Se usa cuando el par solo envía los mensajes que siguen a un prefijo que ya tenemos */
+void stream_prefill(struct archive_stream *st, struct archive *base, uint32_t n);
+
+/* Termina la recepción: verifica los hashes pendientes y devuelve el archivo completo, listo para
+   agregar mensajes. Devuelve NULL (y libera el archivo) si algún hash es incorrecto */
+struct archive *stream_finish(struct archive_stream *st);
+
+/* Descarta un archivo en recepción, liberando su memoria y la referencia */
+void stream_abort(struct archive_stream *st);
+
+/* Devuelve el offset del mensaje número 'i' (comenzando en 1) dentro de la representación en cadena
+   del archivo. Con i = size + 1 devuelve la longitud del archivo */
+uint32_t message_offset(const struct archive *arch, uint32_t i);
+
+/* Devuelve el mensaje número 'i' (comenzando en 1) del archivo: su longitud, su contenido, su código
+   y su hash, contiguos */
+const uint8_t *archive_message(const struct archive *arch, uint32_t i);
+
+/* Devuelve el hash del mensaje número 'i' (comenzando en 1) del archivo */
+const uint8_t *archive_md5(const struct archive *arch, uint32_t i);
+
+/* Devuelve la ventana de hash del mensaje número 'i' (comenzando en 1): la secuencia contigua desde
+   el mensaje max(1, i - 19) hasta el código del mensaje i, cuya longitud se guarda en 'len'. El hash
+   del mensaje i está justo después */
+const uint8_t *archive_window(const struct archive *arch, uint32_t i, uint32_t *len);
+
+/* Agrega al final del archivo los 'n' mensajes consecutivos de 'msgs' (cada uno con su longitud,
+   contenido, código y hash), sin validarlos. Sirve para armar archivos que ya se sabe que son
+   válidos, como los guardados en disco */
+void archive_append(struct archive *arch, const uint8_t *msgs, uint32_t n);
+
+/* Crea el registro de un fichero mapeado con mmap, con una referencia para el llamador */
+struct archive_mapping *archive_mapping_new(void *addr, size_t len);
+
+/* Suelta una referencia a un fichero mapeado, desmapeándolo si era la última */
+void archive_mapping_unref(struct archive_mapping *map);
+
+/* Arma un archivo con los 'n' mensajes consecutivos de 'msgs', que está dentro del fichero mapeado
+   'map', sin validarlos, igual que archive_append. 'offsets' tiene el offset de cada mensaje dentro
+   de 'msgs', y 'len' es el fin del último, así que no hace falta leer los mensajes para separarlos:
+   los segmentos llenos apuntan directamente al fichero (tomando una referencia a 'map') y solo se
+   copian los mensajes del último segmento, si no está lleno. Los bytes a los que apuntan los
+   segmentos no deben cambiar mientras exista alguno */
+struct archive *archive_map(struct archive_mapping *map, const uint8_t *msgs, const uint32_t *offsets,
+                            uint32_t n, uint32_t len);
+
+/* Describe la representación en cadena del archivo, a partir del mensaje 'from' (comenzando en 1,
+   o 0 para incluir el tipo y el número de mensajes), con un vector por segmento que apunta a los
+   bytes del archivo, sin copiarlos. Si 'iov' es NULL solo cuenta los vectores. Devuelve el número
+   de vectores */
+uint32_t archive_iov(const struct archive *arch, uint32_t from, struct iovec *iov);
+
+/* Devuelve una copia contigua de la representación en cadena completa del archivo, de arch->len
+   bytes, que el llamador debe liberar con free. Para quien necesite el archivo en un solo búfer */
+uint8_t *archive_flatten(const struct archive *arch);
+
+/* Toma una referencia adicional al archivo y lo devuelve */
+struct archive *archive_ref(struct archive *arch);
+
+/* Suelta una referencia al archivo, liberándolo si era la última */
+void archive_unref(struct archive *arch);
+
+/* Devuelve una copia privada del archivo (con una referencia), que se puede modificar, por ejemplo
+   para agregarle mensajes, sin afectar a quienes leen el original. Los segmentos llenos se comparten
+   con el original, así que solo se copia el último */
+struct archive *archive_clone(const struct archive *arch);
+
+/* Como archive_clone, pero la copia tiene solo los primeros 'n' mensajes del archivo */
+struct archive *archive_prefix(const struct archive *arch, uint32_t n);
+
+/* Inicializa el snapshot con el archivo dado, cuya referencia pasa a ser del snapshot */
+void snapshot_init(struct snapshot *snap, struct archive *arch);
+
+/* Devuelve el archivo publicado en el snapshot, con una referencia que el llamador debe soltar con
+   archive_unref. Nunca bloquea */
+struct archive *snapshot_get(struct snapshot *snap);
+
+/* Publica 'arch' en el snapshot, solo si el archivo publicado sigue siendo 'expected'. El snapshot
+   toma su propia referencia a 'arch', el llamador conserva la suya. Devuelve 1 si se publicó, o 0 si
+   otro hilo publicó otro archivo mientras tanto. Nunca espera a los lectores: la referencia del
+   snapshot al archivo anterior se suelta cuando ya ninguno lo está tomando */
+int snapshot_publish(struct snapshot *snap, struct archive *expected, struct archive *arch);
+
+/* Agrega el mensaje al archivo publicado en el snapshot y publica el resultado. El minado se
+   interrumpe si otro hilo publica un archivo mientras tanto, y se reinicia sobre el nuevo, sin
+   perder el mensaje. Devuelve el archivo publicado (con una referencia para el llamador), o NULL si
+   el mensaje es inválido. Solo un hilo a la vez debe agregar mensajes a un mismo snapshot */
+struct archive *snapshot_add_message(struct snapshot *snap, uint8_t *msg);
+
 /* Imprime un archivo en el flujo dado, para depuración o actualización del archivo */
 void print_archive(struct archive *arch, FILE *stream);
 
 /* Inicializa una nueva estructura de archivo y la devuelve. Los archivos nuevos tienen tamaño 0,
    de modo que cualquier archivo nuevo y válido puede sobrescribirlos. Su representación en cadena es
    inicialmente de 5 caracteres de longitud, conteniendo solo el tipo de mensaje y los 4 bytes
-   que indican la cantidad de mensajes (que obviamente es 0).
-   El desplazamiento es inicialmente 5, ya que no hay mensajes en el archivo (obviamente), y
-   ignoramos los bytes de tipo y tamaño. */
+   que indican la cantidad de mensajes (que obviamente es 0), y no tiene segmentos. */
 struct archive *init_archive();
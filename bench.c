@@ -0,0 +1,1865 @@
+#include "net.h"         // Bucle de eventos, incluye también archive.h
+#include <time.h>        // clock_gettime, para medir tiempos
+#include <stdarg.h>      // va_list, para nombrar los casos de los resultados en JSON
+#include <fcntl.h>       // open, para silenciar la salida estándar del nodo
+#include <malloc.h>      // malloc_trim, para medir la memoria que reserva el nodo desde cero
+#include <openssl/evp.h> // MD5 de OpenSSL, como referencia de corrección y rendimiento
+
+/*
+   Programa de pruebas de rendimiento para las primitivas de los archivos de chat.
+   No forma parte del nodo, se compila y ejecuta con `make bench`.
+
+   Cada prueba repite la operación medida en lotes hasta superar un tiempo mínimo, para que
+   los resultados sean estables, e imprime una línea por caso con su rendimiento. Las que además
+   comprueban un resultado (los núcleos de md5x, la recepción de encabezados falsos y el
+   almacenamiento) hacen que el programa termine con un código distinto de 0 si fallan, y con
+   `./benchmark -c` (o `make test`) se ejecutan solo ellas. Con
+   `./benchmark -j resultados.json` (o `make bench-json`) además escribe cada valor medido en un
+   fichero JSON, para comparar los resultados entre versiones.
+*/
+
+/* Tiempo mínimo (en segundos) que se mide cada caso */
+#define BENCH_MIN_TIME 0.5
+
+/* Núcleos de md5x que se prueban (por su número de carriles; se saltan los que la CPU no soporta), y
+   mensajes de la ventana de la que check_md5x toma sus entradas: con 25 son 7168 bytes, que cubren
+   el desplazamiento de hasta 1023 bytes más los 6000 de la entrada más larga */
+#define MD5X_CHECK_MSGS 25
+static const unsigned kernels[] = {1, 4, 8, 16};
+
+/* Prueba de los backends de red: clientes conectados por loopback, y solicitudes de pares que
+   cada uno envía de una vez antes de leer las respuestas */
+#define NET_CLIENTS 64
+#define NET_BATCH 32
+
+/* Prueba de recepción con encabezados falsos: mensajes del archivo que el par envía y límite de
+   memoria por par del nodo */
+#define FORGED_MSGS 100000
+#define FORGED_PEER_LIMIT ((size_t)2 << 20)
+
+/* Margen sobre el límite por par que admitimos en el pico de memoria de esa prueba: lo que ocupan el
+   nodo y su conexión aunque no reciban ningún archivo (búferes de recepción, pilas de los hilos) y lo
+   que el asignador reserva además de los segmentos que cuenta el límite */
+#define FORGED_SLACK_KB 512
+
+/* Prueba del almacenamiento: mensajes del archivo guardado, y mensaje desde el que se separa la
+   bifurcación que se guarda encima (antes del último segmento, que se copia al cargar en lugar de
+   mapearse) */
+#define STORE_CHECK_MSGS 2000
+#define STORE_CHECK_FORK 100
+
+/* Prueba de la lista de pares: pares conectados, y hilos que leen la lista mientras otro la modifica */
+#define PEERS 10000
+#define PEER_READERS 3
+
+/* Prueba de las métricas: hilos que suman a la vez en un contador */
+#define METRIC_THREADS 4
+
+/* Prueba del registro: llamadas por ronda (que caben en el búfer del hilo sin descartar ninguna),
+   rondas, y volcados de un archivo de LOG_DUMP_MSGS mensajes */
+#define LOG_BATCH 8192
+#define LOG_ROUNDS 100
+#define LOG_DUMPS 100
+#define LOG_DUMP_MSGS 1000
+
+/* Devuelve el tiempo actual en segundos, con un reloj monótono */
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fichero de los resultados en JSON, o NULL si no se pidió, y resultados escritos hasta ahora */
+static FILE *json = NULL;
+static unsigned json_results = 0;
+
+/* Agrega un resultado al fichero JSON: la prueba, el caso (con el formato de printf), el valor
+   medido y su unidad. Los nombres son fijos del programa, sin caracteres que haya que escapar */
+static void result(const char *bench, const char *unit, double value, const char *fmt, ...)
+{
+  char name[128];
+  va_list ap;
+
+  if (json == NULL)
+  {
+    return;
+  }
+
+  va_start(ap, fmt);
+  vsnprintf(name, sizeof(name), fmt, ap);
+  va_end(ap);
+
+  fprintf(json, "%s\n    {\"bench\": \"%s\", \"case\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}",
+          json_results++ ? "," : "", bench, name, value, unit);
+}
+
+/* Construye la secuencia que se hashea al minar un mensaje con 'msgs' mensajes en la ventana:
+   msgs-1 mensajes completos de 255 caracteres (con código y hash) seguidos de un mensaje nuevo
+   de 255 caracteres al que le falta el código. Devuelve la secuencia y su longitud en 'len' */
+static uint8_t *build_window(uint32_t msgs, uint32_t *len)
+{
+  uint8_t *buf, *ptr;
+  uint32_t i;
+
+  *len = (msgs - 1) * 288 + 256;
+  buf = (uint8_t *)malloc(*len);
+  ptr = buf;
+
+  for (i = 0; i < msgs; i++)
+  {
+    *ptr++ = 255;
+    memset(ptr, 'a' + (i % 26), 255);
+    ptr += 255;
+
+    /* El último mensaje todavía no tiene código ni hash */
+    if (i + 1 < msgs)
+    {
+      memset(ptr, i, 32);
+      ptr += 32;
+    }
+  }
+
+  return buf;
+}
+
+/* MD5 de OpenSSL por la interfaz EVP. El contexto se crea una sola vez y se reutiliza, para que las
+   pruebas de rendimiento no midan su creación en cada llamada */
+static void openssl_md5(const uint8_t *data, size_t len, uint8_t *out)
+{
+  static EVP_MD_CTX *ctx = NULL;
+  if (ctx == NULL)
+  {
+    ctx = EVP_MD_CTX_new();
+  }
+  EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+  EVP_DigestUpdate(ctx, data, len);
+  EVP_DigestFinal_ex(ctx, out, NULL);
+}
+
+/* Camino original del minero: MD5 de toda la secuencia (con el código al final) en cada intento.
+   Devuelve el número de hashes por segundo */
+static double bench_full_md5(const uint8_t *window, uint32_t len)
+{
+  uint8_t *buf, md5[16];
+  unsigned __int128 nonce = 0;
+  uint64_t hashes = 0;
+  double start, elapsed;
+
+  buf = (uint8_t *)malloc(len + 16);
+  memcpy(buf, window, len);
+
+  start = now();
+  do
+  {
+    int i;
+    for (i = 0; i < 1024; i++, nonce++)
+    {
+      memcpy(buf + len, &nonce, 16);
+      openssl_md5(buf, len + 16, md5);
+    }
+    hashes += 1024;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  free(buf);
+  return hashes / elapsed;
+}
+
+/* Camino con midstate: los bloques completos se hashean una sola vez y cada intento
+   solo procesa la cola. Devuelve el número de hashes por segundo */
+static double bench_midstate(const uint8_t *window, uint32_t len)
+{
+  struct md5_midstate ms;
+  uint8_t md5[16];
+  unsigned __int128 nonce = 0;
+  uint64_t hashes = 0;
+  double start, elapsed;
+
+  midstate_init(&ms, window, len);
+
+  start = now();
+  do
+  {
+    int i;
+    for (i = 0; i < 1024; i++, nonce++)
+    {
+      midstate_hash(&ms, (uint8_t *)&nonce, md5);
+    }
+    hashes += 1024;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  return hashes / elapsed;
+}
+
+/* Camino con midstate y múltiples carriles: cada llamada prueba md5x_lanes() códigos a la vez.
+   Devuelve el número de hashes por segundo */
+static double bench_midstate_lanes(const uint8_t *window, uint32_t len)
+{
+  struct md5_midstate ms;
+  uint8_t md5[16];
+  unsigned __int128 nonce = 0;
+  unsigned lanes = md5x_lanes();
+  uint64_t hashes = 0;
+  double start, elapsed;
+
+  midstate_init(&ms, window, len);
+
+  start = now();
+  do
+  {
+    int i;
+    for (i = 0; i < 1024; i++, nonce += lanes)
+    {
+      midstate_try_lanes(&ms, nonce, md5);
+    }
+    hashes += 1024 * lanes;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  return hashes / elapsed;
+}
+
+/* Compara md5x_many, con el núcleo activo, con el MD5 de OpenSSL sobre entradas de longitudes
+   aleatorias (entre 0 y 6000 bytes, cubriendo las ventanas de validación). Devuelve el número de
+   resúmenes distintos */
+static unsigned check_md5x()
+{
+  const uint8_t *inputs[37];
+  uint32_t lens[37], len;
+  uint8_t out[37][16], ref[16];
+  unsigned round, i, bad = 0;
+  uint8_t *data = build_window(MD5X_CHECK_MSGS, &len);
+
+  srand(51511);
+  for (round = 0; round < 200; round++)
+  {
+    for (i = 0; i < 37; i++)
+    {
+      inputs[i] = data + (rand() % 1024);
+      lens[i] = (round == 0) ? i * 3 : (uint32_t)(rand() % 6000);
+    }
+
+    md5x_many(inputs, lens, out, 37);
+    for (i = 0; i < 37; i++)
+    {
+      openssl_md5(inputs[i], lens[i], ref);
+      if (memcmp(ref, out[i], 16) != 0)
+      {
+        bad++;
+      }
+    }
+  }
+
+  free(data);
+  return bad;
+}
+
+/* Ejecuta check_md5x con cada núcleo que soporta la CPU, y deja activo el que se elige por defecto.
+   Devuelve el número de núcleos con resúmenes distintos a los de OpenSSL */
+static int check_kernels()
+{
+  unsigned default_lanes = md5x_lanes();
+  int failed = 0;
+  uint32_t i;
+
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+  {
+    if (!md5x_select(kernels[i]))
+    {
+      continue;
+    }
+    unsigned bad = check_md5x();
+    fprintf(stdout, "md5x %-8s: %s\n", md5x_kernel_name(),
+            bad ? "RESULTADOS DISTINTOS A OPENSSL: FALLO" : "idéntico a openssl");
+    failed += bad != 0;
+  }
+  md5x_select(default_lanes);
+
+  return failed;
+}
+
+/* Rendimiento de md5x_many con ventanas de validación de 20 mensajes, en lotes de 16 entradas.
+   Devuelve los bytes hasheados por segundo */
+static double bench_md5x_many(const uint8_t *data, uint32_t len)
+{
+  const uint8_t *inputs[16];
+  uint32_t lens[16];
+  uint8_t out[16][16];
+  uint64_t bytes = 0;
+  double start, elapsed;
+  int i;
+
+  for (i = 0; i < 16; i++)
+  {
+    inputs[i] = data + i;
+    lens[i] = len - i;
+  }
+
+  start = now();
+  do
+  {
+    for (i = 0; i < 64; i++)
+    {
+      md5x_many(inputs, lens, out, 16);
+    }
+    bytes += 64 * 16 * (uint64_t)(len - 8);
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  return bytes / elapsed;
+}
+
+/* Rendimiento del MD5 de OpenSSL, una entrada a la vez, con las mismas ventanas */
+static double bench_openssl(const uint8_t *data, uint32_t len)
+{
+  uint8_t out[16];
+  uint64_t bytes = 0;
+  double start, elapsed;
+  int i;
+
+  start = now();
+  do
+  {
+    for (i = 0; i < 1024; i++)
+    {
+      openssl_md5(data + (i % 16), len - (i % 16), out);
+    }
+    bytes += 1024 * (uint64_t)(len - 8);
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  return bytes / elapsed;
+}
+
+/* Genera un archivo sintético válido de 'n' mensajes, de entre 20 y 60 caracteres. Con la dificultad
+   en 0 cualquier código es válido, así que no hay que minar: el hash de cada mensaje es simplemente
+   el MD5 de su ventana. El archivo se construye directamente, sin add_message, para no imprimir
+   cada mensaje ni minar. Los mensajes desde el número 'fork' (comenzando en 0) usan mayúsculas, así
+   que dos archivos con distinto 'fork' son bifurcaciones con un prefijo común */
+static struct archive *build_fork(uint32_t n, uint32_t fork)
+{
+  struct archive *arch = init_archive();
+  uint32_t window[20];
+  uint32_t i, len = 5;
+  uint8_t *str;
+
+  str = (uint8_t *)malloc(5 + (uint64_t)n * (33 + 60));
+
+  for (i = 0; i < n; i++)
+  {
+    uint8_t msglen = 20 + (i % 41);
+    uint32_t begin = (i >= 19) ? window[(i - 19) % 20] : 5;
+
+    window[i % 20] = len;
+    str[len] = msglen;
+    memset(str + len + 1, ((i < fork) ? 'a' : 'A') + (i % 26), msglen);
+    memset(str + len + 1 + msglen, 0, 16);
+    memcpy(str + len + 1 + msglen, &i, sizeof(i));
+    md5x(str + begin, len + msglen + 17 - begin, str + len + msglen + 17);
+
+    len += msglen + 33;
+  }
+
+  /* Los mensajes se arman en un búfer contiguo, donde es fácil calcular las ventanas, y luego se
+     agregan al archivo */
+  archive_append(arch, str + 5, n);
+  free(str);
+  return arch;
+}
+
+/* Genera un archivo sintético válido de 'n' mensajes, ver build_fork */
+static struct archive *build_archive(uint32_t n)
+{
+  return build_fork(n, n);
+}
+
+/* Devuelve 1 si los dos archivos tienen la misma representación en cadena */
+static int same_archive(const struct archive *a, const struct archive *b)
+{
+  if (a->len != b->len)
+  {
+    return 0;
+  }
+  uint8_t *sa = archive_flatten(a), *sb = archive_flatten(b);
+  int same = memcmp(sa, sb, a->len) == 0;
+  free(sa);
+  free(sb);
+  return same;
+}
+
+/* Valida un archivo completo con 'threads' hilos de validación, repitiendo hasta superar el tiempo
+   mínimo. Devuelve los mensajes validados por segundo, o 0 si el archivo resulta inválido */
+static double bench_is_valid(struct archive *arch, unsigned threads)
+{
+  uint64_t msgs = 0;
+  double start, elapsed;
+
+  set_validator_threads(threads);
+
+  start = now();
+  do
+  {
+    if (!is_valid(arch))
+    {
+      return 0;
+    }
+    msgs += arch->size;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  return msgs / elapsed;
+}
+
+/* Agrega un mensaje a una copia del archivo, como hace snapshot_add_message antes de minar, repitiendo
+   hasta superar el tiempo mínimo. Si 'flat', en cambio copia el archivo entero a un búfer contiguo,
+   que es lo que costaba la copia antes de dividir los archivos en segmentos. Devuelve los
+   microsegundos por copia */
+static double bench_append(struct archive *arch, int flat)
+{
+  uint8_t msg[33 + 40];
+  uint64_t ops = 0;
+  double start, elapsed;
+
+  memset(msg, 'x', sizeof(msg));
+  msg[0] = 40;
+
+  start = now();
+  do
+  {
+    if (flat)
+    {
+      free(archive_flatten(arch));
+    }
+    else
+    {
+      struct archive *next = archive_clone(arch);
+      archive_append(next, msg, 1);
+      archive_unref(next);
+    }
+    ops++;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  return elapsed * 1e6 / ops;
+}
+
+/* Analiza mensajes de 'len' caracteres con parse_message, repitiendo hasta superar el tiempo mínimo.
+   Devuelve los nanosegundos por mensaje */
+static double bench_parse_message(unsigned len)
+{
+  uint8_t msgs[16][257];
+  uint64_t ops = 0, chars = 0;
+  double start, elapsed;
+  unsigned i;
+
+  /* Mensajes como los que escribe el usuario, terminados en nueva línea */
+  for (i = 0; i < 16; i++)
+  {
+    memset(msgs[i], 'a' + i, len);
+    msgs[i][len] = '\n';
+    msgs[i][len + 1] = 0;
+  }
+
+  start = now();
+  do
+  {
+    for (i = 0; i < 16; i++)
+    {
+      chars += parse_message(msgs[i]);
+    }
+    ops += 16;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  return (chars == ops * len) ? elapsed * 1e9 / ops : 0;
+}
+
+/* Agrega un mensaje de 255 caracteres con add_message a copias de un archivo de 'window' - 1 mensajes,
+   así que el hash cubre una ventana de 'window' mensajes, repitiendo hasta superar el tiempo mínimo.
+   Con la dificultad en 0 el primer código ya es válido, así que se mide el costo propio de agregar
+   (reservar, copiar, hashear la ventana una vez y confirmar) y no la suerte del minado. Devuelve los
+   microsegundos por mensaje */
+static double bench_add_message(uint32_t window)
+{
+  struct archive *base = build_archive(window - 1);
+  uint8_t msg[257];
+  uint64_t ops = 0;
+  double start, elapsed = 0;
+
+  memset(msg, 'z', 255);
+  msg[255] = '\n';
+  msg[256] = 0;
+
+  /* add_message imprime el mensaje, el código y el hash, que no se muestran */
+  fflush(stdout);
+  int saved_out = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  start = now();
+  do
+  {
+    struct archive *next = archive_clone(base);
+    if (!add_message(next, msg))
+    {
+      archive_unref(next);
+      ops = 0;
+      break;
+    }
+    archive_unref(next);
+    ops++;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  fflush(stdout);
+  dup2(saved_out, STDOUT_FILENO);
+  close(saved_out);
+  archive_unref(base);
+
+  return ops ? elapsed * 1e6 / ops : 0;
+}
+
+/* La lista de pares como era antes de indexarla, para comparar: una lista enlazada que se recorre
+   para buscar o eliminar una IP, y cuya representación en cadena se reconstruye en cada cambio */
+struct ref_node
+{
+  uint32_t ip;
+  struct ref_node *next;
+};
+
+struct ref_list
+{
+  struct ref_node *head;
+  uint32_t size;
+  uint8_t *str;
+};
+
+static void ref_to_str(struct ref_list *list)
+{
+  struct ref_node *aux;
+  uint32_t i = 5;
+
+  free(list->str);
+  list->str = (uint8_t *)malloc(5 + list->size * 4);
+  list->str[0] = MSG_PEERLIST;
+  for (aux = list->head; aux != NULL; aux = aux->next, i += 4)
+  {
+    memcpy(list->str + i, &aux->ip, 4);
+  }
+}
+
+static void ref_add(struct ref_list *list, uint32_t ip)
+{
+  struct ref_node **link = &list->head;
+  while (*link != NULL)
+  {
+    link = &(*link)->next;
+  }
+  *link = (struct ref_node *)calloc(1, sizeof(struct ref_node));
+  (*link)->ip = ip;
+  list->size++;
+  ref_to_str(list);
+}
+
+static void ref_remove(struct ref_list *list, uint32_t ip)
+{
+  struct ref_node **link = &list->head;
+  while (*link != NULL && (*link)->ip != ip)
+  {
+    link = &(*link)->next;
+  }
+  if (*link != NULL)
+  {
+    struct ref_node *node = *link;
+    *link = node->next;
+    free(node);
+    list->size--;
+    ref_to_str(list);
+  }
+}
+
+static int ref_find(struct ref_list *list, uint32_t ip)
+{
+  struct ref_node *aux;
+  for (aux = list->head; aux != NULL && aux->ip != ip; aux = aux->next)
+  {
+  }
+  return aux != NULL;
+}
+
+/* Pares encontrados por la última prueba de búsqueda */
+static volatile uint64_t peers_found;
+
+/* Con PEERS pares conectados, desconecta uno al azar y conecta otro (o, si 'lookups', busca una IP al
+   azar, conectada o no) hasta superar el tiempo mínimo, con la lista indexada o con la de referencia.
+   Devuelve las operaciones por segundo */
+static double bench_peers(int indexed, int lookups)
+{
+  struct peer_list *list = init_list();
+  struct ref_list ref = {NULL, 0, NULL};
+  uint32_t ips[PEERS], next = PEERS + 1, i;
+  uint64_t ops = 0, found = 0;
+  double start, elapsed;
+
+  for (i = 0; i < PEERS; i++)
+  {
+    ips[i] = i + 1;
+    if (indexed)
+    {
+      add_peer(list, ips[i], i);
+    }
+    else
+    {
+      ref_add(&ref, ips[i]);
+    }
+  }
+
+  srand(1);
+  start = now();
+  do
+  {
+    for (i = 0; i < 64; i++)
+    {
+      uint32_t k = rand() % PEERS;
+      if (lookups)
+      {
+        uint32_t ip = rand() % (2 * next);
+        found += indexed ? is_connected(list, ip) : ref_find(&ref, ip);
+      }
+      else if (indexed)
+      {
+        remove_peer(list, ips[k], k);
+        ips[k] = next++;
+        add_peer(list, ips[k], k);
+      }
+      else
+      {
+        ref_remove(&ref, ips[k]);
+        ips[k] = next++;
+        ref_add(&ref, ips[k]);
+      }
+    }
+    ops += 64;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  free_list(list);
+  while (ref.head != NULL)
+  {
+    struct ref_node *node = ref.head;
+    ref.head = node->next;
+    free(node);
+  }
+  free(ref.str);
+  /* Las búsquedas se cuentan para que el compilador no las elimine */
+  peers_found = found;
+  return ops / elapsed;
+}
+
+/* Estado compartido de la prueba de lectores de la lista de pares */
+struct peer_readers
+{
+  struct peer_list *list;
+  pthread_mutex_t mutex;
+  int snapshot;
+  atomic_int done;
+  _Atomic uint64_t reads;
+};
+
+/* Lee la lista de pares como lo haría una respuesta a una solicitud de pares, hasta que termine la
+   prueba: con la copia publicada o, como antes, copiando la cadena con el mutex tomado */
+static void *peer_reader(void *arg)
+{
+  struct peer_readers *st = (struct peer_readers *)arg;
+  uint8_t *copy = (uint8_t *)malloc(5 + 4 * 2 * PEERS);
+  uint64_t reads = 0;
+
+  while (!atomic_load(&st->done))
+  {
+    if (st->snapshot)
+    {
+      struct peer_payload *payload = peerlist_get(st->list);
+      memcpy(copy, payload->data, payload->len);
+      peer_payload_unref(payload);
+    }
+    else
+    {
+      pthread_mutex_lock(&st->mutex);
+      memcpy(copy, st->list->str, 5 + 4 * st->list->size);
+      pthread_mutex_unlock(&st->mutex);
+    }
+    reads++;
+  }
+
+  free(copy);
+  atomic_fetch_add(&st->reads, reads);
+  return NULL;
+}
+
+/* Con PEERS pares conectados, PEER_READERS hilos leen la lista mientras este desconecta y conecta
+   pares al azar (publicando cada 64 cambios si 'snapshot', o con el mutex tomado en cada cambio si
+   no) hasta superar el tiempo mínimo. Devuelve las lecturas por segundo de todos los lectores */
+static double bench_peer_readers(int snapshot, double *changes)
+{
+  struct peer_readers st;
+  pthread_t threads[PEER_READERS];
+  uint32_t ips[PEERS], next = PEERS + 1, i;
+  uint64_t ops = 0;
+  double start, elapsed;
+
+  st.list = init_list();
+  pthread_mutex_init(&st.mutex, NULL);
+  st.snapshot = snapshot;
+  atomic_init(&st.done, 0);
+  atomic_init(&st.reads, 0);
+  for (i = 0; i < PEERS; i++)
+  {
+    ips[i] = i + 1;
+    add_peer(st.list, ips[i], i);
+  }
+  peerlist_publish(st.list);
+
+  for (i = 0; i < PEER_READERS; i++)
+  {
+    pthread_create(&threads[i], NULL, peer_reader, &st);
+  }
+
+  srand(1);
+  start = now();
+  do
+  {
+    for (i = 0; i < 64; i++)
+    {
+      uint32_t k = rand() % PEERS;
+      if (!snapshot)
+      {
+        pthread_mutex_lock(&st.mutex);
+      }
+      remove_peer(st.list, ips[k], k);
+      ips[k] = next++;
+      add_peer(st.list, ips[k], k);
+      if (!snapshot)
+      {
+        pthread_mutex_unlock(&st.mutex);
+      }
+    }
+    if (snapshot)
+    {
+      peerlist_publish(st.list);
+    }
+    ops += 64;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  atomic_store(&st.done, 1);
+  for (i = 0; i < PEER_READERS; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  elapsed = now() - start;
+
+  pthread_mutex_destroy(&st.mutex);
+  free_list(st.list);
+  *changes = ops / elapsed;
+  return atomic_load(&st.reads) / elapsed;
+}
+
+/* Registra LOG_ROUNDS rondas de LOG_BATCH mensajes como los del bucle de eventos: con el registro
+   asíncrono en un fichero ('mode' 0), con un nivel que no se registra (1), o formateándolos con
+   fprintf en el fichero, como antes (2). Entre rondas se espera a que el escritor vacíe el búfer,
+   sin contar esa espera. Devuelve los nanosegundos por llamada */
+static double bench_log(int mode)
+{
+  struct log_target *target = log_open("bench.log");
+  FILE *file = fopen("bench_fprintf.log", "w");
+  double elapsed = 0, start;
+  uint32_t round, i;
+
+  for (round = 0; round < LOG_ROUNDS; round++)
+  {
+    start = now();
+    for (i = 0; i < LOG_BATCH; i++)
+    {
+      if (mode == 0)
+      {
+        log_msg(LOG_INFO, target, "Rango de mensajes %u a %u del par %s.\n", i, i + 1000, "127.0.0.1");
+      }
+      else if (mode == 1)
+      {
+        log_msg(LOG_DEBUG, target, "Rango de mensajes %u a %u del par %s.\n", i, i + 1000, "127.0.0.1");
+      }
+      else
+      {
+        fprintf(file, "Rango de mensajes %u a %u del par %s.\n", i, i + 1000, "127.0.0.1");
+      }
+    }
+    elapsed += now() - start;
+    if (mode == 0)
+    {
+      usleep(3 * LOG_IDLE_US);
+    }
+  }
+
+  fclose(file);
+  log_close(target);
+  return elapsed * 1e9 / ((double)LOG_ROUNDS * LOG_BATCH);
+}
+
+/* Imprime el archivo volcado por el escritor de registros, y suelta su referencia */
+static void dump_archive(void *arch, FILE *file)
+{
+  print_archive((struct archive *)arch, file);
+}
+
+static void release_archive(void *arch)
+{
+  archive_unref((struct archive *)arch);
+}
+
+/* Vuelca LOG_DUMPS veces el archivo dado: con el registro asíncrono en un fichero ('async'), o
+   imprimiéndolo en el fichero en el mismo hilo, como antes. El tiempo del escritor no se cuenta.
+   Devuelve los microsegundos por volcado */
+static double bench_dump(struct archive *arch, int async)
+{
+  struct log_target *target = log_open("bench_dump.log");
+  FILE *file = fopen("bench_dump_fprintf.log", "w");
+  double start = now(), elapsed;
+  uint32_t i;
+
+  for (i = 0; i < LOG_DUMPS; i++)
+  {
+    if (async)
+    {
+      log_dump(LOG_INFO, target, dump_archive, release_archive, archive_ref(arch));
+    }
+    else
+    {
+      print_archive(arch, file);
+    }
+  }
+  elapsed = now() - start;
+
+  fclose(file);
+  log_close(target);
+  return elapsed * 1e6 / LOG_DUMPS;
+}
+
+/* Estado compartido por los hilos de la prueba de las métricas: si suman en las porciones de cada
+   hilo o en un único contador compartido, la bandera de fin y el total de sumas */
+struct metric_adders
+{
+  int sharded;
+  atomic_uint_fast64_t shared;
+  atomic_int done;
+  atomic_uint_fast64_t adds;
+};
+
+/* Suma de a uno en el contador hasta que se termine la prueba */
+static void *metric_adder(void *arg)
+{
+  struct metric_adders *st = (struct metric_adders *)arg;
+  uint64_t adds = 0;
+  uint32_t i;
+
+  while (!atomic_load_explicit(&st->done, memory_order_relaxed))
+  {
+    for (i = 0; i < 1024; i++)
+    {
+      if (st->sharded)
+      {
+        metrics_add(METRIC_BYTES_IN, 1);
+      }
+      else
+      {
+        atomic_fetch_add_explicit(&st->shared, 1, memory_order_relaxed);
+      }
+    }
+    adds += 1024;
+  }
+  atomic_fetch_add(&st->adds, adds);
+  return NULL;
+}
+
+/* Con METRIC_THREADS hilos sumando a la vez en un contador de las métricas ('sharded') o en un único
+   contador atómico compartido, durante el tiempo mínimo. Devuelve los nanosegundos por suma de cada
+   hilo */
+static double bench_metrics(int sharded)
+{
+  struct metric_adders st;
+  pthread_t threads[METRIC_THREADS];
+  uint32_t i;
+
+  st.sharded = sharded;
+  atomic_init(&st.shared, 0);
+  atomic_init(&st.done, 0);
+  atomic_init(&st.adds, 0);
+
+  double start = now();
+  for (i = 0; i < METRIC_THREADS; i++)
+  {
+    pthread_create(&threads[i], NULL, metric_adder, &st);
+  }
+  usleep((useconds_t)(BENCH_MIN_TIME * 1e6));
+  atomic_store(&st.done, 1);
+  for (i = 0; i < METRIC_THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now() - start;
+
+  return elapsed * 1e9 * METRIC_THREADS / atomic_load(&st.adds);
+}
+
+/* Lee del cliente hasta recibir 'count' listas de pares, o con 'count' en 0 hasta recibir una respuesta
+   de rango (y todas las listas que la preceden), ignorando los HELLO y las solicitudes de pares del
+   nodo. Devuelve 0, o -1 si el nodo cerró la conexión o envió algo inesperado */
+static int read_peerlists(int sock, unsigned count)
+{
+  static uint8_t buf[65536];
+  size_t have = 0, pos = 0;
+  int until_range = (count == 0);
+
+  if (until_range)
+  {
+    count = 1;
+  }
+
+  while (count > 0)
+  {
+    /* Procesa los mensajes completos que ya tenemos */
+    while (count > 0 && pos < have)
+    {
+      if (buf[pos] == MSG_HELLO || buf[pos] == MSG_PEERREQ)
+      {
+        pos++;
+        continue;
+      }
+      if (until_range && buf[pos] == MSG_RANGERESP)
+      {
+        /* El encabezado y los mensajes de la respuesta, que son pocos y caben en el búfer */
+        size_t end = pos + 25;
+        uint32_t msgs;
+        if (have < end)
+        {
+          break;
+        }
+        msgs = (((uint32_t)buf[pos + 1] << 24) | (buf[pos + 2] << 16) | (buf[pos + 3] << 8) | buf[pos + 4]) -
+               (((uint32_t)buf[pos + 5] << 24) | (buf[pos + 6] << 16) | (buf[pos + 7] << 8) | buf[pos + 8]);
+        while (msgs > 0 && end < have)
+        {
+          end += 1 + buf[end] + 32;
+          msgs--;
+        }
+        if (msgs > 0 || end > have)
+        {
+          break;
+        }
+        pos = end;
+        count--;
+        continue;
+      }
+      if (buf[pos] != MSG_PEERLIST)
+      {
+        return -1;
+      }
+      if (have - pos < 5)
+      {
+        break;
+      }
+      uint32_t n = ((uint32_t)buf[pos + 1] << 24) | (buf[pos + 2] << 16) | (buf[pos + 3] << 8) | buf[pos + 4];
+      if (have - pos < 5 + 4 * (size_t)n)
+      {
+        break;
+      }
+      pos += 5 + 4 * (size_t)n;
+      if (!until_range)
+      {
+        count--;
+      }
+    }
+    if (count == 0)
+    {
+      break;
+    }
+
+    /* Guarda el mensaje incompleto al principio del búfer y lee más */
+    memmove(buf, buf + pos, have - pos);
+    have -= pos;
+    pos = 0;
+    ssize_t got = recv(sock, buf + have, sizeof(buf) - have, 0);
+    if (got <= 0)
+    {
+      return -1;
+    }
+    have += got;
+  }
+
+  return 0;
+}
+
+/* Detiene el bucle de eventos lanzado en 'thread' y libera sus recursos. Las pruebas de red lo llaman
+   también cuando fallan, para que el bucle no siga corriendo mientras la siguiente prueba crea otro */
+static void stop_node(pthread_t thread)
+{
+  net_stop();
+  pthread_join(thread, NULL);
+  net_cleanup();
+}
+
+/* Mide un backend de red: lanza el bucle de eventos, conecta NET_CLIENTS clientes por loopback (cada
+   uno desde su propia IP, para que el nodo los trate como pares distintos), y repite rondas en que
+   cada cliente envía NET_BATCH solicitudes de pares y lee las respuestas. El nodo reemplaza las listas
+   de pares que todavía no empezó a enviar por la más nueva, así que cada ronda termina con una
+   solicitud de rango, que siempre se responde, y el cliente lee hasta esa respuesta (el archivo
+   activo debe tener algún mensaje). Devuelve las solicitudes de pares atendidas por segundo, las
+   llamadas al sistema del bucle por solicitud en 'syscalls' y el backend que se usó en 'used', o 0
+   si no se pudo medir */
+static double bench_backend(const char *name, double *syscalls, const char **used)
+{
+  int socks[NET_CLIENTS];
+  uint8_t reqs[NET_BATCH + 21];
+  uint64_t msgs = 0, calls;
+  double start, elapsed;
+  unsigned i;
+  pthread_t thread;
+
+  net_set_backend(name);
+  if (net_init() == -1)
+  {
+    return 0;
+  }
+  *used = net_backend_name();
+  pthread_create(&thread, NULL, net_loop, NULL);
+
+  struct sockaddr_in node;
+  memset(&node, 0, sizeof(node));
+  node.sin_family = AF_INET;
+  node.sin_port = htons(TCP_PORT_NUM);
+  node.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (i = 0; i < NET_CLIENTS; i++)
+  {
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(0x7f000100 + i + 1);
+
+    socks[i] = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(socks[i], (struct sockaddr *)&local, sizeof(local)) == -1 ||
+        connect(socks[i], (struct sockaddr *)&node, sizeof(node)) == -1)
+    {
+      fprintf(stderr, "No se pudo conectar el cliente %u al nodo!\n", i);
+      do
+      {
+        close(socks[i]);
+      } while (i-- > 0);
+      stop_node(thread);
+      return 0;
+    }
+  }
+
+  /* Una ronda de calentamiento, para que todos los clientes estén en la lista de pares. Las rondas
+     terminan con una solicitud de rango desde el comienzo del archivo */
+  memset(reqs, MSG_PEERREQ, NET_BATCH);
+  memset(reqs + NET_BATCH, 0, 21);
+  reqs[NET_BATCH] = MSG_RANGEREQ;
+  for (i = 0; i < NET_CLIENTS; i++)
+  {
+    send(socks[i], reqs, 1, 0);
+    read_peerlists(socks[i], 1);
+  }
+
+  calls = __atomic_load_n(&net_syscalls, __ATOMIC_RELAXED);
+  start = now();
+  do
+  {
+    for (i = 0; i < NET_CLIENTS; i++)
+    {
+      send(socks[i], reqs, sizeof(reqs), 0);
+    }
+    for (i = 0; i < NET_CLIENTS; i++)
+    {
+      if (read_peerlists(socks[i], 0) == -1)
+      {
+        fprintf(stderr, "El nodo cerró la conexión del cliente %u!\n", i);
+        for (i = 0; i < NET_CLIENTS; i++)
+        {
+          close(socks[i]);
+        }
+        stop_node(thread);
+        return 0;
+      }
+    }
+    msgs += NET_CLIENTS * NET_BATCH;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+  calls = __atomic_load_n(&net_syscalls, __ATOMIC_RELAXED) - calls;
+
+  for (i = 0; i < NET_CLIENTS; i++)
+  {
+    close(socks[i]);
+  }
+  stop_node(thread);
+
+  *syscalls = (double)calls / msgs;
+  return msgs / elapsed;
+}
+
+/* Devuelve el valor en KB del campo dado ("VmRSS:", "VmHWM:") de /proc/self/status, o 0 si no está */
+static long proc_status_kb(const char *field)
+{
+  char line[128];
+  long kb = 0;
+  FILE *f = fopen("/proc/self/status", "r");
+
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL)
+  {
+    if (strncmp(line, field, strlen(field)) == 0)
+    {
+      kb = atol(line + strlen(field));
+      break;
+    }
+  }
+  if (f != NULL)
+  {
+    fclose(f);
+  }
+  return kb;
+}
+
+/* Envía a un nodo local, con el límite de memoria por par dado, una respuesta de archivo que anuncia
+   'claimed' mensajes seguida de los 'len' bytes de mensajes de 'body', y espera a que el nodo la
+   procese o cierre la conexión. Devuelve cuánto creció el pico de memoria residente del proceso
+   (en KB), o -1 si no se pudo medir; en 'size' deja el tamaño del archivo activo al terminar, que
+   sigue vacío si el nodo rechazó el archivo */
+static long bench_forged(uint32_t claimed, const uint8_t *body, size_t len, size_t limit, uint32_t *size)
+{
+  uint8_t hdr[5] = {MSG_ARCHRESP, claimed >> 24, claimed >> 16, claimed >> 8, claimed};
+  uint8_t buf[4096];
+  pthread_t thread;
+  int sock;
+
+  /* El pico de memoria residente se reinicia al valor actual, sin la memoria libre que la
+     biblioteca de C todavía no devolvió */
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd == -1)
+  {
+    return -1;
+  }
+
+  net_set_rx_limits(limit, RX_TOTAL_LIMIT);
+  net_set_backend("epoll");
+  if (net_init() == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  pthread_create(&thread, NULL, net_loop, NULL);
+
+  malloc_trim(0);
+  if (write(fd, "5", 1) != 1)
+  {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  long before = proc_status_kb("VmRSS:");
+
+  struct sockaddr_in node;
+  memset(&node, 0, sizeof(node));
+  node.sin_family = AF_INET;
+  node.sin_port = htons(TCP_PORT_NUM);
+  node.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(sock, (struct sockaddr *)&node, sizeof(node)) == -1)
+  {
+    close(sock);
+    stop_node(thread);
+    return -1;
+  }
+
+  /* Si el nodo rechaza el archivo a mitad de camino, el envío falla y dejamos de enviar */
+  send(sock, hdr, sizeof(hdr), MSG_NOSIGNAL);
+  while (len > 0)
+  {
+    ssize_t sent = send(sock, body, len, MSG_NOSIGNAL);
+    if (sent <= 0)
+    {
+      break;
+    }
+    body += sent;
+    len -= sent;
+  }
+
+  /* Cerramos nuestra mitad de la conexión: el nodo termina de procesar lo recibido y la cierra */
+  shutdown(sock, SHUT_WR);
+  while (recv(sock, buf, sizeof(buf), 0) > 0)
+  {
+  }
+  close(sock);
+
+  long peak = proc_status_kb("VmHWM:");
+  stop_node(thread);
+
+  struct archive *arch = snapshot_get(&active_arch);
+  *size = arch->size;
+  archive_unref(arch);
+  return peak - before;
+}
+
+/* Hilo que envía una y otra vez la respuesta de archivo dada por el socket, hasta que el otro
+   extremo cierra la conexión */
+struct resend_args
+{
+  int sock;
+  const uint8_t *data;
+  size_t len;
+};
+
+static void *resend_thread(void *arg)
+{
+  struct resend_args *args = (struct resend_args *)arg;
+
+  for (;;)
+  {
+    const uint8_t *data = args->data;
+    size_t len = args->len;
+    while (len > 0)
+    {
+      ssize_t sent = send(args->sock, data, len, MSG_NOSIGNAL);
+      if (sent <= 0)
+      {
+        return NULL;
+      }
+      data += sent;
+      len -= sent;
+    }
+  }
+}
+
+/* Recibe exactamente 'len' bytes del socket con una llamada, contándola en 'calls'. Devuelve 0, o -1
+   si la conexión se cerró o hubo un error */
+static int recv_field(int sock, uint8_t *buf, size_t len, uint64_t *calls)
+{
+  (*calls)++;
+  return (recv(sock, buf, len, MSG_WAITALL) == (ssize_t)len) ? 0 : -1;
+}
+
+/* Lectura de respuestas de archivo campo por campo, como hacía el nodo antes del bucle de eventos:
+   una llamada a recv para el tipo, otra para el tamaño y tres por mensaje (longitud, mensaje, código y
+   hash). Devuelve los mensajes leídos por segundo, y en 'syscalls' las llamadas por mensaje */
+static double bench_field_reader(const uint8_t *resp, size_t len, double *syscalls)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  uint8_t buf[288];
+  uint64_t msgs = 0, calls = 0;
+  double start, elapsed;
+  pthread_t thread;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int lsock = socket(AF_INET, SOCK_STREAM, 0);
+  int wsock = socket(AF_INET, SOCK_STREAM, 0);
+  if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lsock, 1) == -1 ||
+      getsockname(lsock, (struct sockaddr *)&addr, &addrlen) == -1 ||
+      connect(wsock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    return 0;
+  }
+  int rsock = accept(lsock, NULL, NULL);
+  close(lsock);
+
+  struct resend_args args = {wsock, resp, len};
+  pthread_create(&thread, NULL, resend_thread, &args);
+
+  start = now();
+  do
+  {
+    if (recv_field(rsock, buf, 5, &calls) == -1)
+    {
+      return 0;
+    }
+    uint32_t n = ((uint32_t)buf[1] << 24) | (buf[2] << 16) | (buf[3] << 8) | buf[4];
+    while (n-- > 0)
+    {
+      if (recv_field(rsock, buf, 1, &calls) == -1 || recv_field(rsock, buf + 1, buf[0], &calls) == -1 ||
+          recv_field(rsock, buf + 1 + buf[0], 32, &calls) == -1)
+      {
+        return 0;
+      }
+      msgs++;
+    }
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+
+  close(rsock);
+  pthread_join(thread, NULL);
+  close(wsock);
+
+  *syscalls = (double)calls / msgs;
+  return msgs / elapsed;
+}
+
+/* Lectura de respuestas de archivo por el bucle de eventos de un nodo local con el backend dado. El
+   nodo ya tiene el archivo, así que lo descarta a medida que llega, y solo se mide el analizador. Tras
+   cada archivo, el cliente pide la lista de pares y espera la respuesta, para saber que el nodo ya lo
+   procesó. Devuelve los mensajes leídos por segundo, y en 'syscalls' las llamadas por mensaje */
+static double bench_node_reader(const char *name, const uint8_t *resp, size_t len, uint32_t size,
+                                double *syscalls, const char **used)
+{
+  uint8_t req = MSG_PEERREQ;
+  uint64_t msgs = 0, calls;
+  double start, elapsed;
+  pthread_t thread;
+
+  net_set_backend(name);
+  if (net_init() == -1)
+  {
+    return 0;
+  }
+  *used = net_backend_name();
+  pthread_create(&thread, NULL, net_loop, NULL);
+
+  struct sockaddr_in node;
+  memset(&node, 0, sizeof(node));
+  node.sin_family = AF_INET;
+  node.sin_port = htons(TCP_PORT_NUM);
+  node.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(sock, (struct sockaddr *)&node, sizeof(node)) == -1)
+  {
+    close(sock);
+    stop_node(thread);
+    return 0;
+  }
+
+  calls = __atomic_load_n(&net_syscalls, __ATOMIC_RELAXED);
+  start = now();
+  do
+  {
+    size_t left = len;
+    const uint8_t *data = resp;
+    while (left > 0)
+    {
+      ssize_t sent = send(sock, data, left, MSG_NOSIGNAL);
+      if (sent <= 0)
+      {
+        close(sock);
+        stop_node(thread);
+        return 0;
+      }
+      data += sent;
+      left -= sent;
+    }
+    send(sock, &req, 1, MSG_NOSIGNAL);
+    if (read_peerlists(sock, 1) == -1)
+    {
+      close(sock);
+      stop_node(thread);
+      return 0;
+    }
+    msgs += size;
+    elapsed = now() - start;
+  } while (elapsed < BENCH_MIN_TIME);
+  calls = __atomic_load_n(&net_syscalls, __ATOMIC_RELAXED) - calls;
+
+  close(sock);
+  stop_node(thread);
+
+  *syscalls = (double)calls / msgs;
+  return msgs / elapsed;
+}
+
+/* Envía al nodo local el archivo 'honest' (en cadena en 'body') con encabezados falsos y con el
+   verdadero, y comprueba que los falsos se rechacen sin que el pico de memoria supere el límite por
+   par más FORGED_SLACK_KB, y que el verdadero se acepte. Imprime una línea por caso y devuelve el
+   número de casos que fallaron */
+static int check_forged(const struct archive *honest, const uint8_t *body)
+{
+  struct
+  {
+    const char *name;
+    uint32_t claimed;
+    size_t limit;
+    int accept;
+  } forged[] = {
+      {"anuncia 4294967295 mensajes", 0xFFFFFFFF, FORGED_PEER_LIMIT, 0},
+      {"anuncia 50000, envía más", FORGED_MSGS / 2, FORGED_PEER_LIMIT, 0},
+      {"archivo real, límite por defecto", FORGED_MSGS, RX_PEER_LIMIT, 1},
+  };
+  int failed = 0;
+  unsigned i;
+
+  fprintf(stdout, "\n---------- Recepción: encabezados falsos, límite de %zu MB por par ----------\n",
+          FORGED_PEER_LIMIT >> 20);
+
+  /* Los casos comienzan con el archivo activo vacío */
+  struct archive *active = snapshot_get(&active_arch), *empty = init_archive();
+  snapshot_publish(&active_arch, active, empty);
+  archive_unref(active);
+  archive_unref(empty);
+
+  for (i = 0; i < sizeof(forged) / sizeof(forged[0]); i++)
+  {
+    uint32_t size = 0;
+    fflush(stdout);
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+
+    log_start(LOG_INFO);
+    long growth = bench_forged(forged[i].claimed, body + 5, honest->len - 5, forged[i].limit, &size);
+
+    log_stop();
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    if (growth == -1)
+    {
+      fprintf(stdout, "no disponible (%s)\n", forged[i].name);
+      continue;
+    }
+
+    int accepted = size > 0;
+    int ok = accepted == forged[i].accept && (size_t)growth <= (forged[i].limit >> 10) + FORGED_SLACK_KB;
+    fprintf(stdout, "%u msgs enviados (%u bytes): pico de memoria +%6ld KB, %-9s (%s)%s\n", FORGED_MSGS,
+            honest->len - 5, growth, accepted ? "aceptado" : "rechazado", forged[i].name, ok ? "" : ": FALLO");
+    result("forged_headers", "KB", growth, "claims %u msgs", forged[i].claimed);
+    failed += !ok;
+  }
+
+  return failed;
+}
+
+/* Guarda un archivo en el almacenamiento y comprueba que se vuelva a cargar idéntico. Después, con el
+   archivo cargado todavía en uso (sus segmentos apuntan al fichero mapeado), guarda encima una
+   bifurcación que se separa antes de los mensajes mapeados, y comprueba que el archivo cargado no
+   cambie y que al reabrir se cargue la bifurcación. Imprime una línea por comprobación y devuelve el
+   número de las que fallaron */
+static int check_store()
+{
+  struct archive *saved = build_archive(STORE_CHECK_MSGS);
+  struct archive *fork = build_fork(STORE_CHECK_MSGS + 1, STORE_CHECK_FORK), *loaded = NULL, *reloaded = NULL;
+  struct store *st;
+  int ok[3] = {0, 0, 0}, failed = 0;
+
+  fprintf(stdout, "\n---------- Almacenamiento: guardar y volver a cargar ----------\n");
+  unlink("check.dat");
+  unlink("check.dat.idx");
+  st = store_open("check.dat", STORE_SYNC_NEVER, &loaded);
+  if (st != NULL)
+  {
+    archive_unref(loaded);
+    store_save(st, saved);
+    store_close(st);
+
+    st = store_open("check.dat", STORE_SYNC_NEVER, &loaded);
+    ok[0] = same_archive(saved, loaded);
+    store_save(st, fork);
+    ok[1] = same_archive(saved, loaded);
+    store_close(st);
+
+    st = store_open("check.dat", STORE_SYNC_NEVER, &reloaded);
+    ok[2] = same_archive(fork, reloaded);
+    store_close(st);
+    archive_unref(loaded);
+    archive_unref(reloaded);
+  }
+
+  fprintf(stdout, "%u msgs guardados y cargados: %s\n", STORE_CHECK_MSGS, ok[0] ? "idéntico" : "DISTINTO: FALLO");
+  fprintf(stdout, "bifurcación desde el mensaje %u guardada: archivo cargado antes %s\n", STORE_CHECK_FORK + 1,
+          ok[1] ? "sin cambios" : "MODIFICADO: FALLO");
+  fprintf(stdout, "bifurcación cargada al reabrir: %s\n", ok[2] ? "idéntica" : "DISTINTA: FALLO");
+  failed = !ok[0] + !ok[1] + !ok[2];
+
+  unlink("check.dat");
+  unlink("check.dat.idx");
+  archive_unref(saved);
+  archive_unref(fork);
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned default_lanes = md5x_lanes();
+  uint32_t sizes[] = {1, 5, 10, 20};
+  uint32_t i;
+  int opt, checks_only = 0, failed = 0;
+
+  while ((opt = getopt(argc, argv, "j:c")) != -1)
+  {
+    if (opt == 'c')
+    {
+      checks_only = 1;
+      continue;
+    }
+    if (opt != 'j')
+    {
+      fprintf(stderr, "Uso: %s [-j resultados.json] [-c]\n", argv[0]);
+      return 1;
+    }
+    if ((json = fopen(optarg, "w")) == NULL)
+    {
+      fprintf(stderr, "No se pudo crear %s!\n", optarg);
+      return 1;
+    }
+  }
+
+  /* Con -c (`make test`) solo se ejecutan las pruebas que comprueban algo, y no se mide nada más */
+  if (checks_only)
+  {
+    char tmpdir[] = "/tmp/benchXXXXXX";
+    if (mkdtemp(tmpdir) == NULL || chdir(tmpdir) == -1)
+    {
+      fprintf(stderr, "No se pudo crear la carpeta temporal!\n");
+      return 1;
+    }
+    peerlist = init_list();
+    snapshot_init(&active_arch, init_archive());
+    set_difficulty(0);
+
+    struct archive *honest = build_archive(FORGED_MSGS);
+    uint8_t *body = archive_flatten(honest);
+    failed = check_kernels() + check_forged(honest, body) + check_store();
+    free(body);
+    archive_unref(honest);
+    return failed ? 1 : 0;
+  }
+
+  /* Los resultados llevan los datos de la máquina que influyen en ellos, para comparar solo los que
+     se midieron en las mismas condiciones */
+  if (json != NULL)
+  {
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    fprintf(json, "{\n  \"host\": \"%s\",\n  \"cores\": %ld,\n  \"md5x\": \"%s\",\n  \"time\": %ld,\n  \"results\": [",
+            host, sysconf(_SC_NPROCESSORS_ONLN), md5x_kernel_name(), (long)time(NULL));
+  }
+
+  fprintf(stdout, "---------- Minado: MD5 completo vs midstate ----------\n");
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    uint32_t len;
+    uint8_t *window = build_window(sizes[i], &len);
+
+    double full = bench_full_md5(window, len);
+    double mid = bench_midstate(window, len);
+
+    fprintf(stdout, "ventana %2u msgs (%5u bytes): completo %10.0f h/s, midstate %10.0f h/s, x%.1f\n",
+            sizes[i], len, full, mid, mid / full);
+    result("mine", "hashes/s", full, "window %u, full md5", sizes[i]);
+    result("mine", "hashes/s", mid, "window %u, midstate", sizes[i]);
+    free(window);
+  }
+
+  /* Todos los núcleos de md5x disponibles, contra OpenSSL */
+  uint32_t len;
+  uint8_t *window = build_window(20, &len);
+
+  fprintf(stdout, "\n---------- md5x: núcleos de múltiples carriles (activo: %s) ----------\n",
+          md5x_kernel_name());
+  double ssl = bench_openssl(window, len);
+  fprintf(stdout, "openssl:  %8.1f MB/s\n", ssl / 1e6);
+  result("md5x", "MB/s", ssl / 1e6, "openssl");
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+  {
+    if (!md5x_select(kernels[i]))
+    {
+      continue;
+    }
+
+    unsigned bad = check_md5x();
+    failed += bad != 0;
+    double many = bench_md5x_many(window, len);
+    double mine = bench_midstate_lanes(window, len);
+
+    fprintf(stdout, "%-8s: %8.1f MB/s validando, %10.0f h/s minando, %s\n", md5x_kernel_name(),
+            many / 1e6, mine, bad ? "RESULTADOS DISTINTOS A OPENSSL" : "idéntico a openssl");
+    result("md5x", "MB/s", many / 1e6, "%s, validate", md5x_kernel_name());
+    result("md5x", "hashes/s", mine, "%s, mine", md5x_kernel_name());
+  }
+  md5x_select(default_lanes);
+  free(window);
+
+  /* Validación de archivos sintéticos de 1k a 1M mensajes, secuencial y repartida entre núcleos */
+  uint32_t archive_sizes[] = {1000, 10000, 100000, 1000000};
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  fprintf(stdout, "\n---------- is_valid: secuencial vs paralelo (%ld núcleos) ----------\n", cores);
+  set_difficulty(0);
+  for (i = 0; i < sizeof(archive_sizes) / sizeof(archive_sizes[0]); i++)
+  {
+    struct archive *arch = build_archive(archive_sizes[i]);
+
+    double serial = bench_is_valid(arch, 1);
+    double parallel = bench_is_valid(arch, 0);
+
+    fprintf(stdout, "%7u msgs (%9u bytes): 1 hilo %10.0f msgs/s, %ld hilos %10.0f msgs/s, x%.1f\n",
+            archive_sizes[i], arch->len, serial, cores, parallel, parallel / serial);
+    result("is_valid", "msgs/s", serial, "%u msgs, 1 thread", archive_sizes[i]);
+    result("is_valid", "msgs/s", parallel, "%u msgs, %ld threads", archive_sizes[i], cores);
+
+    archive_unref(arch);
+  }
+  set_validator_threads(0);
+
+  /* Copiar el archivo para agregarle un mensaje: con segmentos solo se copia el último */
+  fprintf(stdout, "\n---------- Copia para agregar un mensaje: segmentos vs búfer contiguo ----------\n");
+  for (i = 0; i < sizeof(archive_sizes) / sizeof(archive_sizes[0]); i++)
+  {
+    struct archive *arch = build_archive(archive_sizes[i]);
+
+    double segmented = bench_append(arch, 0);
+    double flat = bench_append(arch, 1);
+
+    fprintf(stdout, "%7u msgs: segmentos %9.2f us, contiguo %9.2f us, x%.0f\n", archive_sizes[i], segmented,
+            flat, flat / segmented);
+    result("append", "us", segmented, "%u msgs, segments", archive_sizes[i]);
+    result("append", "us", flat, "%u msgs, flat", archive_sizes[i]);
+    archive_unref(arch);
+  }
+
+  /* add_message según el tamaño de la ventana que cubre el hash, con un solo hilo minero */
+  fprintf(stdout, "\n---------- add_message: mensajes de 255 caracteres según la ventana ----------\n");
+  set_miner_threads(1);
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    double add = bench_add_message(sizes[i]);
+    fprintf(stdout, "ventana %2u msgs: %8.2f us/msg\n", sizes[i], add);
+    result("add_message", "us", add, "window %u", sizes[i]);
+  }
+  set_miner_threads(0);
+
+  /* parse_message según la longitud del mensaje */
+  unsigned msg_lengths[] = {20, 60, 255};
+
+  fprintf(stdout, "\n---------- parse_message: según la longitud del mensaje ----------\n");
+  for (i = 0; i < sizeof(msg_lengths) / sizeof(msg_lengths[0]); i++)
+  {
+    double parse = bench_parse_message(msg_lengths[i]);
+    fprintf(stdout, "%3u caracteres: %8.1f ns/msg\n", msg_lengths[i], parse);
+    result("parse_message", "ns", parse, "%u chars", msg_lengths[i]);
+  }
+
+  /* Lista de pares: tabla hash con la cadena actualizada en su lugar, contra la lista enlazada */
+  fprintf(stdout, "\n---------- Lista de pares: %d pares, tabla hash vs lista enlazada ----------\n", PEERS);
+  for (i = 0; i < 2; i++)
+  {
+    double table = bench_peers(1, i), list = bench_peers(0, i);
+    fprintf(stdout, "tabla %10.0f ops/s, lista %10.0f ops/s, x%-5.0f (%s)\n", table, list, table / list,
+            i ? "búsqueda" : "desconexión y conexión");
+    result("peerlist", "ops/s", table, "%d peers, %s, hash table", PEERS, i ? "lookup" : "remove and add");
+    result("peerlist", "ops/s", list, "%d peers, %s, linked list", PEERS, i ? "lookup" : "remove and add");
+  }
+
+  /* Respuestas a solicitudes de pares mientras la lista cambia: copia publicada contra mutex */
+  fprintf(stdout, "\n---------- Lista de pares: %d lectores y un escritor, copia publicada vs mutex ----------\n",
+          PEER_READERS);
+  {
+    double snap_changes, mutex_changes;
+    double snap = bench_peer_readers(1, &snap_changes), locked = bench_peer_readers(0, &mutex_changes);
+    fprintf(stdout, "copia publicada %10.0f lecturas/s, %10.0f cambios/s\n", snap, snap_changes);
+    fprintf(stdout, "mutex           %10.0f lecturas/s, %10.0f cambios/s\n", locked, mutex_changes);
+    result("peer_readers", "reads/s", snap, "snapshot");
+    result("peer_readers", "changes/s", snap_changes, "snapshot");
+    result("peer_readers", "reads/s", locked, "mutex");
+    result("peer_readers", "changes/s", mutex_changes, "mutex");
+  }
+
+  /* Métricas: sumas de varios hilos a la vez, en porciones por hilo contra un contador compartido */
+  fprintf(stdout, "\n---------- Métricas: %d hilos sumando, porciones por hilo vs contador compartido ----------\n",
+          METRIC_THREADS);
+  {
+    double sharded = bench_metrics(1), shared = bench_metrics(0);
+    fprintf(stdout, "porciones  %6.1f ns/suma, compartido %6.1f ns/suma, x%.1f\n", sharded, shared,
+            shared / sharded);
+    result("metrics", "ns", sharded, "%d threads, sharded", METRIC_THREADS);
+    result("metrics", "ns", shared, "%d threads, shared", METRIC_THREADS);
+  }
+
+  /* Los ficheros que crean las pruebas siguientes van a una carpeta temporal */
+  char tmpdir[] = "/tmp/benchXXXXXX";
+  if (mkdtemp(tmpdir) == NULL || chdir(tmpdir) == -1)
+  {
+    fprintf(stderr, "No se pudo crear la carpeta temporal!\n");
+    return 1;
+  }
+
+  /* Registro: costo por llamada en el hilo que registra, con el escritor en otro hilo */
+  fprintf(stdout, "\n---------- Registro: costo por llamada en el hilo que registra ----------\n");
+  if (log_start(LOG_INFO) == -1)
+  {
+    fprintf(stderr, "No se pudo crear el hilo de registros!\n");
+    return 1;
+  }
+  {
+    double async = bench_log(0), filtered = bench_log(1), direct = bench_log(2);
+    fprintf(stdout, "mensaje asíncrono %8.1f ns/llamada\n", async);
+    fprintf(stdout, "nivel filtrado    %8.1f ns/llamada\n", filtered);
+    fprintf(stdout, "fprintf directo   %8.1f ns/llamada, x%.1f\n", direct, direct / async);
+    result("log", "ns", async, "async");
+    result("log", "ns", filtered, "filtered");
+    result("log", "ns", direct, "direct fprintf");
+
+    struct archive *arch = build_archive(LOG_DUMP_MSGS);
+    double dump_async = bench_dump(arch, 1), dump_direct = bench_dump(arch, 0);
+    fprintf(stdout, "volcado de %u msgs: asíncrono %8.2f us, print_archive directo %8.2f us, x%.0f\n",
+            LOG_DUMP_MSGS, dump_async, dump_direct, dump_direct / dump_async);
+    result("log", "us", dump_async, "dump %u msgs, async", LOG_DUMP_MSGS);
+    result("log", "us", dump_direct, "dump %u msgs, direct", LOG_DUMP_MSGS);
+    log_stop();
+    archive_unref(arch);
+    fprintf(stdout, "registros descartados: %lu\n", (unsigned long)log_dropped());
+  }
+
+  /* Reinicio: cargar un archivo guardado en el almacenamiento, contra validarlo entero como haría un
+     nodo que lo vuelve a recibir de sus pares */
+  uint32_t restart_sizes[] = {10000, 100000, 1000000};
+
+  fprintf(stdout, "\n---------- Reinicio: almacenamiento vs validación completa ----------\n");
+  for (i = 0; i < sizeof(restart_sizes) / sizeof(restart_sizes[0]); i++)
+  {
+    struct archive *arch = build_archive(restart_sizes[i]), *loaded;
+    struct store *st;
+
+    unlink("bench.dat");
+    unlink("bench.dat.idx");
+    st = store_open("bench.dat", STORE_SYNC_NEVER, &loaded);
+    archive_unref(loaded);
+    store_save(st, arch);
+    store_close(st);
+
+    double start = now();
+    st = store_open("bench.dat", STORE_SYNC_NEVER, &loaded);
+    double load = now() - start;
+    int same = same_archive(arch, loaded);
+    store_close(st);
+    archive_unref(loaded);
+
+    start = now();
+    int valid = is_valid(arch);
+    double validate = now() - start;
+
+    fprintf(stdout, "%7u msgs: carga %8.2f ms, validación completa %8.2f ms, x%.0f, %s\n", restart_sizes[i],
+            load * 1e3, validate * 1e3, validate / load,
+            (same && valid) ? "idéntico" : "ARCHIVO CARGADO DISTINTO: FALLO");
+    failed += !(same && valid);
+    result("restart", "ms", load * 1e3, "%u msgs, store load", restart_sizes[i]);
+    result("restart", "ms", validate * 1e3, "%u msgs, full validation", restart_sizes[i]);
+    archive_unref(arch);
+  }
+  set_difficulty(2);
+
+  /* Backends de red, con un nodo local. Los registros de los pares van a la carpeta temporal, y
+     los mensajes del nodo (por stdout y stderr) no se muestran */
+  const char *backends[] = {"epoll", "uring"};
+
+  fprintf(stdout, "\n---------- Red: %d pares por loopback, %d solicitudes por ronda ----------\n",
+          NET_CLIENTS, NET_BATCH);
+  fflush(stdout);
+  peerlist = init_list();
+  snapshot_init(&active_arch, build_archive(1));
+
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+  {
+    double syscalls = 0;
+    const char *used = backends[i];
+    fflush(stdout);
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+
+    log_start(LOG_INFO);
+    double rate = bench_backend(backends[i], &syscalls, &used);
+
+    log_stop();
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    if (rate == 0)
+    {
+      fprintf(stdout, "%-8s: no disponible\n", backends[i]);
+      continue;
+    }
+    fprintf(stdout, "%-8s: %10.0f msgs/s, %6.3f llamadas al sistema por mensaje\n", used, rate, syscalls);
+    result("network", "msgs/s", rate, "%s", used);
+    result("network", "syscalls/msg", syscalls, "%s", used);
+  }
+
+  /* Recepción de archivos con encabezados falsos: la memoria del nodo crece con los mensajes que
+     llegan y no con los que el par anuncia, y se corta en el límite por par */
+  set_difficulty(0);
+  struct archive *honest = build_archive(FORGED_MSGS);
+  uint8_t *body = archive_flatten(honest);
+  failed += check_forged(honest, body);
+
+  /* Lectura de respuestas de archivo: campo por campo con recv, contra el analizador del bucle de
+     eventos, que lee todo lo disponible de una vez y procesa los campos sin copiarlos */
+  fprintf(stdout, "\n---------- Lectura de archivos de %u msgs por loopback ----------\n", FORGED_MSGS);
+  struct archive *active = snapshot_get(&active_arch);
+  snapshot_publish(&active_arch, active, honest);
+  archive_unref(active);
+
+  double syscalls = 0;
+  double rate = bench_field_reader(body, honest->len, &syscalls);
+  fprintf(stdout, "%-8s: %10.0f msgs/s, %8.5f llamadas al sistema por mensaje\n", "por campo", rate, syscalls);
+  result("archive_read", "msgs/s", rate, "field reader");
+  result("archive_read", "syscalls/msg", syscalls, "field reader");
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+  {
+    const char *used = backends[i];
+    syscalls = 0;
+    fflush(stdout);
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+
+    log_start(LOG_INFO);
+    rate = bench_node_reader(backends[i], body, honest->len, honest->size, &syscalls, &used);
+
+    log_stop();
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    if (rate == 0)
+    {
+      fprintf(stdout, "%-8s: no disponible\n", backends[i]);
+      continue;
+    }
+    fprintf(stdout, "%-8s: %10.0f msgs/s, %8.5f llamadas al sistema por mensaje\n", used, rate, syscalls);
+    result("archive_read", "msgs/s", rate, "node reader, %s", used);
+    result("archive_read", "syscalls/msg", syscalls, "node reader, %s", used);
+  }
+
+  free(body);
+  archive_unref(honest);
+  set_difficulty(2);
+
+  if (json != NULL)
+  {
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+  }
+
+  return failed ? 1 : 0;
+}
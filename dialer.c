@@ -0,0 +1,184 @@
+#include "dialer.h"
+
+/* Este archivo implementa el registro de las conexiones salientes. Una IP aparece en las listas de
+   pares de todos nuestros pares, cada pocos segundos; el registro evita abrir una segunda conexión
+   mientras la primera está en curso, y espacia los intentos a las IPs que no responden con esperas
+   que se duplican con cada fallo, así que las IPs muertas dejan de costar un intento por cada lista.
+
+   Las entradas no se eliminan una a una: al crecer la tabla se descartan las que no tienen una
+   conexión en curso ni fallos recientes. Las IPs que fallaron se conservan aunque su espera ya haya
+   pasado, para no volver a la espera base en cuanto la tabla se reconstruye, hasta que pasen
+   DIALER_FORGET esperas máximas sin intentarlas. La tabla no pasa de DIALER_MAX_SLOTS ranuras, para
+   que listas de pares con IPs inventadas no la hagan crecer sin límite; si se llena, se descartan
+   primero las IPs con fallos cuya espera ya pasó. */
+
+/* Tamaño inicial y máximo de la tabla */
+#define DIALER_MIN_SLOTS 16
+#define DIALER_MAX_SLOTS (1 << 16)
+
+/* Esperas máximas sin intentos tras las que se olvidan los fallos de una IP */
+#define DIALER_FORGET 4
+
+/* Dispersa una IP con el hash multiplicativo de Fibonacci, como los índices de la lista de pares */
+static uint32_t hash_ip(uint32_t ip)
+{
+	uint32_t h = ip * 0x9E3779B1u;
+	return h ^ (h >> 16);
+}
+
+/* Devuelve la ranura de la tabla donde está la IP dada, o la ranura vacía donde iría */
+static uint32_t dial_find(const struct dial *slots, uint32_t mask, uint32_t ip)
+{
+	uint32_t i = hash_ip(ip) & mask;
+	while (slots[i].used && slots[i].ip != ip)
+	{
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+/* Devuelve si la entrada todavía importa en el tiempo 'now': tiene una conexión en curso, una espera
+   pendiente o, salvo con 'evict', fallos que todavía no se olvidaron */
+static int dial_keep(const struct dialer *d, const struct dial *dial, uint64_t now, int evict)
+{
+	if (!dial->used)
+	{
+		return 0;
+	}
+	if (dial->inflight || dial->retry_at > now)
+	{
+		return 1;
+	}
+	return !evict && dial->failures > 0 && now - dial->retry_at < DIALER_FORGET * d->max;
+}
+
+/* Reconstruye la tabla conservando solo las entradas que todavía importan en el tiempo 'now' (ver
+   dial_keep), con el tamaño justo para que queden a lo sumo un cuarto de las ranuras ocupadas (y así
+   no haya que reconstruirla enseguida). Devuelve -1 si ni siquiera con el tamaño máximo queda lugar
+   para una entrada más */
+static int dial_rebuild(struct dialer *d, uint64_t now, int evict)
+{
+	uint32_t live = 0, size = DIALER_MIN_SLOTS, i;
+
+	for (i = 0; i <= d->mask; i++)
+	{
+		if (dial_keep(d, &d->slots[i], now, evict))
+		{
+			live++;
+		}
+	}
+	while (size < DIALER_MAX_SLOTS && 4 * (live + 1) > size)
+	{
+		size *= 2;
+	}
+
+	struct dial *slots = (struct dial *)calloc(size, sizeof(struct dial));
+	for (i = 0; i <= d->mask; i++)
+	{
+		if (dial_keep(d, &d->slots[i], now, evict))
+		{
+			slots[dial_find(slots, size - 1, d->slots[i].ip)] = d->slots[i];
+		}
+	}
+	free(d->slots);
+	d->slots = slots;
+	d->mask = size - 1;
+	d->count = live;
+
+	return 2 * (live + 1) > size ? -1 : 0;
+}
+
+void dialer_init(struct dialer *d, uint32_t max_inflight, uint64_t base, uint64_t max)
+{
+	d->slots = (struct dial *)calloc(DIALER_MIN_SLOTS, sizeof(struct dial));
+	d->mask = DIALER_MIN_SLOTS - 1;
+	d->count = 0;
+	d->inflight = 0;
+	d->max_inflight = max_inflight;
+	d->base = base;
+	d->max = max;
+	d->full_at = UINT64_MAX;
+}
+
+int dialer_begin(struct dialer *d, uint32_t ip, uint64_t now)
+{
+	struct dial *dial = &d->slots[dial_find(d->slots, d->mask, ip)];
+	if (dial->used && dial->inflight)
+	{
+		return 0;
+	}
+	if ((dial->used && now < dial->retry_at) || d->inflight >= d->max_inflight)
+	{
+		return -1;
+	}
+
+	/* La tabla nunca pasa de la mitad de su capacidad */
+	if (!dial->used && 2 * (d->count + 1) > d->mask + 1)
+	{
+		if (d->full_at == now)
+		{
+			return -1;
+		}
+		/* Si ni conservando los fallos recientes hay lugar, descartamos los que ya cumplieron su espera */
+		if (dial_rebuild(d, now, 0) == -1 && dial_rebuild(d, now, 1) == -1)
+		{
+			d->full_at = now;
+			return -1;
+		}
+		dial = &d->slots[dial_find(d->slots, d->mask, ip)];
+	}
+
+	if (!dial->used)
+	{
+		dial->used = 1;
+		dial->ip = ip;
+		dial->failures = 0;
+		dial->retry_at = 0;
+		d->count++;
+	}
+
+	dial->inflight = 1;
+	d->inflight++;
+	return 1;
+}
+
+void dialer_done(struct dialer *d, uint32_t ip, int ok, uint64_t now)
+{
+	struct dial *dial = &d->slots[dial_find(d->slots, d->mask, ip)];
+	if (!dial->used || !dial->inflight)
+	{
+		return;
+	}
+	dial->inflight = 0;
+	d->inflight--;
+
+	if (ok)
+	{
+		dial->failures = 0;
+		dial->retry_at = 0;
+		return;
+	}
+
+	/* La espera se duplica con cada fallo seguido, hasta el máximo */
+	uint64_t wait = d->base;
+	uint8_t i;
+	for (i = 0; i < dial->failures && wait < d->max; i++)
+	{
+		wait *= 2;
+	}
+	if (wait > d->max)
+	{
+		wait = d->max;
+	}
+	if (dial->failures < UINT8_MAX)
+	{
+		dial->failures++;
+	}
+	dial->retry_at = now + wait;
+}
+
+void dialer_free(struct dialer *d)
+{
+	free(d->slots);
+	d->slots = NULL;
+}
@@ -0,0 +1,52 @@
+#include <stdlib.h> // mallocs, frees y demás
+#include <stdint.h> // tipos de tamaño portátil (uint8_t, uint32_t, etc.)
+
+/* Estado de los intentos de conexión con una IP:
+   ip        -> la IP
+   used      -> si la ranura está ocupada
+   inflight  -> si hay una conexión saliente en curso con la IP
+   failures  -> intentos fallidos seguidos
+   retry_at  -> tiempo desde el que se puede volver a intentar, tras el último fallo */
+struct dial
+{
+  uint32_t ip;
+  uint8_t used;
+  uint8_t inflight;
+  uint8_t failures;
+  uint64_t retry_at;
+};
+
+/* Registro de las conexiones salientes, para no repetirlas y espaciar los reintentos a las IPs que
+   no responden:
+   slots        -> tabla hash de direccionamiento abierto con sondeo lineal, por IP ('mask' + 1
+                   ranuras, a lo sumo la mitad ocupadas)
+   count        -> ranuras ocupadas
+   inflight     -> conexiones en curso, a lo sumo 'max_inflight'
+   base, max    -> espera tras el primer fallo, que se duplica con cada fallo seguido hasta 'max'
+   full_at      -> tiempo en que la tabla se llenó con su tamaño máximo, o UINT64_MAX; hasta que el
+                   tiempo avance ninguna entrada puede vencer, así que no la reconstruimos de nuevo
+   Los tiempos están en las unidades que use el llamador (los ticks del bucle de eventos) */
+struct dialer
+{
+  struct dial *slots;
+  uint32_t mask, count;
+  uint32_t inflight, max_inflight;
+  uint64_t base, max;
+  uint64_t full_at;
+};
+
+/* Inicializa un registro vacío, con a lo sumo 'max_inflight' conexiones en curso a la vez y esperas
+   entre 'base' y 'max' tras los fallos */
+void dialer_init(struct dialer *d, uint32_t max_inflight, uint64_t base, uint64_t max);
+
+/* Devuelve 1 y anota la conexión como en curso si se puede intentar conectar con la IP en el tiempo
+   'now', 0 si ya hay una conexión en curso con ella, o -1 si todavía no pasó la espera de su último
+   fallo o si ya hay demasiadas conexiones en curso */
+int dialer_begin(struct dialer *d, uint32_t ip, uint64_t now);
+
+/* Registra el resultado de la conexión en curso con la IP: si 'ok', olvida sus fallos; si no, la
+   siguiente no se intenta hasta que pase la espera que corresponde a sus fallos seguidos */
+void dialer_done(struct dialer *d, uint32_t ip, int ok, uint64_t now);
+
+/* Libera la memoria del registro */
+void dialer_free(struct dialer *d);
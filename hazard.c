@@ -0,0 +1,108 @@
+#include "hazard.h"
+#include <stdlib.h> // mallocs, frees y demás
+
+/* Este archivo implementa los punteros de riesgo. Las ranuras son un arreglo fijo: cada lectura
+   ocupa una con un intercambio atómico, empezando por la última que usó su hilo, así que en general
+   cada hilo vuelve a su propia ranura sin disputarla con nadie.
+
+   Los retirados forman una pila enlazada sin bloqueos, a la que cualquier hilo puede agregar. Para
+   recorrerla, quien retira toma la pila entera de una vez, suelta los que ninguna ranura anota y
+   devuelve los demás a la pila; como solo se agregan nodos o se toma la pila completa, no hay
+   problema ABA. Todas las operaciones atómicas son secuencialmente consistentes: si un lector
+   comprobó que el puntero seguía publicado después de anotarlo, quien lo reemplazó verá la
+   anotación al recorrer las ranuras, porque las recorre después de reemplazarlo. */
+
+static struct hazard_slot slots[HAZARD_SLOTS];
+static _Atomic(struct hazard_retired *) retired;
+static __thread int last_slot;
+
+int hazard_claim()
+{
+	int i = last_slot;
+	for (;;)
+	{
+		int expected = 0;
+		if (atomic_load_explicit(&slots[i].busy, memory_order_relaxed) == 0 &&
+			atomic_compare_exchange_strong(&slots[i].busy, &expected, 1))
+		{
+			last_slot = i;
+			return i;
+		}
+		i = (i + 1) % HAZARD_SLOTS;
+	}
+}
+
+void hazard_set(int slot, void *ptr)
+{
+	atomic_store(&slots[slot].ptr, ptr);
+}
+
+void hazard_release(int slot)
+{
+	atomic_store(&slots[slot].ptr, NULL);
+	atomic_store(&slots[slot].busy, 0);
+}
+
+/* Devuelve 1 si alguna ranura anota el puntero dado */
+static int is_protected(void *ptr)
+{
+	int i;
+	for (i = 0; i < HAZARD_SLOTS; i++)
+	{
+		if (atomic_load(&slots[i].ptr) == ptr)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Agrega a la pila de retirados la cadena de 'first' a 'last' */
+static void push_retired(struct hazard_retired *first, struct hazard_retired *last)
+{
+	struct hazard_retired *head = atomic_load(&retired);
+	do
+	{
+		last->next = head;
+	} while (!atomic_compare_exchange_weak(&retired, &head, first));
+}
+
+void hazard_collect()
+{
+	struct hazard_retired *node = atomic_exchange(&retired, NULL);
+	struct hazard_retired *keep = NULL, *keep_last = NULL;
+
+	while (node != NULL)
+	{
+		struct hazard_retired *next = node->next;
+		if (is_protected(node->ptr))
+		{
+			node->next = keep;
+			keep = node;
+			if (keep_last == NULL)
+			{
+				keep_last = node;
+			}
+		}
+		else
+		{
+			node->release(node->ptr);
+			free(node);
+		}
+		node = next;
+	}
+
+	if (keep != NULL)
+	{
+		push_retired(keep, keep_last);
+	}
+}
+
+void hazard_retire(void *ptr, void (*release)(void *ptr))
+{
+	struct hazard_retired *node = (struct hazard_retired *)malloc(sizeof(struct hazard_retired));
+	node->ptr = ptr;
+	node->release = release;
+	push_retired(node, node);
+	hazard_collect();
+}
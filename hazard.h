@@ -0,0 +1,50 @@
+#ifndef HAZARD_H
+#define HAZARD_H
+
+#include <stdint.h>    // tipos de tamaño portátil (uint8_t, uint32_t, etc.)
+#include <stdatomic.h> // punteros de riesgo y lista de retirados sin bloqueos
+
+/* Punteros de riesgo (hazard pointers) para los datos publicados detrás de un puntero atómico, como
+   el archivo del snapshot o la representación de la lista de pares. Un lector anota en una ranura el puntero que va a usar, comprueba que
+   sigue publicado y recién entonces toma su referencia; quien reemplaza el puntero no espera a
+   nadie: retira el anterior, y solo lo suelta cuando ninguna ranura lo anota. Lo que todavía esté anotado queda retirado hasta la próxima vez que alguien retire algo */
+
+/* Número de ranuras. Cada lectura ocupa una solo mientras toma la referencia, así que alcanza con
+   que haya más ranuras que hilos leyendo a la vez */
+#define HAZARD_SLOTS 64
+
+/* Ranura de un lector: si está ocupada ('busy') y el puntero anotado ('ptr'). Cada una va en su
+   propia línea de caché, para que los lectores de hilos distintos no se estorben */
+struct hazard_slot
+{
+  _Alignas(64) atomic_int busy;
+  _Atomic(void *) ptr;
+};
+
+/* Dato retirado, a la espera de que ningún lector lo anote para soltarlo con 'release' */
+struct hazard_retired
+{
+  void *ptr;
+  void (*release)(void *ptr);
+  struct hazard_retired *next;
+};
+
+/* Ocupa una ranura libre para el hilo que llama y devuelve su índice. Nunca bloquea mientras haya
+   menos de HAZARD_SLOTS lecturas en curso */
+int hazard_claim();
+
+/* Anota en la ranura el puntero que el lector va a usar. Después el lector debe volver a leer el
+   puntero publicado: si sigue siendo el mismo, no se soltará hasta que libere la ranura */
+void hazard_set(int slot, void *ptr);
+
+/* Libera la ranura, una vez que el lector tomó su propia referencia */
+void hazard_release(int slot);
+
+/* Retira un puntero que ya no está publicado: se suelta con 'release' ahora, si ninguna ranura lo
+   anota, o más adelante. También suelta los retirados antes que ya nadie anote. Nunca espera */
+void hazard_retire(void *ptr, void (*release)(void *ptr));
+
+/* Suelta los retirados que ya nadie anota, sin retirar nada nuevo */
+void hazard_collect();
+
+#endif
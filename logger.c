@@ -0,0 +1,966 @@
+#include "logger.h"
+#include <stdlib.h>    // mallocs, frees y demás
+#include <string.h>    // strchr, memcpy, para copiar los argumentos
+#include <stddef.h>    // ptrdiff_t, para los argumentos con el modificador 't'
+#include <sys/types.h> // ssize_t, para los argumentos con el modificador 'z'
+#include <time.h>      // clock_gettime y localtime_r, para la hora de cada registro
+#include <sched.h>     // sched_yield, para esperar lugar al cerrar un destino
+#include <unistd.h>    // usleep, para que el escritor duerma cuando no hay nada que escribir
+
+/* Este archivo implementa el registro asíncrono. Cada hilo tiene un búfer circular de bytes en el
+   que escribe registros de tamaño variable (múltiplo de 8 bytes): un encabezado con el tipo, el nivel,
+   la hora, el destino y el formato, seguido de los argumentos en ranuras de 8 bytes. Las cadenas
+   ocupan una ranura con su longitud y después sus bytes. Un registro que no cabe antes del final del
+   búfer se escribe al principio, precedido de un registro de relleno.
+
+   El productor (el hilo dueño del búfer) solo avanza 'head' y el escritor solo avanza 'tail', así
+   que no hace falta ningún bloqueo. Los búferes se enlazan en una lista a la que los hilos se
+   agregan al registrar algo por primera vez; cuando un hilo termina, su búfer se marca y el escritor
+   lo libera después de vaciarlo. */
+
+/* Tipos de registro */
+enum
+{
+	REC_MSG,   // mensaje con formato
+	REC_DUMP,  // objeto grande, que escribe su propia función
+	REC_CLOSE, // cierre de un destino
+	REC_PAD    // relleno hasta el final del búfer
+};
+
+/* Encabezado de un registro (32 bytes) */
+struct log_record
+{
+	uint32_t size;
+	uint8_t kind;
+	uint8_t level;
+	uint16_t nargs;
+	uint64_t time;
+	struct log_target *target;
+	const char *fmt;
+};
+
+/* Registro de un objeto grande: la función que lo escribe, la que lo suelta y el objeto */
+struct log_dump_record
+{
+	struct log_record hdr;
+	void (*print)(void *obj, FILE *file);
+	void (*release)(void *obj);
+	void *obj;
+};
+
+/* Clase de argumento que consume una conversión de un formato */
+enum
+{
+	ARG_SIGNED,   // entero con signo (también los '*' de ancho y precisión)
+	ARG_UNSIGNED, // entero sin signo
+	ARG_CHAR,     // carácter, que se pasa como int
+	ARG_DOUBLE,   // coma flotante
+	ARG_PTR,      // puntero
+	ARG_STR,      // cadena, que se copia
+	ARG_OTHER     // conversión no admitida: se consume y se guarda un 0
+};
+
+/* Entradas de la caché de formatos de cada hilo, y argumentos que puede tener un formato en ella */
+#define FMT_CACHE_SIZE 64
+#define FMT_MAX_ARGS 24
+
+/* Formato ya separado en los argumentos que consume, con su clase y su modificador de longitud. Así
+   cada llamada con un formato ya visto solo recorre este arreglo, en lugar de volver a analizarlo.
+   Los formatos con más de FMT_MAX_ARGS argumentos se analizan en cada llamada ('nargs' es -1) */
+struct fmt_entry
+{
+	const char *fmt;
+	int nargs;
+	uint8_t kind[FMT_MAX_ARGS];
+	uint8_t len[FMT_MAX_ARGS];
+};
+
+/* Búfer circular de un hilo. 'head' (bytes escritos) y 'tail' (bytes consumidos) van en líneas de
+   caché distintas para que el productor y el escritor no se estorben; el productor guarda además la
+   última 'tail' que leyó, para no leerla en cada registro */
+struct log_ring
+{
+	_Alignas(64) atomic_uint_fast64_t head;
+	uint64_t cached_tail;
+	_Alignas(64) atomic_uint_fast64_t tail;
+	atomic_uint_fast64_t dropped;
+	atomic_int closed;
+	struct log_ring *next;
+	struct fmt_entry formats[FMT_CACHE_SIZE];
+	uint8_t data[LOG_RING_SIZE];
+};
+
+/* Modificadores de longitud de una conversión */
+enum
+{
+	LEN_NONE,
+	LEN_HH,
+	LEN_H,
+	LEN_L,
+	LEN_LL,
+	LEN_Z,
+	LEN_J,
+	LEN_T
+};
+
+/* Especificación de conversión de un formato, ya separada en sus partes */
+struct spec
+{
+	const char *flags;
+	int nflags;
+	const char *width, *prec; // dígitos en el formato, o NULL
+	int nwidth, nprec;
+	int star_width, star_prec; // '*': el valor es un argumento
+	int has_prec;
+	int len;
+	char conv;
+};
+
+struct log_target log_stdout = {NULL, 0, "stdout"}, log_stderr = {NULL, 0, "stderr"};
+
+static enum log_level max_level = LOG_INFO;
+static _Atomic(struct log_ring *) rings;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *my_ring;
+
+static pthread_t writer;
+static atomic_int running, stop_requested;
+
+/* Destinos con datos escritos desde el último vaciado (capacidad 'dirty_cap'). Solo los usa el escritor */
+static struct log_target **dirty;
+static uint32_t ndirty, dirty_cap;
+
+/* Destinos que se pidió cerrar, en orden (capacidad 'closing_cap'), ver drain_all */
+static struct log_target **closing;
+static uint32_t nclosing, closing_cap;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+int log_parse_level(const char *name, enum log_level *level)
+{
+	unsigned i;
+	for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++)
+	{
+		if (strcmp(name, level_names[i]) == 0)
+		{
+			*level = (enum log_level)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int log_enabled(enum log_level level)
+{
+	return level <= max_level;
+}
+
+/* Marca el búfer de un hilo que terminó, para que el escritor lo libere cuando lo vacíe */
+static void ring_orphan(void *arg)
+{
+	atomic_store(&((struct log_ring *)arg)->closed, 1);
+}
+
+static void ring_key_create()
+{
+	pthread_key_create(&ring_key, ring_orphan);
+}
+
+/* Devuelve el búfer del hilo actual, creándolo y agregándolo a la lista la primera vez */
+static struct log_ring *ring_get()
+{
+	if (my_ring != NULL)
+	{
+		return my_ring;
+	}
+
+	struct log_ring *r;
+	if (posix_memalign((void **)&r, 64, sizeof(struct log_ring)) != 0)
+	{
+		return NULL;
+	}
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->dropped, 0);
+	atomic_init(&r->closed, 0);
+	r->cached_tail = 0;
+	memset(r->formats, 0, sizeof(r->formats));
+
+	/* Los hilos solo agregan búferes al principio de la lista */
+	r->next = atomic_load(&rings);
+	while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+	{
+	}
+
+	pthread_once(&ring_once, ring_key_create);
+	pthread_setspecific(ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+/* Copia un registro ya armado de 'size' bytes al búfer del hilo. Devuelve 0, o -1 si no hay lugar */
+static int ring_put(struct log_ring *r, const void *rec, uint32_t size)
+{
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t off = head % LOG_RING_SIZE;
+	uint32_t pad = LOG_RING_SIZE - off < size ? LOG_RING_SIZE - off : 0;
+
+	if (head + pad + size - r->cached_tail > LOG_RING_SIZE)
+	{
+		r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (head + pad + size - r->cached_tail > LOG_RING_SIZE)
+		{
+			return -1;
+		}
+	}
+
+	if (pad > 0)
+	{
+		struct log_record *filler = (struct log_record *)(r->data + off);
+		filler->size = pad;
+		filler->kind = REC_PAD;
+		off = 0;
+	}
+	memcpy(r->data + off, rec, size);
+	atomic_store_explicit(&r->head, head + pad + size, memory_order_release);
+	return 0;
+}
+
+/* Separa la especificación de conversión que empieza después de un '%'. Devuelve dónde termina */
+static const char *spec_parse(const char *f, struct spec *s)
+{
+	memset(s, 0, sizeof(*s));
+
+	s->flags = f;
+	while (*f != '\0' && strchr("-+ #0", *f) != NULL)
+	{
+		f++;
+	}
+	s->nflags = f - s->flags;
+
+	if (*f == '*')
+	{
+		s->star_width = 1;
+		f++;
+	}
+	else
+	{
+		s->width = f;
+		while (*f >= '0' && *f <= '9')
+		{
+			f++;
+		}
+		s->nwidth = f - s->width;
+	}
+
+	if (*f == '.')
+	{
+		s->has_prec = 1;
+		f++;
+		if (*f == '*')
+		{
+			s->star_prec = 1;
+			f++;
+		}
+		else
+		{
+			s->prec = f;
+			while (*f >= '0' && *f <= '9')
+			{
+				f++;
+			}
+			s->nprec = f - s->prec;
+		}
+	}
+
+	switch (*f)
+	{
+	case 'h':
+		s->len = f[1] == 'h' ? LEN_HH : LEN_H;
+		f += s->len == LEN_HH ? 2 : 1;
+		break;
+	case 'l':
+		s->len = f[1] == 'l' ? LEN_LL : LEN_L;
+		f += s->len == LEN_LL ? 2 : 1;
+		break;
+	case 'z':
+		s->len = LEN_Z;
+		f++;
+		break;
+	case 'j':
+		s->len = LEN_J;
+		f++;
+		break;
+	case 't':
+		s->len = LEN_T;
+		f++;
+		break;
+	}
+
+	s->conv = *f;
+	return *f != '\0' ? f + 1 : f;
+}
+
+/* Lee un argumento entero con signo según el modificador de longitud */
+static int64_t arg_signed(va_list *ap, int len)
+{
+	switch (len)
+	{
+	case LEN_HH:
+		return (signed char)va_arg(*ap, int);
+	case LEN_H:
+		return (short)va_arg(*ap, int);
+	case LEN_L:
+		return va_arg(*ap, long);
+	case LEN_LL:
+		return va_arg(*ap, long long);
+	case LEN_Z:
+		return va_arg(*ap, ssize_t);
+	case LEN_J:
+		return va_arg(*ap, intmax_t);
+	case LEN_T:
+		return va_arg(*ap, ptrdiff_t);
+	default:
+		return va_arg(*ap, int);
+	}
+}
+
+/* Lee un argumento entero sin signo según el modificador de longitud */
+static uint64_t arg_unsigned(va_list *ap, int len)
+{
+	switch (len)
+	{
+	case LEN_HH:
+		return (unsigned char)va_arg(*ap, unsigned);
+	case LEN_H:
+		return (unsigned short)va_arg(*ap, unsigned);
+	case LEN_L:
+		return va_arg(*ap, unsigned long);
+	case LEN_LL:
+		return va_arg(*ap, unsigned long long);
+	case LEN_Z:
+		return va_arg(*ap, size_t);
+	case LEN_J:
+		return va_arg(*ap, uintmax_t);
+	case LEN_T:
+		return (uint64_t)va_arg(*ap, ptrdiff_t);
+	default:
+		return va_arg(*ap, unsigned);
+	}
+}
+
+/* Hora actual en nanosegundos. El reloj "grueso" tiene una resolución de pocos milisegundos, que
+   alcanza para un registro, y cuesta mucho menos que el exacto */
+static uint64_t log_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Separa un formato en los argumentos que consume (a lo sumo 'max'), guardando la clase y el
+   modificador de longitud de cada uno. Devuelve cuántos son */
+static int fmt_compile(const char *fmt, uint8_t *kind, uint8_t *len, int max)
+{
+	const char *f = fmt;
+	int n = 0;
+
+	while ((f = strchr(f, '%')) != NULL && n < max)
+	{
+		struct spec s;
+		if (f[1] == '%')
+		{
+			f += 2;
+			continue;
+		}
+		f = spec_parse(f + 1, &s);
+
+		if (s.star_width && n < max)
+		{
+			kind[n] = ARG_SIGNED;
+			len[n++] = LEN_NONE;
+		}
+		if (s.star_prec && n < max)
+		{
+			kind[n] = ARG_SIGNED;
+			len[n++] = LEN_NONE;
+		}
+		if (n == max || s.conv == '\0')
+		{
+			break;
+		}
+
+		switch (s.conv)
+		{
+		case 'd':
+		case 'i':
+			kind[n] = ARG_SIGNED;
+			break;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			kind[n] = ARG_UNSIGNED;
+			break;
+		case 'c':
+			kind[n] = ARG_CHAR;
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			kind[n] = ARG_DOUBLE;
+			break;
+		case 'p':
+			kind[n] = ARG_PTR;
+			break;
+		case 's':
+			kind[n] = ARG_STR;
+			break;
+		default:
+			kind[n] = ARG_OTHER;
+			break;
+		}
+		len[n++] = s.len;
+	}
+	return n;
+}
+
+/* Posición de un formato en la caché de formatos, por la dirección de su cadena */
+static uint32_t fmt_slot(const char *fmt)
+{
+	return (uint32_t)(((uint64_t)(uintptr_t)fmt * 0x9E3779B97F4A7C15u) >> 32) % FMT_CACHE_SIZE;
+}
+
+void log_msg(enum log_level level, struct log_target *target, const char *fmt, ...)
+{
+	if (level > max_level)
+	{
+		return;
+	}
+	struct log_ring *r = ring_get();
+	if (r == NULL)
+	{
+		return;
+	}
+
+	/* El registro se arma en la pila y se copia entero al búfer */
+	union
+	{
+		struct log_record hdr;
+		uint64_t slots[LOG_RECORD_MAX / 8];
+	} buf;
+	uint64_t *rec = buf.slots;
+	uint32_t slot = sizeof(struct log_record) / 8, end = LOG_RECORD_MAX / 8;
+
+	/* Los argumentos del formato salen de la caché, o se analizan y se guardan en ella si caben. Un
+	   formato no puede tener más argumentos que ranuras tiene el registro */
+	struct fmt_entry *e = &r->formats[fmt_slot(fmt)];
+	uint8_t kinds[LOG_RECORD_MAX / 8], lens[LOG_RECORD_MAX / 8];
+	const uint8_t *kind = e->kind, *len = e->len;
+	int nargs = e->nargs, i;
+	if (e->fmt != fmt)
+	{
+		nargs = fmt_compile(fmt, kinds, lens, end - slot);
+		if (nargs <= FMT_MAX_ARGS)
+		{
+			memcpy(e->kind, kinds, nargs);
+			memcpy(e->len, lens, nargs);
+			e->nargs = nargs;
+			e->fmt = fmt;
+		}
+		else
+		{
+			kind = kinds;
+			len = lens;
+		}
+	}
+
+	va_list ap;
+	va_start(ap, fmt);
+	for (i = 0; i < nargs && slot < end; i++)
+	{
+		switch (kind[i])
+		{
+		case ARG_SIGNED:
+			rec[slot++] = (uint64_t)arg_signed(&ap, len[i]);
+			break;
+		case ARG_UNSIGNED:
+			rec[slot++] = arg_unsigned(&ap, len[i]);
+			break;
+		case ARG_CHAR:
+			rec[slot++] = (uint64_t)va_arg(ap, int);
+			break;
+		case ARG_DOUBLE:
+		{
+			double d = va_arg(ap, double);
+			memcpy(&rec[slot++], &d, 8);
+			break;
+		}
+		case ARG_PTR:
+			rec[slot++] = (uintptr_t)va_arg(ap, void *);
+			break;
+		case ARG_STR:
+		{
+			/* La cadena se copia (truncada si no cabe) con su terminador */
+			const char *str = va_arg(ap, const char *);
+			if (str == NULL)
+			{
+				str = "(null)";
+			}
+			if (slot + 1 == end)
+			{
+				end = slot; // no cabe: el registro termina aquí
+				break;
+			}
+			size_t room = (end - slot - 1) * 8, n = strnlen(str, LOG_STR_MAX);
+			if (n + 1 > room)
+			{
+				n = room - 1;
+			}
+			rec[slot] = n;
+			memcpy(&rec[slot + 1], str, n);
+			((char *)&rec[slot + 1])[n] = '\0';
+			slot += 1 + (n + 8) / 8;
+			break;
+		}
+		default:
+			/* Conversiones no admitidas, como 'n': se consume el argumento */
+			(void)va_arg(ap, void *);
+			rec[slot++] = 0;
+			break;
+		}
+	}
+	va_end(ap);
+
+	buf.hdr.size = slot * 8;
+	buf.hdr.kind = REC_MSG;
+	buf.hdr.level = level;
+	buf.hdr.nargs = 0;
+	buf.hdr.time = log_time();
+	buf.hdr.target = target;
+	buf.hdr.fmt = fmt;
+
+	if (ring_put(r, &buf, buf.hdr.size) == -1)
+	{
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+	}
+}
+
+void log_dump(enum log_level level, struct log_target *target, void (*print)(void *obj, FILE *file),
+              void (*release)(void *obj), void *obj)
+{
+	struct log_ring *r = level <= max_level ? ring_get() : NULL;
+	if (r == NULL)
+	{
+		release(obj);
+		return;
+	}
+
+	struct log_dump_record rec = {{sizeof(rec), REC_DUMP, level, 0, log_time(), target, NULL}, print, release, obj};
+
+	if (ring_put(r, &rec, sizeof(rec)) == -1)
+	{
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		release(obj);
+	}
+}
+
+struct log_target *log_open(const char *name)
+{
+	struct log_target *target = (struct log_target *)calloc(1, sizeof(struct log_target));
+	target->owned = 1;
+	snprintf(target->name, sizeof(target->name), "%s", name);
+	return target;
+}
+
+void log_close(struct log_target *target)
+{
+	struct log_ring *r = ring_get();
+	struct log_record rec = {sizeof(rec), REC_CLOSE, 0, 0, 0, target, NULL};
+
+	/* El cierre no se puede descartar, porque el escritor es el único que puede liberar el destino;
+	   si el búfer está lleno esperamos a que lo vacíe (y si no hay escritor, el destino se pierde) */
+	while (r != NULL && ring_put(r, &rec, sizeof(rec)) == -1 && atomic_load(&running))
+	{
+		sched_yield();
+	}
+}
+
+uint64_t log_dropped()
+{
+	uint64_t total = 0;
+	struct log_ring *r;
+	for (r = atomic_load(&rings); r != NULL; r = r->next)
+	{
+		total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+	}
+	return total;
+}
+
+/* Devuelve el fichero de un destino, abriéndolo si hace falta, o NULL si no se pudo abrir */
+static FILE *target_file(struct log_target *target)
+{
+	if (target->file == NULL)
+	{
+		if (target == &log_stdout || target == &log_stderr)
+		{
+			target->file = target == &log_stdout ? stdout : stderr;
+		}
+		else
+		{
+			target->file = fopen(target->name, "a");
+		}
+	}
+	return target->file;
+}
+
+/* Anota que el destino tiene datos sin vaciar */
+static void mark_dirty(struct log_target *target)
+{
+	uint32_t i;
+	for (i = 0; i < ndirty; i++)
+	{
+		if (dirty[i] == target)
+		{
+			return;
+		}
+	}
+	if (ndirty == dirty_cap)
+	{
+		dirty_cap = dirty_cap ? 2 * dirty_cap : 16;
+		dirty = (struct log_target **)realloc(dirty, dirty_cap * sizeof(struct log_target *));
+	}
+	dirty[ndirty++] = target;
+}
+
+/* Formatea un registro de mensaje en 'line' (de 'cap' bytes). Devuelve la longitud escrita */
+static size_t format_msg(const struct log_record *rec, char *line, size_t cap)
+{
+	const uint64_t *args = (const uint64_t *)rec + sizeof(struct log_record) / 8;
+	const uint64_t *end = (const uint64_t *)rec + rec->size / 8;
+	const char *f = rec->fmt;
+	size_t len = 0;
+
+/* Agrega texto a la línea sin pasarse de su capacidad */
+#define LINE_PUT(expr)                          \
+	do                                          \
+	{                                           \
+		int n = (expr);                         \
+		if (n > 0)                              \
+		{                                       \
+			len += (size_t)n < cap - len ? (size_t)n : cap - len - 1; \
+		}                                       \
+	} while (0)
+
+	while (*f != '\0' && len + 1 < cap)
+	{
+		const char *pct = strchr(f, '%');
+		size_t lit = pct != NULL ? (size_t)(pct - f) : strlen(f);
+		if (lit > cap - len - 1)
+		{
+			lit = cap - len - 1;
+		}
+		memcpy(line + len, f, lit);
+		len += lit;
+		if (pct == NULL)
+		{
+			break;
+		}
+		if (pct[1] == '%')
+		{
+			line[len++] = '%';
+			f = pct + 2;
+			continue;
+		}
+
+		/* Reconstruye la especificación con los '*' ya resueltos y el modificador de longitud que
+		   corresponde a cómo guardamos el valor */
+		struct spec s;
+		f = spec_parse(pct + 1, &s);
+		char sp[64];
+		int n = snprintf(sp, sizeof(sp), "%%%.*s", s.nflags, s.flags);
+		if (s.star_width && args < end)
+		{
+			n += snprintf(sp + n, sizeof(sp) - n, "%d", (int)*args++);
+		}
+		else
+		{
+			n += snprintf(sp + n, sizeof(sp) - n, "%.*s", s.nwidth, s.width);
+		}
+		if (s.star_prec && args < end)
+		{
+			int prec = (int)*args++;
+			if (prec >= 0)
+			{
+				n += snprintf(sp + n, sizeof(sp) - n, ".%d", prec);
+			}
+		}
+		else if (s.has_prec)
+		{
+			n += snprintf(sp + n, sizeof(sp) - n, ".%.*s", s.nprec, s.prec);
+		}
+		if (strchr("diuoxX", s.conv) != NULL && s.conv != '\0')
+		{
+			n += snprintf(sp + n, sizeof(sp) - n, "ll");
+		}
+		snprintf(sp + n, sizeof(sp) - n, "%c", s.conv);
+
+		if (args >= end || s.conv == '\0')
+		{
+			break;
+		}
+		switch (s.conv)
+		{
+		case 'd':
+		case 'i':
+			LINE_PUT(snprintf(line + len, cap - len, sp, (long long)*args++));
+			break;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			LINE_PUT(snprintf(line + len, cap - len, sp, (unsigned long long)*args++));
+			break;
+		case 'c':
+			LINE_PUT(snprintf(line + len, cap - len, sp, (int)*args++));
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+		{
+			double d;
+			memcpy(&d, args++, 8);
+			LINE_PUT(snprintf(line + len, cap - len, sp, d));
+			break;
+		}
+		case 'p':
+			LINE_PUT(snprintf(line + len, cap - len, sp, (void *)(uintptr_t)*args++));
+			break;
+		case 's':
+		{
+			const char *str = (const char *)(args + 1);
+			LINE_PUT(snprintf(line + len, cap - len, sp, str));
+			args += 1 + (*args + 8) / 8;
+			break;
+		}
+		default:
+			args++;
+			break;
+		}
+	}
+#undef LINE_PUT
+
+	/* Un registro truncado igual termina su línea */
+	if (len > 0 && line[len - 1] != '\n' && rec->fmt[strlen(rec->fmt) - 1] == '\n')
+	{
+		if (len + 1 >= cap)
+		{
+			len = cap - 2;
+		}
+		line[len++] = '\n';
+	}
+	line[len] = '\0';
+	return len;
+}
+
+/* Escribe la hora y el nivel de un registro al comienzo de la línea */
+static size_t format_prefix(const struct log_record *rec, char *line, size_t cap)
+{
+	time_t secs = rec->time / 1000000000;
+	struct tm tm;
+	localtime_r(&secs, &tm);
+	return snprintf(line, cap, "%02d:%02d:%02d.%03u %-5s ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+					(unsigned)(rec->time % 1000000000 / 1000000), level_names[rec->level]);
+}
+
+/* Procesa un registro */
+static void write_record(const struct log_record *rec)
+{
+	struct log_target *target = rec->target;
+
+	if (rec->kind == REC_CLOSE)
+	{
+		if (nclosing == closing_cap)
+		{
+			closing_cap = closing_cap ? 2 * closing_cap : 16;
+			closing = (struct log_target **)realloc(closing, closing_cap * sizeof(struct log_target *));
+		}
+		closing[nclosing++] = target;
+		return;
+	}
+
+	FILE *file = target_file(target);
+	if (rec->kind == REC_DUMP)
+	{
+		const struct log_dump_record *dump = (const struct log_dump_record *)rec;
+		if (file != NULL)
+		{
+			dump->print(dump->obj, file);
+			mark_dirty(target);
+		}
+		dump->release(dump->obj);
+		return;
+	}
+	if (file == NULL)
+	{
+		return;
+	}
+	mark_dirty(target);
+
+	char line[LOG_RECORD_MAX + 512];
+	size_t len = target->owned ? format_prefix(rec, line, sizeof(line)) : 0;
+	len += format_msg(rec, line + len, sizeof(line) - len);
+	fwrite(line, 1, len, file);
+}
+
+/* Cierra y libera un destino */
+static void target_free(struct log_target *target)
+{
+	uint32_t i;
+	for (i = 0; i < ndirty; i++)
+	{
+		if (dirty[i] == target)
+		{
+			dirty[i] = dirty[--ndirty];
+			break;
+		}
+	}
+	if (target->file != NULL)
+	{
+		fclose(target->file);
+	}
+	free(target);
+}
+
+/* Vacía el búfer de un hilo. Devuelve cuántos registros procesó */
+static uint64_t ring_drain(struct log_ring *r)
+{
+	uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	uint64_t count = 0;
+
+	while (tail != head)
+	{
+		const struct log_record *rec = (const struct log_record *)(r->data + tail % LOG_RING_SIZE);
+		if (rec->kind != REC_PAD)
+		{
+			write_record(rec);
+			count++;
+		}
+		tail += rec->size;
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+	}
+	return count;
+}
+
+/* Vacía los búferes de todos los hilos, liberando los de los hilos que terminaron. El primero de la
+   lista nunca se libera, porque un hilo nuevo podría estar agregándose delante de él.
+
+   Otro hilo pudo haber registrado algo en un destino justo antes de que se pidiera cerrarlo, en un
+   búfer que ya vaciamos en esta pasada; por eso los destinos se cierran recién al terminar la pasada
+   siguiente, que ya ve todo lo que se registró antes del pedido. Devuelve cuántos registros procesó,
+   contando los cierres */
+static uint64_t drain_all()
+{
+	uint64_t count = 0;
+	uint32_t ready = nclosing, i;
+	struct log_ring *prev = NULL, *r = atomic_load(&rings);
+
+	while (r != NULL)
+	{
+		int closed = atomic_load(&r->closed);
+		count += ring_drain(r);
+
+		struct log_ring *next = r->next;
+		if (closed && prev != NULL)
+		{
+			prev->next = next;
+			free(r);
+		}
+		else
+		{
+			prev = r;
+		}
+		r = next;
+	}
+
+	for (i = 0; i < ready; i++)
+	{
+		target_free(closing[i]);
+	}
+	memmove(closing, closing + ready, (nclosing - ready) * sizeof(struct log_target *));
+	nclosing -= ready;
+	return count + ready;
+}
+
+/* Trabajo del hilo escritor: vacía los búferes y, cuando no queda nada, escribe en el disco lo
+   escrito en los destinos y duerme un momento */
+static void *writer_loop()
+{
+	uint64_t reported = 0;
+
+	for (;;)
+	{
+		int stopping = atomic_load(&stop_requested);
+		if (drain_all() > 0)
+		{
+			continue;
+		}
+
+		uint32_t i;
+		for (i = 0; i < ndirty; i++)
+		{
+			fflush(dirty[i]->file);
+		}
+		ndirty = 0;
+
+		uint64_t dropped = log_dropped();
+		if (dropped != reported)
+		{
+			fprintf(stderr, "[Registro] %lu registros descartados por falta de lugar\n",
+					(unsigned long)(dropped - reported));
+			reported = dropped;
+		}
+
+		if (stopping)
+		{
+			break;
+		}
+		usleep(LOG_IDLE_US);
+	}
+	return NULL;
+}
+
+int log_start(enum log_level level)
+{
+	max_level = level;
+	atomic_store(&stop_requested, 0);
+	if (pthread_create(&writer, NULL, writer_loop, NULL) != 0)
+	{
+		return -1;
+	}
+	atomic_store(&running, 1);
+	return 0;
+}
+
+void log_stop()
+{
+	if (!atomic_load(&running))
+	{
+		return;
+	}
+	atomic_store(&stop_requested, 1);
+	pthread_join(writer, NULL);
+	atomic_store(&running, 0);
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>     // FILE, para los destinos de los registros
+#include <stdint.h>    // tipos de tamaño portátil (uint8_t, uint32_t, etc.)
+#include <stdarg.h>    // argumentos variables de log_msg
+#include <stdatomic.h> // búferes circulares sin bloqueos entre cada hilo y el escritor
+#include <pthread.h>   // hilo escritor
+
+/* Registro asíncrono. Los hilos que registran algo (sobre todo el del bucle de eventos) no formatean
+   ni escriben nada: copian el formato (solo el puntero), los argumentos y la hora en un búfer
+   circular propio de cada hilo, con un único productor y un único consumidor, sin bloqueos. Un solo
+   hilo escritor vacía los búferes de todos los hilos, formatea cada registro y lo escribe en su
+   destino. Si el búfer de un hilo está lleno, el registro se descarta (y se cuenta) en lugar de
+   esperar al escritor. */
+
+/* Niveles de los registros, de más a menos importante. Solo se registra lo que tiene un nivel menor
+   o igual al configurado (por defecto LOG_INFO). En LOG_DEBUG se registran también los detalles de
+   cada mensaje recibido y el contenido completo de los archivos recibidos */
+enum log_level
+{
+  LOG_ERROR,
+  LOG_WARN,
+  LOG_INFO,
+  LOG_DEBUG
+};
+
+/* Tamaño del búfer circular de cada hilo, tamaño máximo de un registro y de cada argumento de cadena
+   (que se trunca si no cabe), y cuánto duerme el escritor cuando no hay nada que escribir */
+#define LOG_RING_SIZE (1 << 20)
+#define LOG_RECORD_MAX 1024
+#define LOG_STR_MAX 256
+#define LOG_IDLE_US 10000
+
+/* Destino de los registros: un fichero que abre el escritor la primera vez que lo necesita (o uno
+   ya abierto, como stdout). Los registros en un fichero propio llevan la hora y el nivel al comienzo */
+struct log_target
+{
+  FILE *file;
+  int owned;
+  char name[48];
+};
+
+/* Destinos de la salida estándar y de errores, sin hora ni nivel */
+extern struct log_target log_stdout, log_stderr;
+
+/* Convierte el nombre de un nivel ("error", "warn", "info" o "debug") a su valor. Devuelve 0, o -1
+   si el nombre no es válido */
+int log_parse_level(const char *name, enum log_level *level);
+
+/* Arranca el hilo escritor, registrando solo hasta el nivel dado. Devuelve 0, o -1 si no se pudo
+   crear el hilo */
+int log_start(enum log_level level);
+
+/* Escribe todo lo que quede en los búferes y detiene el hilo escritor */
+void log_stop();
+
+/* Devuelve 1 si se registra lo que tenga el nivel dado, para no preparar argumentos costosos en vano */
+int log_enabled(enum log_level level);
+
+/* Registra un mensaje en el destino dado, con el formato de printf. El formato debe vivir hasta que
+   el escritor lo use (en la práctica, una cadena literal); los argumentos de cadena sí se copian.
+   Admite las conversiones enteras, de coma flotante, de cadenas, de punteros y '%%', con cualquier
+   modificador salvo 'L' */
+void log_msg(enum log_level level, struct log_target *target, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* Registra un objeto grande (como un archivo entero) sin copiarlo: el escritor llama a 'print' para
+   escribirlo en el destino y después a 'release' para soltarlo. El llamador debe haber tomado lo que
+   'release' suelta. Si el nivel no se registra o el búfer está lleno, se llama a 'release' enseguida */
+void log_dump(enum log_level level, struct log_target *target, void (*print)(void *obj, FILE *file),
+              void (*release)(void *obj), void *obj);
+
+/* Crea un destino en el fichero con el nombre dado, que el escritor abre en modo de agregado */
+struct log_target *log_open(const char *name);
+
+/* Cierra un destino creado con log_open. El escritor lo cierra y lo libera después de escribir todo
+   lo registrado antes en él (por cualquier hilo), así que nadie debe volver a usarlo */
+void log_close(struct log_target *target);
+
+/* Número de registros descartados porque el búfer de su hilo estaba lleno */
+uint64_t log_dropped();
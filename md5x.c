@@ -0,0 +1,550 @@
+#include "md5x.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> //intrínsecos SSE2, AVX2 y AVX-512
+#define MD5X_X86
+#endif
+
+/*
+   En este archivo implementamos MD5 con un núcleo de compresión de múltiples carriles.
+   Todos los núcleos comparten la misma lista de 64 pasos (MD5X_STEPS), y cada uno define
+   las operaciones sobre su tipo de dato: enteros de 32 bits para el núcleo escalar, y vectores
+   de 4, 8 o 16 enteros para SSE2, AVX2 y AVX-512. Las versiones vectoriales se compilan con
+   atributos "target", así que no necesitamos banderas especiales en el Makefile, y solo se
+   ejecutan si el procesador las soporta.
+*/
+
+/* Los 64 pasos de MD5: función de ronda, orden de los registros, palabra del bloque,
+   constante y rotación de cada paso */
+#define MD5X_STEPS \
+  STEP(F, a, b, c, d,  0, 0xd76aa478,  7) \
+  STEP(F, d, a, b, c,  1, 0xe8c7b756, 12) \
+  STEP(F, c, d, a, b,  2, 0x242070db, 17) \
+  STEP(F, b, c, d, a,  3, 0xc1bdceee, 22) \
+  STEP(F, a, b, c, d,  4, 0xf57c0faf,  7) \
+  STEP(F, d, a, b, c,  5, 0x4787c62a, 12) \
+  STEP(F, c, d, a, b,  6, 0xa8304613, 17) \
+  STEP(F, b, c, d, a,  7, 0xfd469501, 22) \
+  STEP(F, a, b, c, d,  8, 0x698098d8,  7) \
+  STEP(F, d, a, b, c,  9, 0x8b44f7af, 12) \
+  STEP(F, c, d, a, b, 10, 0xffff5bb1, 17) \
+  STEP(F, b, c, d, a, 11, 0x895cd7be, 22) \
+  STEP(F, a, b, c, d, 12, 0x6b901122,  7) \
+  STEP(F, d, a, b, c, 13, 0xfd987193, 12) \
+  STEP(F, c, d, a, b, 14, 0xa679438e, 17) \
+  STEP(F, b, c, d, a, 15, 0x49b40821, 22) \
+  STEP(G, a, b, c, d,  1, 0xf61e2562,  5) \
+  STEP(G, d, a, b, c,  6, 0xc040b340,  9) \
+  STEP(G, c, d, a, b, 11, 0x265e5a51, 14) \
+  STEP(G, b, c, d, a,  0, 0xe9b6c7aa, 20) \
+  STEP(G, a, b, c, d,  5, 0xd62f105d,  5) \
+  STEP(G, d, a, b, c, 10, 0x02441453,  9) \
+  STEP(G, c, d, a, b, 15, 0xd8a1e681, 14) \
+  STEP(G, b, c, d, a,  4, 0xe7d3fbc8, 20) \
+  STEP(G, a, b, c, d,  9, 0x21e1cde6,  5) \
+  STEP(G, d, a, b, c, 14, 0xc33707d6,  9) \
+  STEP(G, c, d, a, b,  3, 0xf4d50d87, 14) \
+  STEP(G, b, c, d, a,  8, 0x455a14ed, 20) \
+  STEP(G, a, b, c, d, 13, 0xa9e3e905,  5) \
+  STEP(G, d, a, b, c,  2, 0xfcefa3f8,  9) \
+  STEP(G, c, d, a, b,  7, 0x676f02d9, 14) \
+  STEP(G, b, c, d, a, 12, 0x8d2a4c8a, 20) \
+  STEP(H, a, b, c, d,  5, 0xfffa3942,  4) \
+  STEP(H, d, a, b, c,  8, 0x8771f681, 11) \
+  STEP(H, c, d, a, b, 11, 0x6d9d6122, 16) \
+  STEP(H, b, c, d, a, 14, 0xfde5380c, 23) \
+  STEP(H, a, b, c, d,  1, 0xa4beea44,  4) \
+  STEP(H, d, a, b, c,  4, 0x4bdecfa9, 11) \
+  STEP(H, c, d, a, b,  7, 0xf6bb4b60, 16) \
+  STEP(H, b, c, d, a, 10, 0xbebfbc70, 23) \
+  STEP(H, a, b, c, d, 13, 0x289b7ec6,  4) \
+  STEP(H, d, a, b, c,  0, 0xeaa127fa, 11) \
+  STEP(H, c, d, a, b,  3, 0xd4ef3085, 16) \
+  STEP(H, b, c, d, a,  6, 0x04881d05, 23) \
+  STEP(H, a, b, c, d,  9, 0xd9d4d039,  4) \
+  STEP(H, d, a, b, c, 12, 0xe6db99e5, 11) \
+  STEP(H, c, d, a, b, 15, 0x1fa27cf8, 16) \
+  STEP(H, b, c, d, a,  2, 0xc4ac5665, 23) \
+  STEP(I, a, b, c, d,  0, 0xf4292244,  6) \
+  STEP(I, d, a, b, c,  7, 0x432aff97, 10) \
+  STEP(I, c, d, a, b, 14, 0xab9423a7, 15) \
+  STEP(I, b, c, d, a,  5, 0xfc93a039, 21) \
+  STEP(I, a, b, c, d, 12, 0x655b59c3,  6) \
+  STEP(I, d, a, b, c,  3, 0x8f0ccc92, 10) \
+  STEP(I, c, d, a, b, 10, 0xffeff47d, 15) \
+  STEP(I, b, c, d, a,  1, 0x85845dd1, 21) \
+  STEP(I, a, b, c, d,  8, 0x6fa87e4f,  6) \
+  STEP(I, d, a, b, c, 15, 0xfe2ce6e0, 10) \
+  STEP(I, c, d, a, b,  6, 0xa3014314, 15) \
+  STEP(I, b, c, d, a, 13, 0x4e0811a1, 21) \
+  STEP(I, a, b, c, d,  4, 0xf7537e82,  6) \
+  STEP(I, d, a, b, c, 11, 0xbd3af235, 10) \
+  STEP(I, c, d, a, b,  2, 0x2ad7d2bb, 15) \
+  STEP(I, b, c, d, a,  9, 0xeb86d391, 21)
+
+/* Valores iniciales del estado MD5 */
+static const uint32_t md5x_iv[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+/* Lee una palabra de 32 bits en orden little-endian, que es el orden de MD5 */
+static inline uint32_t load_le32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Escribe una palabra de 32 bits en orden little-endian */
+static inline void store_le32(uint8_t *p, uint32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+/* ---------- Núcleo escalar (un carril) ---------- */
+
+#define F(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define G(b, c, d) ((c) ^ ((d) & ((b) ^ (c))))
+#define H(b, c, d) ((b) ^ (c) ^ (d))
+#define I(b, c, d) ((c) ^ ((b) | ~(d)))
+#define STEP(f, a, b, c, d, g, t, s)              \
+  a += f(b, c, d) + x[g] + (t);                  \
+  a = ((a << (s)) | (a >> (32 - (s)))) + b;
+
+/* Comprime un bloque cuyas 16 palabras ya están en 'x' sobre el estado 'st' */
+static void compress_scalar(uint32_t st[4], const uint32_t x[16])
+{
+  uint32_t a = st[0], b = st[1], c = st[2], d = st[3];
+
+  MD5X_STEPS
+
+  st[0] += a;
+  st[1] += b;
+  st[2] += c;
+  st[3] += d;
+}
+
+#undef F
+#undef G
+#undef H
+#undef I
+#undef STEP
+
+/* El núcleo escalar en formato de carriles: solo usa el carril 0 */
+static void kernel_scalar(uint32_t st[4][MD5X_MAX_LANES], uint32_t w[16][MD5X_MAX_LANES])
+{
+  uint32_t s[4], x[16];
+  int i;
+
+  for (i = 0; i < 4; i++)
+  {
+    s[i] = st[i][0];
+  }
+  for (i = 0; i < 16; i++)
+  {
+    x[i] = w[i][0];
+  }
+
+  compress_scalar(s, x);
+
+  for (i = 0; i < 4; i++)
+  {
+    st[i][0] = s[i];
+  }
+}
+
+#ifdef MD5X_X86
+
+/* ---------- Núcleo SSE2 (4 carriles) ---------- */
+
+#define ADD(x, y) _mm_add_epi32(x, y)
+#define ROTL(x, s) _mm_or_si128(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - (s)))
+#define F(b, c, d) _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)))
+#define G(b, c, d) _mm_xor_si128(c, _mm_and_si128(d, _mm_xor_si128(b, c)))
+#define H(b, c, d) _mm_xor_si128(_mm_xor_si128(b, c), d)
+#define I(b, c, d) _mm_xor_si128(c, _mm_or_si128(b, _mm_xor_si128(d, ones)))
+#define STEP(f, a, b, c, d, g, t, s) \
+  a = ADD(b, ROTL(ADD(ADD(a, f(b, c, d)), ADD(x[g], _mm_set1_epi32((int)(t)))), s));
+
+__attribute__((target("sse2"))) static void kernel_sse2(uint32_t st[4][MD5X_MAX_LANES],
+                                                        uint32_t w[16][MD5X_MAX_LANES])
+{
+  const __m128i ones = _mm_set1_epi32(-1);
+  __m128i x[16], a, b, c, d, aa, bb, cc, dd;
+  int i;
+
+  for (i = 0; i < 16; i++)
+  {
+    x[i] = _mm_loadu_si128((const __m128i *)w[i]);
+  }
+  a = aa = _mm_loadu_si128((const __m128i *)st[0]);
+  b = bb = _mm_loadu_si128((const __m128i *)st[1]);
+  c = cc = _mm_loadu_si128((const __m128i *)st[2]);
+  d = dd = _mm_loadu_si128((const __m128i *)st[3]);
+
+  MD5X_STEPS
+
+  _mm_storeu_si128((__m128i *)st[0], ADD(a, aa));
+  _mm_storeu_si128((__m128i *)st[1], ADD(b, bb));
+  _mm_storeu_si128((__m128i *)st[2], ADD(c, cc));
+  _mm_storeu_si128((__m128i *)st[3], ADD(d, dd));
+}
+
+#undef ADD
+#undef ROTL
+#undef F
+#undef G
+#undef H
+#undef I
+#undef STEP
+
+/* ---------- Núcleo AVX2 (8 carriles) ---------- */
+
+#define ADD(x, y) _mm256_add_epi32(x, y)
+#define ROTL(x, s) _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+#define F(b, c, d) _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define G(b, c, d) _mm256_xor_si256(c, _mm256_and_si256(d, _mm256_xor_si256(b, c)))
+#define H(b, c, d) _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define I(b, c, d) _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, ones)))
+#define STEP(f, a, b, c, d, g, t, s) \
+  a = ADD(b, ROTL(ADD(ADD(a, f(b, c, d)), ADD(x[g], _mm256_set1_epi32((int)(t)))), s));
+
+__attribute__((target("avx2"))) static void kernel_avx2(uint32_t st[4][MD5X_MAX_LANES],
+                                                        uint32_t w[16][MD5X_MAX_LANES])
+{
+  const __m256i ones = _mm256_set1_epi32(-1);
+  __m256i x[16], a, b, c, d, aa, bb, cc, dd;
+  int i;
+
+  for (i = 0; i < 16; i++)
+  {
+    x[i] = _mm256_loadu_si256((const __m256i *)w[i]);
+  }
+  a = aa = _mm256_loadu_si256((const __m256i *)st[0]);
+  b = bb = _mm256_loadu_si256((const __m256i *)st[1]);
+  c = cc = _mm256_loadu_si256((const __m256i *)st[2]);
+  d = dd = _mm256_loadu_si256((const __m256i *)st[3]);
+
+  MD5X_STEPS
+
+  _mm256_storeu_si256((__m256i *)st[0], ADD(a, aa));
+  _mm256_storeu_si256((__m256i *)st[1], ADD(b, bb));
+  _mm256_storeu_si256((__m256i *)st[2], ADD(c, cc));
+  _mm256_storeu_si256((__m256i *)st[3], ADD(d, dd));
+}
+
+#undef ADD
+#undef ROTL
+#undef F
+#undef G
+#undef H
+#undef I
+#undef STEP
+
+/* ---------- Núcleo AVX-512 (16 carriles) ---------- */
+
+/* AVX-512 tiene rotaciones nativas, y cada función de ronda es una sola instrucción
+   "ternarylogic", cuyo inmediato es la tabla de verdad de la función */
+#define ADD(x, y) _mm512_add_epi32(x, y)
+#define ROTL(x, s) _mm512_rol_epi32(x, s)
+#define F(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xCA)
+#define G(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xE4)
+#define H(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define I(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0x39)
+#define STEP(f, a, b, c, d, g, t, s) \
+  a = ADD(b, ROTL(ADD(ADD(a, f(b, c, d)), ADD(x[g], _mm512_set1_epi32((int)(t)))), s));
+
+__attribute__((target("avx512f"))) static void kernel_avx512(uint32_t st[4][MD5X_MAX_LANES],
+                                                             uint32_t w[16][MD5X_MAX_LANES])
+{
+  __m512i x[16], a, b, c, d, aa, bb, cc, dd;
+  int i;
+
+  for (i = 0; i < 16; i++)
+  {
+    x[i] = _mm512_loadu_si512((const void *)w[i]);
+  }
+  a = aa = _mm512_loadu_si512((const void *)st[0]);
+  b = bb = _mm512_loadu_si512((const void *)st[1]);
+  c = cc = _mm512_loadu_si512((const void *)st[2]);
+  d = dd = _mm512_loadu_si512((const void *)st[3]);
+
+  MD5X_STEPS
+
+  _mm512_storeu_si512((void *)st[0], ADD(a, aa));
+  _mm512_storeu_si512((void *)st[1], ADD(b, bb));
+  _mm512_storeu_si512((void *)st[2], ADD(c, cc));
+  _mm512_storeu_si512((void *)st[3], ADD(d, dd));
+}
+
+#undef ADD
+#undef ROTL
+#undef F
+#undef G
+#undef H
+#undef I
+#undef STEP
+
+#endif
+
+/* ---------- Selección del núcleo ---------- */
+
+/* Núcleo activo, su número de carriles y su nombre. Se eligen la primera vez que se usan */
+static void (*kernel)(uint32_t st[4][MD5X_MAX_LANES], uint32_t w[16][MD5X_MAX_LANES]);
+static unsigned kernel_lanes;
+static const char *kernel_name;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* Intenta activar el núcleo de 'lanes' carriles, consultando al procesador (CPUID)
+   si soporta las instrucciones que necesita */
+static int set_kernel(unsigned lanes)
+{
+  switch (lanes)
+  {
+  case 1:
+    kernel = kernel_scalar;
+    kernel_name = "escalar";
+    break;
+
+#ifdef MD5X_X86
+  case 4:
+    if (!__builtin_cpu_supports("sse2"))
+    {
+      return 0;
+    }
+    kernel = kernel_sse2;
+    kernel_name = "sse2";
+    break;
+
+  case 8:
+    if (!__builtin_cpu_supports("avx2"))
+    {
+      return 0;
+    }
+    kernel = kernel_avx2;
+    kernel_name = "avx2";
+    break;
+
+  case 16:
+    if (!__builtin_cpu_supports("avx512f"))
+    {
+      return 0;
+    }
+    kernel = kernel_avx512;
+    kernel_name = "avx512";
+    break;
+#endif
+
+  default:
+    return 0;
+  }
+
+  kernel_lanes = lanes;
+  return 1;
+}
+
+/* Elige el núcleo más ancho que soporte el procesador */
+static void detect_kernel()
+{
+#ifdef MD5X_X86
+  __builtin_cpu_init();
+#endif
+  if (!set_kernel(16) && !set_kernel(8) && !set_kernel(4))
+  {
+    set_kernel(1);
+  }
+}
+
+/* Devuelve el número de carriles del núcleo activo */
+unsigned md5x_lanes()
+{
+  pthread_once(&kernel_once, detect_kernel);
+  return kernel_lanes;
+}
+
+/* Devuelve el nombre del núcleo activo */
+const char *md5x_kernel_name()
+{
+  pthread_once(&kernel_once, detect_kernel);
+  return kernel_name;
+}
+
+/* Fuerza el núcleo de 'lanes' carriles, si el procesador lo soporta */
+int md5x_select(unsigned lanes)
+{
+  pthread_once(&kernel_once, detect_kernel);
+  return set_kernel(lanes);
+}
+
+/* ---------- Interfaz de un solo carril ---------- */
+
+/* Inicializa un estado MD5 con los valores iniciales del algoritmo */
+void md5x_init(uint32_t st[4])
+{
+  memcpy(st, md5x_iv, sizeof(md5x_iv));
+}
+
+/* Procesa bloques completos de 64 bytes sobre un estado de un solo carril */
+void md5x_blocks(uint32_t st[4], const uint8_t *data, size_t nblocks)
+{
+  uint32_t x[16];
+  size_t i;
+  int j;
+
+  for (i = 0; i < nblocks; i++, data += 64)
+  {
+    for (j = 0; j < 16; j++)
+    {
+      x[j] = load_le32(data + 4 * j);
+    }
+    compress_scalar(st, x);
+  }
+}
+
+/* Arma los bloques finales de un mensaje: la cola, el byte 0x80, ceros y la longitud en bits
+   en los últimos 8 bytes. Devuelve el número de bloques (1 o 2) escritos en 'buf' */
+unsigned md5x_pad(uint8_t *buf, const uint8_t *tail, size_t tail_len, uint64_t total)
+{
+  unsigned nblocks = (tail_len < 56) ? 1 : 2;
+
+  memset(buf, 0, 128);
+  memcpy(buf, tail, tail_len);
+  buf[tail_len] = 0x80;
+
+  uint64_t bits = total * 8;
+  store_le32(buf + (nblocks * 64) - 8, (uint32_t)bits);
+  store_le32(buf + (nblocks * 64) - 4, (uint32_t)(bits >> 32));
+
+  return nblocks;
+}
+
+/* Escribe el resumen de un estado de un solo carril */
+void md5x_digest(const uint32_t st[4], uint8_t *out)
+{
+  int i;
+  for (i = 0; i < 4; i++)
+  {
+    store_le32(out + 4 * i, st[i]);
+  }
+}
+
+/* Termina un hash de un solo carril con la cola y el relleno, y escribe el resumen */
+void md5x_final(uint32_t st[4], const uint8_t *tail, size_t tail_len, uint64_t total, uint8_t *out)
+{
+  uint8_t buf[128];
+
+  md5x_blocks(st, buf, md5x_pad(buf, tail, tail_len, total));
+  md5x_digest(st, out);
+}
+
+/* Calcula el MD5 de un mensaje completo con el núcleo escalar */
+void md5x(const uint8_t *data, size_t len, uint8_t *out)
+{
+  uint32_t st[4];
+  size_t full = len / 64;
+
+  md5x_init(st);
+  md5x_blocks(st, data, full);
+  md5x_final(st, data + full * 64, len - full * 64, len, out);
+}
+
+/* ---------- Interfaz de múltiples carriles ---------- */
+
+/* Copia un bloque de 64 bytes al carril dado de los bloques de mensaje */
+void md5x_load_lane(uint32_t w[16][MD5X_MAX_LANES], unsigned lane, const uint8_t *block)
+{
+  int j;
+  for (j = 0; j < 16; j++)
+  {
+    w[j][lane] = load_le32(block + 4 * j);
+  }
+}
+
+/* Escribe el resumen del carril dado */
+void md5x_digest_lane(uint32_t st[4][MD5X_MAX_LANES], unsigned lane, uint8_t *out)
+{
+  int i;
+  for (i = 0; i < 4; i++)
+  {
+    store_le32(out + 4 * i, st[i][lane]);
+  }
+}
+
+/* Comprime un bloque en cada carril con el núcleo activo */
+void md5x_compress_lanes(uint32_t st[4][MD5X_MAX_LANES], uint32_t w[16][MD5X_MAX_LANES])
+{
+  pthread_once(&kernel_once, detect_kernel);
+  kernel(st, w);
+}
+
+/* Calcula los MD5 de varias entradas independientes. Las repartimos en grupos del ancho del núcleo;
+   dentro de un grupo, cada carril avanza un bloque por compresión, y un carril que ya terminó su
+   entrada recibe un bloque vacío cuyo resultado ignoramos (su resumen ya fue copiado) */
+void md5x_many(const uint8_t *const *data, const uint32_t *len, uint8_t (*out)[16], unsigned n)
+{
+  static const uint8_t empty[64];
+  uint32_t st[4][MD5X_MAX_LANES], w[16][MD5X_MAX_LANES];
+  uint8_t tails[MD5X_MAX_LANES][128];
+  uint32_t full[MD5X_MAX_LANES], total[MD5X_MAX_LANES];
+  unsigned lanes = md5x_lanes();
+  unsigned first, l;
+
+  for (first = 0; first < n; first += lanes)
+  {
+    unsigned count = (n - first < lanes) ? (n - first) : lanes;
+    uint32_t max_blocks = 0, b;
+
+    /* Prepara el estado inicial y los bloques finales (con relleno) de cada carril */
+    for (l = 0; l < count; l++)
+    {
+      const uint8_t *d = data[first + l];
+      uint32_t dlen = len[first + l];
+
+      full[l] = dlen / 64;
+      total[l] = full[l] + md5x_pad(tails[l], d + full[l] * 64, dlen - full[l] * 64, dlen);
+      if (total[l] > max_blocks)
+      {
+        max_blocks = total[l];
+      }
+
+      int i;
+      for (i = 0; i < 4; i++)
+      {
+        st[i][l] = md5x_iv[i];
+      }
+    }
+
+    /* Los carriles sobrantes del último grupo no se usan */
+    for (l = count; l < lanes; l++)
+    {
+      md5x_load_lane(w, l, empty);
+    }
+
+    for (b = 0; b < max_blocks; b++)
+    {
+      for (l = 0; l < count; l++)
+      {
+        const uint8_t *block = empty;
+        if (b < full[l])
+        {
+          block = data[first + l] + b * 64;
+        }
+        else if (b < total[l])
+        {
+          block = tails[l] + (b - full[l]) * 64;
+        }
+        md5x_load_lane(w, l, block);
+      }
+
+      kernel(st, w);
+
+      /* Copia el resumen de los carriles que acaban de procesar su último bloque */
+      for (l = 0; l < count; l++)
+      {
+        if (b + 1 == total[l])
+        {
+          md5x_digest_lane(st, l, out[first + l]);
+        }
+      }
+    }
+  }
+}
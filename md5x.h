@@ -0,0 +1,66 @@
+#ifndef MD5X_H
+#define MD5X_H
+
+#include <stdint.h>  //tipos portátiles (uint8_t, uint32_t, etc...)
+#include <stddef.h>  //size_t
+#include <string.h>  //memcpy, memset
+#include <pthread.h> //pthread_once, para elegir el núcleo de cómputo una sola vez
+
+/* Implementación propia de MD5 con un núcleo de compresión de múltiples carriles ("multi-buffer").
+   Un carril es una entrada independiente: el núcleo procesa un bloque de 64 bytes de cada carril
+   a la vez, usando SSE2 (4 carriles), AVX2 (8) o AVX-512 (16) según lo que soporte el procesador,
+   que consultamos en tiempo de ejecución. Si no hay ninguna extensión disponible, usamos un núcleo
+   escalar de un solo carril. Los resultados son idénticos bit a bit a los de OpenSSL.
+
+   Los estados y los bloques de mensaje de los carriles se guardan en formato "estructura de arreglos":
+   st[i][l] es la palabra i del estado del carril l, y w[j][l] es la palabra j del bloque del carril l.
+   Los arreglos siempre tienen espacio para el máximo de carriles, aunque el núcleo activo use menos. */
+
+/* Número máximo de carriles de cualquier núcleo */
+#define MD5X_MAX_LANES 16
+
+/* Inicializa un estado MD5 (de un solo carril) con los valores iniciales del algoritmo */
+void md5x_init(uint32_t st[4]);
+
+/* Procesa 'nblocks' bloques completos de 64 bytes de 'data' sobre un estado de un solo carril */
+void md5x_blocks(uint32_t st[4], const uint8_t *data, size_t nblocks);
+
+/* Termina un hash de un solo carril: procesa la cola 'tail' (menos de 64 bytes) con el relleno de MD5,
+   donde 'total' es la longitud de todo el mensaje, y escribe el resumen de 16 bytes en 'out' */
+void md5x_final(uint32_t st[4], const uint8_t *tail, size_t tail_len, uint64_t total, uint8_t *out);
+
+/* Arma los bloques finales de un mensaje en 'buf' (128 bytes): la cola 'tail' (menos de 64 bytes),
+   el byte 0x80, ceros y la longitud total en bits. Devuelve el número de bloques escritos (1 o 2) */
+unsigned md5x_pad(uint8_t *buf, const uint8_t *tail, size_t tail_len, uint64_t total);
+
+/* Escribe el resumen de 16 bytes de un estado de un solo carril en 'out' */
+void md5x_digest(const uint32_t st[4], uint8_t *out);
+
+/* Calcula el MD5 de 'len' bytes de 'data' de una sola vez, con el núcleo escalar */
+void md5x(const uint8_t *data, size_t len, uint8_t *out);
+
+/* Devuelve el número de carriles del núcleo activo (1, 4, 8 o 16) */
+unsigned md5x_lanes();
+
+/* Devuelve el nombre del núcleo activo, para informes */
+const char *md5x_kernel_name();
+
+/* Fuerza el núcleo de 'lanes' carriles, si el procesador lo soporta. Devuelve 1 si se pudo cambiar,
+   0 en caso contrario. Solo está pensado para pruebas de rendimiento, no debe llamarse mientras
+   otros hilos estén hasheando */
+int md5x_select(unsigned lanes);
+
+/* Copia el bloque de 64 bytes 'block' al carril 'lane' de los bloques de mensaje 'w' */
+void md5x_load_lane(uint32_t w[16][MD5X_MAX_LANES], unsigned lane, const uint8_t *block);
+
+/* Escribe el resumen de 16 bytes del carril 'lane' del estado 'st' en 'out' */
+void md5x_digest_lane(uint32_t st[4][MD5X_MAX_LANES], unsigned lane, uint8_t *out);
+
+/* Comprime un bloque en cada uno de los md5x_lanes() carriles, actualizando sus estados */
+void md5x_compress_lanes(uint32_t st[4][MD5X_MAX_LANES], uint32_t w[16][MD5X_MAX_LANES]);
+
+/* Calcula los MD5 de 'n' entradas independientes (data[i], de longitud len[i]), repartiéndolas
+   en los carriles del núcleo activo, y escribe el resumen de cada una en out[i] */
+void md5x_many(const uint8_t *const *data, const uint32_t *len, uint8_t (*out)[16], unsigned n);
+
+#endif
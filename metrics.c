@@ -0,0 +1,379 @@
+#include "metrics.h"
+#include <stdlib.h>      // mallocs, frees y demás
+#include <string.h>      // strncmp, memset
+#include <stdarg.h>      // argumentos variables de text_put
+#include <errno.h>       // errno, EINTR, ECONNREFUSED
+#include <time.h>        // clock_gettime, para medir los tiempos
+#include <unistd.h>      // close, unlink
+#include <poll.h>        // poll, para esperar conexiones y solicitudes con un plazo
+#include <sys/socket.h>  // el socket de las métricas
+#include <sys/un.h>      // sockaddr_un, su dirección
+#include <sys/stat.h>    // stat, para no borrar un fichero que no sea un socket
+#include <sys/eventfd.h> // para despertar al hilo de las métricas al detenerlo
+
+/* Este archivo implementa las métricas del nodo. Los contadores y los histogramas están repartidos
+   en METRICS_SHARDS porciones, cada una en sus propias líneas de caché; cada hilo elige una porción
+   la primera vez que actualiza algo y suma siempre en ella, con sumas atómicas relajadas (los hilos
+   que comparten porción, si hay más hilos que porciones, solo se estorban entre sí). La consulta
+   recorre todas las porciones y suma sus valores, así que nunca ve un contador a medio actualizar,
+   aunque sí puede ver un histograma con un tiempo registrado en un intervalo y todavía no en la suma.
+
+   Un hilo aparte atiende el socket Unix: acepta cada conexión, espera un momento por si el cliente
+   envía una petición HTTP, responde con el texto de todas las métricas y cierra la conexión. */
+
+/* Una porción de los contadores y los histogramas (los intervalos y la suma de los tiempos de cada
+   uno, en nanosegundos; el total de tiempos registrados es la suma de sus intervalos) */
+struct metrics_shard
+{
+	_Alignas(64) atomic_uint_fast64_t counters[METRIC_COUNTERS];
+	atomic_uint_fast64_t buckets[METRIC_HISTOGRAMS][METRICS_BUCKETS + 1];
+	atomic_uint_fast64_t sums[METRIC_HISTOGRAMS];
+};
+
+/* Descripción de un contador para la consulta: su nombre, su ayuda y si va por tipo de mensaje */
+struct counter_desc
+{
+	int counter;
+	int by_type;
+	const char *name, *help;
+};
+
+/* Texto en construcción (capacidad 'cap') */
+struct text
+{
+	char *data;
+	size_t len, cap;
+};
+
+static struct metrics_shard shards[METRICS_SHARDS];
+static atomic_uint_fast64_t gauges[METRIC_GAUGES];
+static atomic_uint next_shard;
+static __thread struct metrics_shard *my_shard;
+
+static int listen_sock = -1, wake_fd = -1;
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static pthread_t server;
+static int serving;
+
+/* Nombres de los tipos de mensaje, por su byte de tipo (0 para los desconocidos) */
+static const char *type_names[METRIC_MSG_TYPES] = {"desconocido", "peerreq", "peerlist", "archreq", "archresp",
+												   "hello", "rangereq", "rangeresp", "tip"};
+
+static const struct counter_desc counter_descs[] = {
+	{METRIC_HASHES, 0, "blockchain_hashes_total", "Hashes calculados al minar"},
+	{METRIC_MINE_CANCELLED, 0, "blockchain_mine_cancelled_total",
+	 "Minados interrumpidos porque cambió el archivo activo"},
+	{METRIC_MSGS_IN, 1, "blockchain_messages_received_total", "Mensajes recibidos de los pares"},
+	{METRIC_BYTES_IN, 1, "blockchain_bytes_received_total", "Bytes de los mensajes recibidos de los pares"},
+	{METRIC_MSGS_OUT, 1, "blockchain_messages_sent_total", "Mensajes encolados para enviar a los pares"},
+	{METRIC_BYTES_OUT, 1, "blockchain_bytes_sent_total", "Bytes de los mensajes encolados para enviar a los pares"},
+	{METRIC_MSGS_REPLACED, 1, "blockchain_messages_replaced_total",
+	 "Mensajes encolados que se descartaron sin enviar porque llegó uno más nuevo"},
+	{METRIC_CONNS_IN, 0, "blockchain_incoming_connections_total", "Conexiones entrantes establecidas"},
+	{METRIC_CONNS_OUT, 0, "blockchain_outgoing_connections_total", "Conexiones salientes establecidas"},
+	{METRIC_CONNS_CLOSED, 0, "blockchain_connections_closed_total", "Conexiones establecidas que se cerraron"},
+	{METRIC_DIALS_FAILED, 0, "blockchain_dials_failed_total", "Conexiones salientes que no se establecieron"},
+	{METRIC_ARCHIVES_REPLACED, 0, "blockchain_archive_replacements_total",
+	 "Veces que un archivo recibido reemplazó al activo"}};
+
+static const char *hist_names[METRIC_HISTOGRAMS][2] = {
+	{"blockchain_mine_seconds", "Tiempo hasta encontrar el código de un mensaje"},
+	{"blockchain_validate_seconds", "Tiempo de verificar el hash de un mensaje recibido"}};
+
+static const char *gauge_names[METRIC_GAUGES][2] = {
+	{"blockchain_peers", "IPs de pares conectados"},
+	{"blockchain_connections", "Conexiones con pares, establecidas o en curso"},
+	{"blockchain_hash_rate", "Hashes por segundo del último minado"}};
+
+/* Devuelve la porción del hilo actual, eligiéndola la primera vez */
+static struct metrics_shard *shard_get()
+{
+	if (my_shard == NULL)
+	{
+		my_shard = &shards[atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % METRICS_SHARDS];
+	}
+	return my_shard;
+}
+
+void metrics_add(int counter, uint64_t n)
+{
+	atomic_fetch_add_explicit(&shard_get()->counters[counter], n, memory_order_relaxed);
+}
+
+void metrics_observe(enum metric_histogram hist, uint64_t ns, uint64_t n)
+{
+	uint64_t bound = 64;
+	int i = 0;
+	while (i < METRICS_BUCKETS && ns > bound)
+	{
+		bound *= 4;
+		i++;
+	}
+
+	struct metrics_shard *s = shard_get();
+	atomic_fetch_add_explicit(&s->buckets[hist][i], n, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->sums[hist], ns * n, memory_order_relaxed);
+}
+
+void metrics_set(enum metric_gauge gauge, uint64_t value)
+{
+	atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+int metric_msg_type(uint8_t type)
+{
+	return type < METRIC_MSG_TYPES ? type : 0;
+}
+
+uint64_t metrics_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Agrega texto con el formato de printf al final del texto en construcción */
+static void text_put(struct text *t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void text_put(struct text *t, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(t->data + t->len, t->cap - t->len, fmt, ap);
+	va_end(ap);
+
+	if ((size_t)n >= t->cap - t->len)
+	{
+		while ((size_t)n >= t->cap - t->len)
+		{
+			t->cap *= 2;
+		}
+		t->data = (char *)realloc(t->data, t->cap);
+		va_start(ap, fmt);
+		vsnprintf(t->data + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+	}
+	t->len += n;
+}
+
+/* Suma el contador dado en todas las porciones */
+static uint64_t counter_total(int counter)
+{
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < METRICS_SHARDS; i++)
+	{
+		total += atomic_load_explicit(&shards[i].counters[counter], memory_order_relaxed);
+	}
+	return total;
+}
+
+size_t metrics_format(char **text)
+{
+	struct text t = {(char *)malloc(4096), 0, 4096};
+	uint32_t i, j;
+	int k;
+
+	for (i = 0; i < sizeof(counter_descs) / sizeof(counter_descs[0]); i++)
+	{
+		const struct counter_desc *d = &counter_descs[i];
+		text_put(&t, "# HELP %s %s.\n# TYPE %s counter\n", d->name, d->help, d->name);
+		if (!d->by_type)
+		{
+			text_put(&t, "%s %lu\n", d->name, (unsigned long)counter_total(d->counter));
+			continue;
+		}
+		for (j = 0; j < METRIC_MSG_TYPES; j++)
+		{
+			text_put(&t, "%s{type=\"%s\"} %lu\n", d->name, type_names[j],
+					 (unsigned long)counter_total(d->counter + j));
+		}
+	}
+
+	/* Los intervalos de Prometheus son acumulativos, y sus límites y la suma van en segundos */
+	for (i = 0; i < METRIC_HISTOGRAMS; i++)
+	{
+		uint64_t buckets[METRICS_BUCKETS + 1] = {0}, sum = 0, count = 0, bound = 64;
+		for (k = 0; k < METRICS_SHARDS; k++)
+		{
+			for (j = 0; j <= METRICS_BUCKETS; j++)
+			{
+				buckets[j] += atomic_load_explicit(&shards[k].buckets[i][j], memory_order_relaxed);
+			}
+			sum += atomic_load_explicit(&shards[k].sums[i], memory_order_relaxed);
+		}
+
+		text_put(&t, "# HELP %s %s.\n# TYPE %s histogram\n", hist_names[i][0], hist_names[i][1], hist_names[i][0]);
+		for (j = 0; j < METRICS_BUCKETS; j++, bound *= 4)
+		{
+			count += buckets[j];
+			text_put(&t, "%s_bucket{le=\"%g\"} %lu\n", hist_names[i][0], bound / 1e9, (unsigned long)count);
+		}
+		count += buckets[METRICS_BUCKETS];
+		text_put(&t, "%s_bucket{le=\"+Inf\"} %lu\n", hist_names[i][0], (unsigned long)count);
+		text_put(&t, "%s_sum %.9f\n%s_count %lu\n", hist_names[i][0], sum / 1e9, hist_names[i][0],
+				 (unsigned long)count);
+	}
+
+	for (i = 0; i < METRIC_GAUGES; i++)
+	{
+		text_put(&t, "# HELP %s %s.\n# TYPE %s gauge\n%s %lu\n", gauge_names[i][0], gauge_names[i][1],
+				 gauge_names[i][0], gauge_names[i][0],
+				 (unsigned long)atomic_load_explicit(&gauges[i], memory_order_relaxed));
+	}
+
+	*text = t.data;
+	return t.len;
+}
+
+/* Envía 'len' bytes por el socket, sin quedarse esperando a un cliente que no los lee */
+static void send_all(int sock, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/* Responde a un cliente con el texto de las métricas, con un encabezado HTTP si lo pidió por HTTP */
+static void metrics_reply(int client)
+{
+	struct pollfd pfd = {client, POLLIN, 0};
+	struct timeval timeout = {1, 0};
+	char request[1024], *text;
+	int http = 0;
+
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (poll(&pfd, 1, METRICS_REQUEST_MS) == 1 && (pfd.revents & POLLIN))
+	{
+		ssize_t n = recv(client, request, sizeof(request), MSG_DONTWAIT);
+		http = n >= 4 && strncmp(request, "GET ", 4) == 0;
+	}
+
+	size_t len = metrics_format(&text);
+	if (http)
+	{
+		char header[128];
+		int n = snprintf(header, sizeof(header),
+						 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+						 len);
+		send_all(client, header, n);
+	}
+	send_all(client, text, len);
+	free(text);
+}
+
+/* Hilo de las métricas: atiende a los clientes de a uno hasta que lo despierten para terminar */
+static void *metrics_thread(void *arg)
+{
+	(void)arg;
+	struct pollfd pfds[2] = {{listen_sock, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+
+	while (1)
+	{
+		if (poll(pfds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if (pfds[1].revents & POLLIN)
+		{
+			break;
+		}
+		if (pfds[0].revents & POLLIN)
+		{
+			int client = accept(listen_sock, NULL, NULL);
+			if (client != -1)
+			{
+				metrics_reply(client);
+				close(client);
+			}
+		}
+	}
+	return NULL;
+}
+
+int metrics_start(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listen_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_sock == -1)
+	{
+		return -1;
+	}
+
+	/* Un socket que quedó de una ejecución anterior (nadie lo atiende) se reemplaza; uno de otro nodo
+	   en marcha o cualquier otro fichero, no */
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+		connect(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED)
+	{
+		unlink(path);
+	}
+	close(listen_sock);
+
+	listen_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (listen_sock == -1 || wake_fd == -1 || bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		metrics_stop();
+		return -1;
+	}
+	strcpy(sock_path, path);
+
+	if (listen(listen_sock, 16) == -1 || pthread_create(&server, NULL, metrics_thread, NULL) != 0)
+	{
+		metrics_stop();
+		return -1;
+	}
+	serving = 1;
+	return 0;
+}
+
+void metrics_stop()
+{
+	/* Si el hilo está en marcha, lo despertamos y esperamos a que termine */
+	uint64_t one = 1;
+	if (serving && write(wake_fd, &one, sizeof(one)) == sizeof(one))
+	{
+		pthread_join(server, NULL);
+	}
+	serving = 0;
+
+	if (sock_path[0] != '\0')
+	{
+		unlink(sock_path);
+		sock_path[0] = '\0';
+	}
+	if (listen_sock != -1)
+	{
+		close(listen_sock);
+		listen_sock = -1;
+	}
+	if (wake_fd != -1)
+	{
+		close(wake_fd);
+		wake_fd = -1;
+	}
+}
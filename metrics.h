@@ -0,0 +1,102 @@
+#include <stdio.h>     // snprintf, para armar el texto de las métricas
+#include <stdint.h>    // tipos de tamaño portátil (uint8_t, uint32_t, etc.)
+#include <stdatomic.h> // contadores que actualizan varios hilos sin bloqueos
+#include <pthread.h>   // hilo que atiende las consultas de métricas
+
+/* Métricas del nodo: contadores, histogramas de tiempos y valores instantáneos, que cualquier hilo
+   actualiza sin bloqueos y que se consultan como texto por un socket Unix local. Cada hilo suma en
+   su propia porción de los contadores (en líneas de caché distintas), y solo la consulta las suma
+   todas, así que actualizar una métrica cuesta una suma atómica que ningún otro hilo disputa. */
+
+/* Tipos de mensaje del protocolo para las métricas por tipo: el índice es el byte de tipo del
+   mensaje (MSG_PEERREQ a MSG_TIP), y 0 agrupa los tipos desconocidos */
+#define METRIC_MSG_TYPES 9
+
+/* Contadores. Los que van por tipo de mensaje ocupan METRIC_MSG_TYPES posiciones seguidas, y se
+   indexan sumando el tipo (ver metric_msg_type):
+   METRIC_HASHES         -> hashes calculados al minar
+   METRIC_MINE_CANCELLED -> minados interrumpidos porque cambió el archivo activo
+   METRIC_MSGS_IN/OUT    -> mensajes recibidos de los pares, y encolados para enviarles
+   METRIC_BYTES_IN/OUT   -> bytes de esos mensajes
+   METRIC_MSGS_REPLACED  -> mensajes encolados que se descartaron sin enviar porque llegó uno más nuevo
+                            del mismo tipo
+   METRIC_CONNS_IN/OUT   -> conexiones establecidas con pares, entrantes y salientes
+   METRIC_CONNS_CLOSED   -> conexiones establecidas que se cerraron
+   METRIC_DIALS_FAILED   -> conexiones salientes que no se llegaron a establecer
+   METRIC_ARCHIVES_REPLACED -> veces que un archivo recibido reemplazó al activo */
+enum metric_counter
+{
+  METRIC_HASHES,
+  METRIC_MINE_CANCELLED,
+  METRIC_MSGS_IN,
+  METRIC_BYTES_IN = METRIC_MSGS_IN + METRIC_MSG_TYPES,
+  METRIC_MSGS_OUT = METRIC_BYTES_IN + METRIC_MSG_TYPES,
+  METRIC_BYTES_OUT = METRIC_MSGS_OUT + METRIC_MSG_TYPES,
+  METRIC_MSGS_REPLACED = METRIC_BYTES_OUT + METRIC_MSG_TYPES,
+  METRIC_CONNS_IN = METRIC_MSGS_REPLACED + METRIC_MSG_TYPES,
+  METRIC_CONNS_OUT,
+  METRIC_CONNS_CLOSED,
+  METRIC_DIALS_FAILED,
+  METRIC_ARCHIVES_REPLACED,
+  METRIC_COUNTERS
+};
+
+/* Histogramas de tiempos, en nanosegundos:
+   METRIC_MINE_TIME     -> tiempo hasta encontrar el código de un mensaje
+   METRIC_VALIDATE_TIME -> tiempo de verificar el hash de un mensaje recibido (se mide por lote y se
+                           reparte entre sus mensajes) */
+enum metric_histogram
+{
+  METRIC_MINE_TIME,
+  METRIC_VALIDATE_TIME,
+  METRIC_HISTOGRAMS
+};
+
+/* Valores instantáneos, que fija un solo hilo:
+   METRIC_PEERS     -> IPs de pares conectados
+   METRIC_CONNS     -> conexiones con pares, establecidas o en curso
+   METRIC_HASH_RATE -> hashes por segundo del último minado */
+enum metric_gauge
+{
+  METRIC_PEERS,
+  METRIC_CONNS,
+  METRIC_HASH_RATE,
+  METRIC_GAUGES
+};
+
+/* Porciones de los contadores (los hilos se reparten entre ellas) y límites de los intervalos de
+   los histogramas: el intervalo i cuenta los tiempos de hasta 64 * 4^i nanosegundos (de 64 ns a
+   unos 17 segundos), y uno más los que superan al último */
+#define METRICS_SHARDS 16
+#define METRICS_BUCKETS 15
+
+/* Ruta predeterminada del socket de métricas, y cuánto esperamos que el cliente envíe su solicitud
+   (si envía una petición HTTP, respondemos con un encabezado HTTP; si no envía nada, solo el texto) */
+#define METRICS_PATH "metricas.sock"
+#define METRICS_REQUEST_MS 200
+
+/* Suma 'n' al contador dado */
+void metrics_add(int counter, uint64_t n);
+
+/* Registra 'n' tiempos de 'ns' nanosegundos cada uno en el histograma dado */
+void metrics_observe(enum metric_histogram hist, uint64_t ns, uint64_t n);
+
+/* Fija el valor instantáneo dado */
+void metrics_set(enum metric_gauge gauge, uint64_t value);
+
+/* Devuelve el índice de las métricas por tipo de mensaje que corresponde al byte de tipo dado */
+int metric_msg_type(uint8_t type);
+
+/* Tiempo actual en nanosegundos, con un reloj monótono, para medir lo que registran los histogramas */
+uint64_t metrics_now();
+
+/* Escribe todas las métricas en el formato de texto de Prometheus, en un búfer que el llamador debe
+   liberar con free. Devuelve la longitud del texto */
+size_t metrics_format(char **text);
+
+/* Crea el socket Unix en la ruta dada y lanza el hilo que responde a cada conexión con el texto de
+   las métricas. Devuelve 0, o -1 si no se pudo crear el socket o el hilo */
+int metrics_start(const char *path);
+
+/* Detiene el hilo de las métricas y elimina su socket */
+void metrics_stop();
@@ -0,0 +1,2144 @@
+#include "net.h"
+
+/* Este archivo implementa toda la comunicación con los pares sobre un único bucle de eventos.
+   Todos los sockets son no bloqueantes y los atiende un backend de red (epoll, aquí mismo, o
+   io_uring, en net_uring.c); un solo hilo espera sus eventos, recibe lo que llega a cada socket y lo
+   pasa a un analizador incremental que avanza campo a campo, sin importar cómo se fragmenten los
+   mensajes. Lo que no se puede enviar de inmediato se guarda en bloques pendientes por conexión. Las
+   solicitudes periódicas y los tiempos de espera se manejan con una rueda de temporizadores. Así, el
+   número de hilos no depende del número de pares conectados. */
+
+/* La lista de pares conectados. Esto debe ser global para ser compartido entre todos
+   los hilos (podríamos pasarla como parámetro, pero eso sería muy engorroso,
+   así que simplificamos haciéndolo global)
+   Debe ser seguro acceder a ella entre hilos porque main() la inicializa
+   antes de lanzar cualquier hilo, solo el hilo del bucle de eventos la modifica y los demás
+   leen su representación publicada */
+struct peer_list *peerlist;
+
+/* El archivo activo actual, que transmitiremos a cualquier par que envíe
+   mensajes de solicitud de archivo. Debe ser global por las mismas razones que la lista de pares.
+   Este será inicializado por el hilo principal tan pronto como comience la ejecución,
+   y nos aseguramos de que contenga un archivo adecuado antes de transmitirlo.
+   Los archivos publicados no se modifican: el hilo principal agrega mensajes a una copia, y tanto él
+   como el bucle de eventos (al recibir un archivo más grande) reemplazan el archivo activo entero.
+   Así nadie bloquea el archivo, y quien lo lee trabaja con una referencia que sigue siendo válida
+   aunque lo reemplacen mientras tanto. */
+struct snapshot active_arch;
+
+/* Almacenamiento en disco donde se guarda cada archivo activo nuevo, abierto por el hilo principal
+   (NULL si no se guarda) */
+struct store *archive_store;
+
+/* Dirección IP pública del dispositivo local, para evitar intentos de conexión a sí mismo */
+uint32_t myaddr;
+
+/* Estado del bucle de eventos, que solo toca su propio hilo: el socket de escucha, el eventfd para
+   despertarlo, el backend de red en uso, la rueda de temporizadores y la lista de conexiones */
+static int listen_sock = -1, wake_fd = -1;
+static const struct net_backend *backend;
+static struct timer_wheel wheel;
+
+/* Número de conexiones abiertas desde el inicio, para nombrar sus registros */
+static uint32_t conn_serial;
+
+/* Registro de las conexiones salientes en curso y de los fallos recientes de cada IP */
+static struct dialer dialer;
+static struct conn *conns;
+
+/* Número de conexiones en la lista, establecidas o en curso, para las métricas */
+static uint32_t nconns;
+
+/* Backend pedido con net_set_backend: "epoll", "uring" o "auto" */
+static const char *backend_choice = "auto";
+
+/* Banderas que otros hilos activan para pedir que se publique el archivo activo o que el
+   bucle de eventos termine */
+static atomic_int publish_pending;
+static atomic_int stop_pending;
+
+/* Tamaño de la punta más grande que pedimos a algún par, y cuándo la pedimos. Solo sirven
+   para no descargar los mismos mensajes de varios pares a la vez */
+static uint32_t fetch_size;
+static time_t fetch_time;
+
+/* Número de llamadas al sistema de red hechas por el hilo del bucle de eventos */
+uint64_t net_syscalls;
+
+/* Memoria ocupada por los archivos y rangos en recepción de todas las conexiones, y los límites por
+   par y total */
+static size_t rx_total;
+static size_t rx_peer_limit = RX_PEER_LIMIT, rx_total_limit = RX_TOTAL_LIMIT;
+
+/* Devuelve el tick actual del reloj monotónico */
+static uint64_t current_tick()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / NET_TICK_MS;
+}
+
+/* Saca un temporizador de su ranura, si estaba programado */
+static void timer_cancel(struct timer *t)
+{
+	if (t->next != NULL)
+	{
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		t->next = t->prev = NULL;
+	}
+}
+
+/* Programa un temporizador para el tick dado (o el siguiente, si ya pasó), reemplazando su
+   programación anterior */
+static void timer_schedule(struct timer *t, uint64_t expires)
+{
+	timer_cancel(t);
+	if (expires <= wheel.now)
+	{
+		expires = wheel.now + 1;
+	}
+	t->expires = expires;
+
+	struct timer *head = &wheel.slots[expires % TIMER_WHEEL_SLOTS];
+	t->next = head->next;
+	t->prev = head;
+	head->next->prev = t;
+	head->next = t;
+}
+
+/* Programa el temporizador de la conexión para el más próximo de sus plazos */
+static void conn_schedule(struct conn *c)
+{
+	uint64_t next = c->rx_deadline;
+	if (c->next_peerreq < next)
+	{
+		next = c->next_peerreq;
+	}
+	if (c->next_archreq < next)
+	{
+		next = c->next_archreq;
+	}
+	if (c->out_deadline != 0 && c->out_deadline < next)
+	{
+		next = c->out_deadline;
+	}
+	if (c->settle_deadline != 0 && c->settle_deadline < next)
+	{
+		next = c->settle_deadline;
+	}
+	timer_schedule(&c->timer, next);
+}
+
+/* Prepara al analizador para esperar 'want' bytes en el estado dado */
+static void expect(struct conn *c, int parse, uint32_t want)
+{
+	c->parse = parse;
+	c->want = want;
+	c->got = 0;
+}
+
+/* Crea una conexión para el socket dado y la agrega a la lista de conexiones */
+static struct conn *conn_create(int sock, uint32_t ip, int state)
+{
+	struct conn *c = (struct conn *)calloc(1, sizeof(struct conn));
+	c->sock = sock;
+	c->ip = ip;
+	c->state = state;
+	c->outgoing = state == CONN_CONNECTING;
+	c->mode = BODY_DRAIN;
+	expect(c, PARSE_TYPE, 1);
+
+	c->addr.sin_family = AF_INET;
+	c->addr.sin_port = htons(TCP_PORT_NUM);
+	c->addr.sin_addr.s_addr = ip;
+	snprintf(c->name, sizeof(c->name), "%s", inet_ntoa(c->addr.sin_addr));
+
+	c->next = conns;
+	c->prev = NULL;
+	if (conns != NULL)
+	{
+		conns->prev = c;
+	}
+	conns = c;
+	nconns++;
+
+	return c;
+}
+
+/* Devuelve 1 si la conexión es la que conservan ambos nodos cuando se conectan a la vez uno con el
+   otro: la que inició el nodo de IP menor */
+static int conn_preferred(const struct conn *c)
+{
+	return c->outgoing == (ntohl(myaddr) < ntohl(c->ip));
+}
+
+/* Mantenemos una sola conexión con cada IP. Si 'c', que se está abriendo, tiene otra ya abierta con
+   la misma IP, una de las dos se marca para cerrar. Cuando dos nodos se conectan a la vez uno con el
+   otro, cada uno termina con una conexión saliente y una entrante con el otro; en ese caso ambos se
+   quedan con la preferida (ver conn_preferred) sin necesidad de ponerse de acuerdo. Si están en el
+   mismo sentido, se cierra la nueva. Si la que sobra es la otra, sale de la lista de pares para que
+   'c' ocupe su lugar; como la otra no era la preferida, todavía no estaba asentada (ver conn_open)
+   y no llevó tráfico de archivos. Devuelve 1 si la que sobra es 'c' */
+static int conn_dedupe(struct conn *c)
+{
+	struct conn *other;
+	for (other = conns; other != NULL; other = other->next)
+	{
+		if (other != c && other->ip == c->ip && other->state == CONN_OPEN && !other->closing)
+		{
+			break;
+		}
+	}
+	if (other == NULL)
+	{
+		return 0;
+	}
+
+	struct conn *loser = c;
+	if (other->outgoing != c->outgoing && conn_preferred(c))
+	{
+		loser = other;
+	}
+
+	log_msg(LOG_INFO, &log_stdout, "Conexión duplicada con el par %s, cerrando la %s\n", c->name,
+			loser->outgoing ? "saliente" : "entrante");
+	loser->closing = 1;
+	if (loser == other)
+	{
+		remove_peer(peerlist, other->ip, other->sock);
+	}
+	return loser == c;
+}
+
+/* Devuelve 1 si tenemos una conexión saliente en curso con la IP dada */
+static int dialing(uint32_t ip)
+{
+	struct conn *c;
+	for (c = conns; c != NULL; c = c->next)
+	{
+		if (c->ip == ip && c->state == CONN_CONNECTING && !c->closing)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Asienta la conexión: ya no puede cerrarse por duplicada, así que desde ahora lleva tráfico de
+   archivos. Si es una conexión entrante, recién ahora enviamos el saludo, que le indica al par que
+   la asentamos */
+static void conn_settle(struct conn *c)
+{
+	c->settled = 1;
+	c->settle_deadline = 0;
+	if (!c->outgoing)
+	{
+		uint8_t hello = MSG_HELLO;
+		conn_send(c, &hello, 1);
+	}
+	log_msg(LOG_DEBUG, c->log, "Conexión asentada, ya no puede cerrarse por duplicada.\n");
+}
+
+/* Completa el establecimiento de una conexión: añade al par a la lista de pares conectados, abre su
+   archivo de registro, anuncia que soportamos la sincronización por rangos, envía la primera
+   solicitud de pares y programa las siguientes. Si ya teníamos una conexión con el par y sobra esta,
+   se cierra sin enviar nada por ella.
+
+   Una conexión que no es la preferida (ver conn_preferred) todavía podría cerrarse si el par nos
+   está conectando a la vez, así que no lleva tráfico de archivos (puntas, rangos ni archivos) hasta
+   que se asienta. El nodo de IP menor asienta la conexión entrante si no tiene una saliente en curso
+   con el par, o cuando esa falla (si se establece, la entrante se cierra), y recién entonces envía su
+   saludo; el de IP mayor asienta su conexión saliente al recibir ese saludo, o tras SETTLE_TIMEOUT
+   si el par no lo envía nunca (un par que no soporta rangos). La preferida se asienta enseguida */
+static void conn_open(struct conn *c)
+{
+	if (c->state == CONN_CONNECTING)
+	{
+		dialer_done(&dialer, c->ip, 1, wheel.now);
+	}
+	c->state = CONN_OPEN;
+	metrics_add(c->outgoing ? METRIC_CONNS_OUT : METRIC_CONNS_IN, 1);
+	if (is_connected(peerlist, c->ip) && conn_dedupe(c))
+	{
+		return;
+	}
+
+	add_peer(peerlist, c->ip, c->sock);
+	log_msg(LOG_INFO, &log_stdout, "Conectado exitosamente con el par %s\n", c->name);
+
+	/* Crea el registro de la conexión, con un nombre que no se repite aunque el sistema reutilice el
+	   descriptor del socket (lo abre el escritor de registros, no este hilo) */
+	char filename[32];
+	snprintf(filename, sizeof(filename), "%s_%u.log", c->name, ++conn_serial);
+	c->log = log_open(filename);
+
+	backend->watch(c);
+
+	uint8_t hello = MSG_HELLO, peerreq = MSG_PEERREQ;
+	if (conn_preferred(c))
+	{
+		c->settled = 1;
+	}
+	else if (c->outgoing)
+	{
+		c->settle_deadline = wheel.now + SETTLE_TIMEOUT;
+	}
+	else
+	{
+		c->settled = !dialing(c->ip);
+	}
+	if (c->outgoing || c->settled)
+	{
+		conn_send(c, &hello, 1);
+	}
+	conn_send(c, &peerreq, 1);
+
+	c->next_peerreq = wheel.now + PEERREQ_INTERVAL;
+	c->next_archreq = wheel.now + ARCHREQ_INTERVAL;
+	c->rx_deadline = wheel.now + RECV_TIMEOUT;
+	conn_schedule(c);
+}
+
+/* Devuelve 1 si la recepción de la conexión puede ocupar 'bytes' más sin superar los límites de
+   memoria por par y total, o 0 si no */
+static int rx_fits(struct conn *c, uint64_t bytes)
+{
+	return c->rx_held + bytes <= rx_peer_limit && rx_total + bytes <= rx_total_limit;
+}
+
+/* Actualiza la memoria contada de la conexión (y el total) con la que ocupa su archivo en recepción */
+static void rx_account(struct conn *c)
+{
+	rx_total += c->stream.held - c->rx_held;
+	c->rx_held = c->stream.held;
+}
+
+/* Descuenta del total la memoria de la recepción de la conexión, que terminó o se abandonó */
+static void rx_release(struct conn *c)
+{
+	rx_total -= c->rx_held;
+	c->rx_held = 0;
+}
+
+/* Cierra una conexión, eliminando al par de la lista de pares conectados. El backend cierra el
+   socket y libera la conexión */
+static void conn_destroy(struct conn *c)
+{
+	if (c->state == CONN_OPEN)
+	{
+		remove_peer(peerlist, c->ip, c->sock);
+		metrics_add(METRIC_CONNS_CLOSED, 1);
+	}
+	else if (c->state == CONN_CONNECTING)
+	{
+		dialer_done(&dialer, c->ip, 0, wheel.now);
+		metrics_add(METRIC_DIALS_FAILED, 1);
+
+		/* Si el par nos conectó mientras tanto, su conexión ya no tiene con cuál competir */
+		struct conn *other;
+		for (other = conns; other != NULL; other = other->next)
+		{
+			if (other->ip == c->ip && other->state == CONN_OPEN && !other->settled && !other->outgoing &&
+				!other->closing)
+			{
+				conn_settle(other);
+			}
+		}
+	}
+
+	if (c->mode != BODY_DRAIN)
+	{
+		stream_abort(&c->stream);
+		c->mode = BODY_DRAIN;
+	}
+	rx_release(c);
+
+	timer_cancel(&c->timer);
+
+	if (c->prev != NULL)
+	{
+		c->prev->next = c->next;
+	}
+	else
+	{
+		conns = c->next;
+	}
+	if (c->next != NULL)
+	{
+		c->next->prev = c->prev;
+	}
+	nconns--;
+
+	if (c->log != NULL)
+	{
+		log_close(c->log);
+		c->log = NULL;
+	}
+	backend->release(c);
+}
+
+/* Cierra las conexiones marcadas para cerrar. Las conexiones nunca se liberan en medio del
+   procesamiento de un evento, solo se marcan, porque otras partes del bucle podrían estar
+   iterando sobre ellas */
+static void reap_conns()
+{
+	struct conn *c = conns;
+	while (c != NULL)
+	{
+		struct conn *next = c->next;
+		if (c->closing)
+		{
+			conn_destroy(c);
+		}
+		c = next;
+	}
+}
+
+/* Libera un bloque de datos pendientes, soltando su archivo si lo tiene */
+static void chunk_free(struct out_chunk *chunk)
+{
+	if (chunk->arch != NULL)
+	{
+		archive_unref(chunk->arch);
+	}
+	free(chunk);
+}
+
+/* Deja de esperar a que la cola de salida baje si ya está dentro del límite */
+static void out_check(struct conn *c)
+{
+	if (c->out_deadline != 0 && c->out_bytes <= OUT_QUEUE_LIMIT)
+	{
+		log_msg(LOG_INFO, c->log, "Cola de salida de nuevo dentro del límite (%zu bytes pendientes).\n", c->out_bytes);
+		c->out_deadline = 0;
+	}
+}
+
+/* Descarta el mensaje pendiente del tipo dado, si lo hay y nadie empezó a enviarlo: no se tocan los
+   bloques que el backend está enviando en segundo plano ni los mensajes cuyo primer bloque ya salió
+   en parte (o entero, y entonces ya no está marcado). El plazo de la cola no cambia, porque en
+   seguida se encola el mensaje que lo reemplaza: solo lo que el par recibe la hace bajar */
+static void conn_drop_superseded(struct conn *c, int kind)
+{
+	struct out_chunk **link = &c->out_head, *prev = NULL;
+	uint32_t busy = c->send_inflight;
+
+	while (*link != NULL)
+	{
+		struct out_chunk *chunk = *link;
+		if (busy > 0 || !chunk->start || chunk->kind != kind || chunk->off != 0)
+		{
+			busy -= (busy > 0);
+			prev = chunk;
+			link = &chunk->next;
+			continue;
+		}
+
+		metrics_add(METRIC_MSGS_REPLACED + metric_msg_type(chunk->ptr[0]), 1);
+		do
+		{
+			struct out_chunk *next = chunk->next;
+			c->out_bytes -= chunk->len;
+			chunk_free(chunk);
+			chunk = next;
+		} while (chunk != NULL && chunk->kind == kind && !chunk->start);
+		*link = chunk;
+		if (chunk == NULL)
+		{
+			c->out_tail = prev;
+		}
+	}
+}
+
+/* Cuenta en las métricas 'msgs' mensajes del tipo dado, de 'len' bytes en total, encolados para enviar */
+static void count_sent(uint8_t type, size_t len, int msgs)
+{
+	int t = metric_msg_type(type);
+	metrics_add(METRIC_MSGS_OUT + t, msgs);
+	metrics_add(METRIC_BYTES_OUT + t, len);
+}
+
+/* Marca con el tipo dado los bloques del mensaje de 'len' bytes que se acaba de encolar después de
+   'last' (o al principio, si era NULL), cuando había 'pending' bytes pendientes. Solo se marca si el
+   mensaje quedó entero en la cola, sin que se enviara nada mientras tanto */
+static void conn_mark(struct conn *c, struct out_chunk *last, size_t pending, size_t len, int kind)
+{
+	if (c->out_bytes != pending + len)
+	{
+		return;
+	}
+
+	struct out_chunk *chunk = (last != NULL) ? last->next : c->out_head;
+	if (chunk != NULL)
+	{
+		chunk->start = 1;
+	}
+	for (; chunk != NULL; chunk = chunk->next)
+	{
+		chunk->kind = kind;
+	}
+}
+
+/* Encola 'len' bytes de 'data' para enviarlos a la conexión dada, después de sus datos pendientes */
+void conn_send(struct conn *c, const void *data, size_t len)
+{
+	if (c->closing || len == 0)
+	{
+		return;
+	}
+	struct iovec iov = {(void *)data, len};
+	count_sent(*(const uint8_t *)data, len, 1);
+	backend->send(c, &iov, 1, NULL);
+}
+
+/* Encola un mensaje del tipo dado, reemplazando al pendiente del mismo tipo que aún no salió */
+void conn_send_latest(struct conn *c, int kind, const void *data, size_t len)
+{
+	if (c->closing || len == 0)
+	{
+		return;
+	}
+
+	conn_drop_superseded(c, kind);
+	struct out_chunk *last = c->out_tail;
+	size_t pending = c->out_bytes;
+	struct iovec iov = {(void *)data, len};
+	count_sent(*(const uint8_t *)data, len, 1);
+	backend->send(c, &iov, 1, NULL);
+	conn_mark(c, last, pending, len, kind);
+}
+
+/* Encola la representación en cadena del archivo dado, a partir del mensaje 'from' (0 para enviarlo
+   entero), para enviarla a la conexión sin copiarla: un bloque por segmento del archivo. Todos los
+   segmentos se encolan de una vez, así que un archivo entero queda marcado como tal si no había nada
+   enviándose, y reemplaza al que esté pendiente */
+void conn_send_archive(struct conn *c, struct archive *arch, uint32_t from)
+{
+	if (c->closing)
+	{
+		return;
+	}
+
+	if (from == 0)
+	{
+		conn_drop_superseded(c, OUT_ARCHIVE);
+	}
+	struct out_chunk *last = c->out_tail;
+	size_t pending = c->out_bytes, len = 0;
+
+	uint32_t n = archive_iov(arch, from, NULL), i;
+	struct iovec *iov = (struct iovec *)malloc(n * sizeof(struct iovec));
+	archive_iov(arch, from, iov);
+	for (i = 0; i < n; i++)
+	{
+		len += iov[i].iov_len;
+	}
+	if (n > 0)
+	{
+		backend->send(c, iov, n, arch);
+	}
+	free(iov);
+
+	/* Un archivo entero es una respuesta de archivo; si no, es el cuerpo de una respuesta de rango,
+	   cuyo encabezado ya se contó */
+	if (from == 0)
+	{
+		count_sent(MSG_ARCHRESP, len, 1);
+		conn_mark(c, last, pending, len, OUT_ARCHIVE);
+	}
+	else
+	{
+		count_sent(MSG_RANGERESP, len, 0);
+	}
+}
+
+/* Agrega un nuevo bloque con 'len' bytes de 'data' al final de los datos pendientes de la conexión,
+   copiándolos o tomando una referencia al archivo del que forman parte. Si la cola supera su
+   límite, le damos al par OUT_STALL_TIMEOUT para vaciarla */
+void conn_queue(struct conn *c, const uint8_t *data, size_t len, struct archive *arch)
+{
+	struct out_chunk *chunk;
+	if (arch != NULL)
+	{
+		chunk = (struct out_chunk *)malloc(sizeof(struct out_chunk));
+		chunk->ptr = data;
+		chunk->arch = archive_ref(arch);
+	}
+	else
+	{
+		chunk = (struct out_chunk *)malloc(sizeof(struct out_chunk) + len);
+		memcpy(chunk->data, data, len);
+		chunk->ptr = chunk->data;
+		chunk->arch = NULL;
+	}
+	chunk->next = NULL;
+	chunk->len = len;
+	chunk->off = 0;
+	chunk->kind = OUT_PLAIN;
+	chunk->start = 0;
+
+	if (c->out_tail != NULL)
+	{
+		c->out_tail->next = chunk;
+	}
+	else
+	{
+		c->out_head = chunk;
+	}
+	c->out_tail = chunk;
+
+	c->out_bytes += len;
+	if (c->out_bytes > OUT_QUEUE_LIMIT && c->out_deadline == 0 && c->state == CONN_OPEN)
+	{
+		log_msg(LOG_WARN, c->log, "Cola de salida por encima del límite (%zu bytes pendientes)!\n", c->out_bytes);
+		c->out_deadline = wheel.now + OUT_STALL_TIMEOUT;
+		conn_schedule(c);
+	}
+}
+
+/* Descarta los primeros 'n' bytes de los datos pendientes de la conexión, que ya se enviaron,
+   liberando los bloques que se completaron */
+void conn_sent(struct conn *c, size_t n)
+{
+	c->out_bytes -= n;
+	out_check(c);
+
+	while (n > 0 && c->out_head != NULL)
+	{
+		struct out_chunk *chunk = c->out_head;
+		size_t left = chunk->len - chunk->off;
+		if (n < left)
+		{
+			chunk->off += n;
+			return;
+		}
+
+		n -= left;
+		c->out_head = chunk->next;
+		if (c->out_head == NULL)
+		{
+			c->out_tail = NULL;
+		}
+		chunk_free(chunk);
+	}
+}
+
+/* Libera todos los datos pendientes de la conexión */
+void conn_free_chunks(struct conn *c)
+{
+	while (c->out_head != NULL)
+	{
+		struct out_chunk *next = c->out_head->next;
+		chunk_free(c->out_head);
+		c->out_head = next;
+	}
+	c->out_tail = NULL;
+	c->out_bytes = 0;
+	c->out_deadline = 0;
+}
+
+/* Completa una conexión saliente en curso: la abre si 'err' es 0, o la cierra si no */
+void conn_connected(struct conn *c, int err)
+{
+	if (err != 0)
+	{
+		log_msg(LOG_WARN, &log_stderr, "No se pudo conectar con el par %s!\n", c->name);
+		c->closing = 1;
+		return;
+	}
+	conn_open(c);
+}
+
+/* Crea y abre una conexión para un socket entrante aceptado desde la IP dada */
+void accept_conn(int sock, uint32_t ip)
+{
+	log_msg(LOG_INFO, &log_stdout, "Conexión de par entrante aceptada!\n");
+	conn_open(conn_create(sock, ip, CONN_OPEN));
+}
+
+/* Entrega 'n' bytes recibidos por la conexión a su analizador. Si 'n' es 0, el par cerró la conexión,
+   y si es negativo, hubo un error (-n es el código de errno) */
+void conn_received(struct conn *c, const uint8_t *data, ssize_t n)
+{
+	if (c->closing)
+	{
+		return;
+	}
+
+	if (n < 0)
+	{
+		log_msg(LOG_WARN, &log_stderr, "Error al recibir del par %s (%s). Cerrando conexión...\n", c->name, strerror((int)-n));
+		c->closing = 1;
+		return;
+	}
+	if (n == 0)
+	{
+		log_msg(LOG_WARN, &log_stderr, "El par %s cerró la conexión. Cerrando conexión...\n", c->name);
+		c->closing = 1;
+		return;
+	}
+
+	c->rx_deadline = wheel.now + RECV_TIMEOUT;
+	if (conn_feed(c, data, n) == -1)
+	{
+		log_msg(LOG_WARN, &log_stderr, "Mensaje inválido o incompleto del par %s, cerrando conexión...\n", c->name);
+		c->closing = 1;
+	}
+}
+
+/* Atiende un despertar del bucle de eventos: si el hilo principal agregó un mensaje, publica el
+   archivo activo */
+void handle_wake()
+{
+	if (atomic_exchange(&publish_pending, 0))
+	{
+		struct archive *arch = snapshot_get(&active_arch);
+		publish_archive(arch);
+		archive_unref(arch);
+	}
+}
+
+/* Backend de epoll: los sockets se registran en una instancia de epoll, y se leen y escriben con
+   recv y sendmsg cuando están listos. Los mensajes cortos se intentan enviar de inmediato, y solo se
+   guardan los que el socket no acepta. Los archivos nunca se copian: los bloques pendientes apuntan
+   al archivo, se juntan varios en cada sendmsg y, si son grandes, se envían con MSG_ZEROCOPY */
+
+static int epfd = -1;
+
+/* Marcas para distinguir en los eventos de epoll el socket de escucha y el eventfd de las conexiones */
+static int listen_mark, wake_mark;
+
+/* Búfer de recepción compartido por todas las conexiones, ya que se procesa de inmediato */
+static uint8_t recv_buf[65536];
+
+/* Registra o actualiza los eventos de epoll de la conexión: siempre queremos saber cuándo llegan
+   datos, y cuándo hay espacio en el socket si tenemos datos pendientes o estamos conectando */
+static void epoll_update(struct conn *c)
+{
+	uint32_t events = EPOLLIN;
+	if (c->state == CONN_CONNECTING || c->out_head != NULL)
+	{
+		events |= EPOLLOUT;
+	}
+
+	if (events != c->events)
+	{
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->sock, &ev);
+		net_syscalls++;
+		c->events = events;
+	}
+}
+
+static int epoll_init(int lsock, int wfd)
+{
+	struct epoll_event ev;
+
+	if ((epfd = epoll_create1(0)) == -1)
+	{
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wake_mark;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wfd, &ev);
+
+	if (lsock != -1)
+	{
+		ev.events = EPOLLIN;
+		ev.data.ptr = &listen_mark;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev);
+	}
+	return 0;
+}
+
+static void epoll_watch(struct conn *c)
+{
+	/* Si el kernel no admite MSG_ZEROCOPY, los archivos se envían copiándolos, como todo lo demás */
+	int one = 1;
+	c->zerocopy = setsockopt(c->sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+	net_syscalls++;
+	epoll_update(c);
+}
+
+static int epoll_connect(struct conn *c)
+{
+	/* La conexión termina en segundo plano; nos enteramos cuando el socket se vuelve escribible.
+	   En la interfaz local puede terminar de inmediato */
+	net_syscalls++;
+	if (connect(c->sock, (struct sockaddr *)&c->addr, sizeof(c->addr)) == 0)
+	{
+		conn_open(c);
+		return 0;
+	}
+	if (errno != EINPROGRESS)
+	{
+		return -1;
+	}
+	epoll_update(c);
+	return 0;
+}
+
+/* Guarda una referencia a cada archivo de los primeros 'n' bloques pendientes, que el kernel puede
+   seguir leyendo después de la llamada a sendmsg con MSG_ZEROCOPY que acaba de hacerse */
+static void zc_hold(struct conn *c, int n)
+{
+	struct out_chunk *chunk = c->out_head;
+	struct archive *last = NULL;
+	for (; n > 0; n--, chunk = chunk->next)
+	{
+		if (chunk->arch == NULL || chunk->arch == last)
+		{
+			continue;
+		}
+		if (c->zc_count == c->zc_cap)
+		{
+			c->zc_cap = c->zc_cap ? 2 * c->zc_cap : 8;
+			c->zc_holds = (struct zc_hold *)realloc(c->zc_holds, c->zc_cap * sizeof(struct zc_hold));
+		}
+		c->zc_holds[c->zc_count].seq = c->zc_seq;
+		c->zc_holds[c->zc_count].arch = archive_ref(chunk->arch);
+		c->zc_count++;
+		last = chunk->arch;
+	}
+	c->zc_seq++;
+}
+
+/* Suelta los archivos de las llamadas con números de secuencia entre 'lo' y 'hi' (inclusive), que el
+   kernel ya terminó de enviar */
+static void zc_release(struct conn *c, uint32_t lo, uint32_t hi)
+{
+	uint32_t i, kept = 0;
+	for (i = 0; i < c->zc_count; i++)
+	{
+		if (c->zc_holds[i].seq - lo <= hi - lo)
+		{
+			archive_unref(c->zc_holds[i].arch);
+		}
+		else
+		{
+			c->zc_holds[kept++] = c->zc_holds[i];
+		}
+	}
+	c->zc_count = kept;
+}
+
+/* Lee los avisos de fin de los envíos sin copia de la cola de errores del socket. Si el kernel tuvo
+   que copiar los datos de todos modos (por ejemplo, en la interfaz local), dejamos de pedírselo */
+static void epoll_zerocopy_done(struct conn *c)
+{
+	while (c->zc_count > 0)
+	{
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		net_syscalls++;
+		if (recvmsg(c->sock, &msg, MSG_ERRQUEUE) == -1)
+		{
+			return;
+		}
+
+		struct cmsghdr *cm;
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR ||
+			    ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+			{
+				continue;
+			}
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			{
+				c->zerocopy = 0;
+			}
+			zc_release(c, ee->ee_info, ee->ee_data);
+		}
+	}
+}
+
+/* Envía los datos pendientes de la conexión, hasta vaciarlos o hasta que el socket se llene. Cada
+   llamada a sendmsg junta hasta SEND_IOV_MAX bloques, y una escritura parcial deja el primer bloque
+   sin terminar a partir de donde se cortó */
+static void epoll_flush(struct conn *c)
+{
+	while (c->out_head != NULL)
+	{
+		struct iovec iov[SEND_IOV_MAX];
+		struct out_chunk *chunk;
+		size_t total = 0, shared = 0;
+		int n = 0;
+
+		/* Con MSG_ZEROCOPY el kernel fija las páginas de todos los bloques de la llamada, así que
+		   si el socket lo admite no mezclamos bloques de archivos (que retenemos hasta el aviso)
+		   con mensajes cortos (que se liberan en cuanto se envían) */
+		int run = c->out_head->arch != NULL;
+		for (chunk = c->out_head; chunk != NULL && n < SEND_IOV_MAX; chunk = chunk->next, n++)
+		{
+			if (c->zerocopy && (chunk->arch != NULL) != run)
+			{
+				break;
+			}
+			iov[n].iov_base = (void *)(chunk->ptr + chunk->off);
+			iov[n].iov_len = chunk->len - chunk->off;
+			total += iov[n].iov_len;
+			if (chunk->arch != NULL)
+			{
+				shared += iov[n].iov_len;
+			}
+		}
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		int zerocopy = c->zerocopy && shared >= ZEROCOPY_MIN;
+		ssize_t sent = sendmsg(c->sock, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+		net_syscalls++;
+		if (sent == -1 && zerocopy && errno == ENOBUFS)
+		{
+			/* No queda memoria del socket para fijar más páginas: esta vez los copiamos */
+			zerocopy = 0;
+			sent = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
+			net_syscalls++;
+		}
+		if (sent == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				log_msg(LOG_WARN, c->log, "Error al enviar al par, ¿tubo roto?\n");
+				c->closing = 1;
+			}
+			break;
+		}
+
+		if (zerocopy)
+		{
+			zc_hold(c, n);
+		}
+		conn_sent(c, sent);
+		if ((size_t)sent < total)
+		{
+			break;
+		}
+	}
+	epoll_update(c);
+}
+
+static void epoll_send(struct conn *c, const struct iovec *iov, uint32_t n, struct archive *arch)
+{
+	const uint8_t *data = (const uint8_t *)iov[0].iov_base;
+	size_t len = iov[0].iov_len;
+	uint32_t i;
+
+	/* Si no hay nada pendiente, intentamos enviar los mensajes cortos directamente */
+	if (arch == NULL && c->out_head == NULL && c->state == CONN_OPEN)
+	{
+		ssize_t sent = send(c->sock, data, len, MSG_NOSIGNAL);
+		net_syscalls++;
+		if (sent == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				log_msg(LOG_WARN, c->log, "Error al enviar al par, ¿tubo roto?\n");
+				c->closing = 1;
+				return;
+			}
+			sent = 0;
+		}
+		if ((size_t)sent == len)
+		{
+			return;
+		}
+		data += sent;
+		len -= sent;
+	}
+
+	/* Los archivos se envían desde sus bloques, uno por segmento, que los referencian sin copiarlos.
+	   Se encolan todos y se empiezan a enviar juntos; si ya había datos pendientes, el socket está
+	   lleno y se enviarán cuando tenga espacio */
+	int idle = c->out_head == NULL;
+	conn_queue(c, data, len, arch);
+	for (i = 1; i < n; i++)
+	{
+		conn_queue(c, (const uint8_t *)iov[i].iov_base, iov[i].iov_len, arch);
+	}
+	if (arch != NULL && idle && c->state == CONN_OPEN)
+	{
+		epoll_flush(c);
+		return;
+	}
+	epoll_update(c);
+}
+
+static void epoll_release(struct conn *c)
+{
+	if (c->events)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+		net_syscalls++;
+	}
+
+	/* Si el kernel todavía puede estar leyendo archivos enviados sin copia, descartamos lo que quede
+	   en el socket al cerrarlo, para poder soltarlos ya */
+	if (c->zc_count > 0)
+	{
+		struct linger lg = {1, 0};
+		setsockopt(c->sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+		net_syscalls++;
+		zc_release(c, 0, UINT32_MAX);
+	}
+	free(c->zc_holds);
+
+	close(c->sock);
+	net_syscalls++;
+	conn_free_chunks(c);
+	free(c);
+}
+
+/* Acepta todas las conexiones entrantes pendientes */
+static void epoll_accept()
+{
+	while (1)
+	{
+		struct sockaddr_in peeraddr;
+		socklen_t peersize = sizeof(peeraddr);
+		int peersock = accept4(listen_sock, (struct sockaddr *)&peeraddr, &peersize, SOCK_NONBLOCK);
+		net_syscalls++;
+		if (peersock == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				log_msg(LOG_ERROR, &log_stderr, "Error, no se pudo aceptar la conexión del par!\n");
+			}
+			return;
+		}
+		accept_conn(peersock, peeraddr.sin_addr.s_addr);
+	}
+}
+
+/* Recibe todo lo disponible en el socket de la conexión y lo pasa a su analizador */
+static void epoll_readable(struct conn *c)
+{
+	while (!c->closing)
+	{
+		ssize_t n = recv(c->sock, recv_buf, sizeof(recv_buf), 0);
+		net_syscalls++;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		{
+			return;
+		}
+		conn_received(c, recv_buf, (n == -1) ? -errno : n);
+
+		/* Si no llenó el búfer, no queda nada más por leer */
+		if (n < (ssize_t)sizeof(recv_buf))
+		{
+			return;
+		}
+	}
+}
+
+static void epoll_wait_events(int timeout)
+{
+	struct epoll_event events[64];
+	int n = epoll_wait(epfd, events, 64, timeout);
+	int i;
+
+	net_syscalls++;
+	for (i = 0; i < n; i++)
+	{
+		void *ptr = events[i].data.ptr;
+
+		if (ptr == &listen_mark)
+		{
+			epoll_accept();
+			continue;
+		}
+
+		if (ptr == &wake_mark)
+		{
+			uint64_t count;
+			net_syscalls++;
+			if (read(wake_fd, &count, sizeof(count)) > 0)
+			{
+				handle_wake();
+			}
+			continue;
+		}
+
+		struct conn *c = (struct conn *)ptr;
+		if (c->closing)
+		{
+			continue;
+		}
+
+		if (c->state == CONN_CONNECTING)
+		{
+			if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			{
+				int err;
+				socklen_t len = sizeof(err);
+				getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+				net_syscalls++;
+				conn_connected(c, err);
+			}
+			continue;
+		}
+
+		if ((events[i].events & EPOLLERR) && c->zc_count > 0)
+		{
+			epoll_zerocopy_done(c);
+		}
+		if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		{
+			epoll_readable(c);
+		}
+		if ((events[i].events & EPOLLOUT) && !c->closing)
+		{
+			epoll_flush(c);
+		}
+	}
+}
+
+static void epoll_cleanup()
+{
+	close(epfd);
+	epfd = -1;
+}
+
+const struct net_backend epoll_backend = {
+	"epoll",
+	epoll_init,
+	epoll_watch,
+	epoll_connect,
+	epoll_send,
+	epoll_release,
+	epoll_wait_events,
+	epoll_cleanup};
+
+/* Resuelve la IP o nombre de host dado a una dirección IPv4 en 'ip' (orden de bytes de red).
+   Devuelve 0 si tuvo éxito, o -1 si no pudo resolverlo */
+int resolve_peer(char *host, uint32_t *ip)
+{
+	struct addrinfo hints, *peerinfo;
+	int addrinfo_rv;
+
+	/* Inicializa la estructura hints */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	/* Obtiene la lista de direcciones para el par dado, y nos quedamos con la primera */
+	if ((addrinfo_rv = getaddrinfo(host, TCP_PORT, &hints, &peerinfo)) != 0)
+	{
+		fprintf(stderr, "Error al recuperar la información de dirección del par!\n");
+		fprintf(stderr, "Estado de Addrinfo: %s\n", gai_strerror(addrinfo_rv));
+		return -1;
+	}
+
+	*ip = ((struct sockaddr_in *)peerinfo->ai_addr)->sin_addr.s_addr;
+	freeaddrinfo(peerinfo);
+	return 0;
+}
+
+/* Inicializa un socket TCP que se enlaza a la dirección local y devuelve su
+   ID de descriptor de archivo. Este socket se utilizará para aceptar conexiones entrantes
+   de otros pares. Devuelve -1 si falla. */
+int init_incoming_socket()
+{
+	int addrinfo_rv, sock = -1;
+	int re = 1;
+	struct addrinfo hints, *myinfo, *aux;
+
+	/* Inicializa la estructura hints */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	/* Obtiene la lista de interfaces disponibles */
+	if ((addrinfo_rv = getaddrinfo(NULL, TCP_PORT, &hints, &myinfo)) != 0)
+	{
+		fprintf(stderr, "Error al recuperar la lista de direcciones locales!\n");
+		fprintf(stderr, "Estado de Addrinfo: %s\n", gai_strerror(addrinfo_rv));
+		return -1;
+	}
+
+	/* Itera sobre las direcciones hasta encontrar una enlazable */
+	for (aux = myinfo; aux != NULL; aux = aux->ai_next)
+	{
+		if ((sock = socket(aux->ai_family, aux->ai_socktype | SOCK_NONBLOCK, aux->ai_protocol)) == -1)
+		{
+			fprintf(stderr, "Error al crear el socket para la dirección!\n");
+			continue;
+		}
+
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &re, sizeof(re)) == -1)
+		{
+			fprintf(stderr, "Error, no se pudo establecer el socket como reutilizable.\n");
+			return -1;
+		}
+
+		/* Si el nodo se acaba de reiniciar, el núcleo puede tardar unos milisegundos en liberar el
+		   puerto de la ejecución anterior (por ejemplo, mientras desarma su io_uring), así que
+		   reintentamos un rato antes de darnos por vencidos */
+		int tries = 0, rv;
+		while ((rv = bind(sock, aux->ai_addr, aux->ai_addrlen)) == -1 && errno == EADDRINUSE && tries++ < BIND_RETRIES)
+		{
+			usleep(BIND_RETRY_US);
+		}
+		if (rv == -1)
+		{
+			close(sock);
+			fprintf(stderr, "Error, no se pudo enlazar el socket a la dirección.\n");
+			continue;
+		}
+
+		break;
+	}
+
+	freeaddrinfo(myinfo);
+
+	/* Verifica si logramos enlazarnos a alguna dirección */
+	if (aux == NULL)
+	{
+		fprintf(stderr, "No se pudo encontrar una dirección válida para aceptar pares!\n");
+		return -1;
+	}
+
+	return sock;
+}
+
+/* Elige el backend de red por nombre: "epoll", "uring" o "auto". Devuelve 0, o -1 si el nombre
+   no es válido */
+int net_set_backend(const char *name)
+{
+	if (strcmp(name, "epoll") != 0 && strcmp(name, "uring") != 0 && strcmp(name, "auto") != 0)
+	{
+		return -1;
+	}
+	backend_choice = name;
+	return 0;
+}
+
+/* Fija la memoria que pueden ocupar los archivos y rangos en recepción, por par y total */
+void net_set_rx_limits(size_t peer, size_t total)
+{
+	rx_peer_limit = peer;
+	rx_total_limit = total;
+}
+
+/* Devuelve el nombre del backend de red en uso, para informes */
+const char *net_backend_name()
+{
+	return backend ? backend->name : "ninguno";
+}
+
+/* Inicializa el bucle de eventos: crea el socket de escucha, el eventfd para despertarlo y el
+   backend de red. Devuelve 0 si tuvo éxito, o -1 si no se pudo crear el bucle */
+int net_init()
+{
+	int i;
+
+	/* Cada ranura de la rueda empieza como una lista circular vacía */
+	for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+	{
+		wheel.slots[i].next = wheel.slots[i].prev = &wheel.slots[i];
+	}
+	wheel.now = current_tick();
+	atomic_store(&stop_pending, 0);
+	dialer_init(&dialer, DIAL_MAX_INFLIGHT, DIAL_BACKOFF_MIN, DIAL_BACKOFF_MAX);
+
+	if ((wake_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+	{
+		fprintf(stderr, "No se pudo crear el bucle de eventos!\n");
+		return -1;
+	}
+
+	/* Si no podemos escuchar, seguimos funcionando solo con conexiones salientes */
+	listen_sock = init_incoming_socket();
+	if (listen_sock != -1 && listen(listen_sock, 128) == -1)
+	{
+		close(listen_sock);
+		listen_sock = -1;
+	}
+	if (listen_sock == -1)
+	{
+		fprintf(stderr, "No se pudo escuchar en el socket de pares entrantes!\n");
+	}
+
+	/* Preferimos io_uring si lo pidieron (o en modo automático), pero si el núcleo no lo soporta
+	   usamos epoll, que siempre está disponible */
+	backend = NULL;
+	if (strcmp(backend_choice, "epoll") != 0)
+	{
+		if (uring_backend.init(listen_sock, wake_fd) == 0)
+		{
+			backend = &uring_backend;
+		}
+		else if (strcmp(backend_choice, "uring") == 0)
+		{
+			fprintf(stderr, "El sistema no soporta io_uring, usando epoll.\n");
+		}
+	}
+	if (backend == NULL)
+	{
+		if (epoll_backend.init(listen_sock, wake_fd) == -1)
+		{
+			fprintf(stderr, "No se pudo crear el bucle de eventos!\n");
+			return -1;
+		}
+		backend = &epoll_backend;
+	}
+
+	return 0;
+}
+
+/* Inicia una conexión no bloqueante con el par de la IP dada, salvo que sea nuestra propia IP, que
+   ya estemos conectados o conectando con ella, que haya fallado hace poco (ver dialer.c) o que ya
+   haya demasiadas conexiones en curso. Devuelve 0 si la conexión está en curso o establecida, o -1
+   si no */
+int net_dial(uint32_t ip)
+{
+	struct conn *c;
+
+	/* No intentamos conectarnos a nosotros mismos :) */
+	if (ip == myaddr)
+	{
+		return -1;
+	}
+
+	/* Ni a pares a los que ya estamos conectados */
+	if (is_connected(peerlist, ip))
+	{
+		return 0;
+	}
+
+	/* El registro descarta las IPs con una conexión en curso o en espera tras un fallo */
+	int dial = dialer_begin(&dialer, ip, wheel.now);
+	if (dial != 1)
+	{
+		return dial;
+	}
+
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	net_syscalls++;
+	if (sock == -1)
+	{
+		dialer_done(&dialer, ip, 0, wheel.now);
+		return -1;
+	}
+
+	c = conn_create(sock, ip, CONN_CONNECTING);
+	log_msg(LOG_INFO, &log_stdout, "Intentando conectar con el nuevo par %s... \n", c->name);
+
+	/* La conexión termina en segundo plano; si no termina a tiempo, el temporizador la cierra (y
+	   conn_destroy registra el fallo) */
+	timer_schedule(&c->timer, wheel.now + CONNECT_TIMEOUT);
+	if (backend->connect(c) == -1)
+	{
+		log_msg(LOG_WARN, &log_stderr, "No se pudo conectar con el par %s!\n", c->name);
+		c->closing = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Dispara el temporizador de la conexión: cierra las conexiones que no terminaron de establecerse
+   o de las que no recibimos nada en mucho tiempo, y envía las solicitudes periódicas que tocan */
+static void conn_timer(struct conn *c)
+{
+	if (c->state == CONN_CONNECTING)
+	{
+		log_msg(LOG_WARN, &log_stderr, "No se pudo conectar con el par %s!\n", c->name);
+		c->closing = 1;
+		return;
+	}
+
+	if (wheel.now >= c->rx_deadline)
+	{
+		log_msg(LOG_WARN, &log_stderr, "Tiempo de espera agotado esperando al par %s.\n", c->name);
+		log_msg(LOG_WARN, &log_stderr, "Probablemente el par se desconectó. Cerrando conexión...\n");
+		c->closing = 1;
+		return;
+	}
+
+	if (c->out_deadline != 0 && wheel.now >= c->out_deadline)
+	{
+		log_msg(LOG_WARN, &log_stderr, "El par %s no recibe lo que le enviamos (%zu bytes pendientes). Cerrando conexión...\n",
+				c->name, c->out_bytes);
+		c->closing = 1;
+		return;
+	}
+
+	if (c->settle_deadline != 0 && wheel.now >= c->settle_deadline)
+	{
+		log_msg(LOG_DEBUG, c->log, "El par no envió su saludo, asentando la conexión de todos modos.\n");
+		conn_settle(c);
+	}
+
+	/* Envía solicitudes de pares cada 5 segundos */
+	if (wheel.now >= c->next_peerreq)
+	{
+		uint8_t msg = MSG_PEERREQ;
+		if (c->out_bytes > 0)
+		{
+			log_msg(LOG_DEBUG, c->log, "Cola de salida: %zu bytes pendientes.\n", c->out_bytes);
+		}
+		conn_send(c, &msg, 1);
+		c->next_peerreq = wheel.now + PEERREQ_INTERVAL;
+	}
+
+	/* Y solicitudes de archivo cada 60 segundos. Si el par soporta rangos, en lugar de pedirle el
+	   archivo le anunciamos nuestra punta: si él tiene más mensajes nos responderá con la suya,
+	   y si no, no se transfiere nada más. Una conexión sin asentar se salta esta vuelta */
+	if (wheel.now >= c->next_archreq)
+	{
+		if (!c->settled)
+		{
+			log_msg(LOG_DEBUG, c->log, "La conexión todavía no está asentada, sin pedir archivo.\n");
+		}
+		else if (c->flags & PEER_RANGE_SYNC)
+		{
+			uint8_t tip[21];
+			struct archive *arch = snapshot_get(&active_arch);
+			build_tip(arch, MSG_TIP, tip);
+			archive_unref(arch);
+			conn_send_latest(c, OUT_TIP, tip, 21);
+		}
+		else
+		{
+			uint8_t msg = MSG_ARCHREQ;
+			conn_send(c, &msg, 1);
+		}
+		c->next_archreq = wheel.now + ARCHREQ_INTERVAL;
+	}
+
+	conn_schedule(c);
+}
+
+/* Avanza la rueda de temporizadores hasta el tick dado, disparando los temporizadores vencidos */
+static void timers_advance(uint64_t tick)
+{
+	while (wheel.now < tick)
+	{
+		wheel.now++;
+		struct timer *head = &wheel.slots[wheel.now % TIMER_WHEEL_SLOTS];
+		struct timer *t = head->next;
+
+		/* Un temporizador disparado se saca de la ranura antes de llamar a su conexión, que solo
+		   puede reprogramar su propio temporizador, así que el siguiente sigue siendo válido */
+		while (t != head)
+		{
+			struct timer *next = t->next;
+			if (t->expires <= wheel.now)
+			{
+				timer_cancel(t);
+				conn_timer((struct conn *)((uint8_t *)t - offsetof(struct conn, timer)));
+			}
+			t = next;
+		}
+	}
+}
+
+/* Pide al bucle de eventos que publique el archivo activo a todos los pares. Puede llamarse desde
+   cualquier hilo, sin tener el archivo activo bloqueado */
+void net_publish()
+{
+	uint64_t one = 1;
+	atomic_store(&publish_pending, 1);
+	if (write(wake_fd, &one, sizeof(one)) == -1)
+	{
+		log_msg(LOG_ERROR, &log_stderr, "No se pudo despertar al bucle de eventos!\n");
+	}
+}
+
+/* Pide al bucle de eventos que termine. Puede llamarse desde cualquier hilo */
+void net_stop()
+{
+	uint64_t one = 1;
+	atomic_store(&stop_pending, 1);
+	if (write(wake_fd, &one, sizeof(one)) == -1)
+	{
+		log_msg(LOG_ERROR, &log_stderr, "No se pudo despertar al bucle de eventos!\n");
+	}
+}
+
+/* Implementa el trabajo del hilo del bucle de eventos. Se ejecuta hasta que se llame a net_stop */
+void *net_loop()
+{
+	log_msg(LOG_INFO, &log_stdout, "[El hilo de red está esperando conexiones, con %s]\n", backend->name);
+
+	while (!atomic_load(&stop_pending))
+	{
+		/* Esperamos eventos a lo sumo hasta el próximo tick */
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		uint64_t now_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		int timeout = (int)((now_ms / NET_TICK_MS + 1) * NET_TICK_MS - now_ms);
+
+		backend->wait(timeout);
+		timers_advance(current_tick());
+		reap_conns();
+
+		/* Los cambios de la lista de pares de esta vuelta se publican juntos, y con ellos el número
+		   de pares y de conexiones para las métricas */
+		peerlist_publish(peerlist);
+		metrics_set(METRIC_PEERS, peerlist->size);
+		metrics_set(METRIC_CONNS, nconns);
+	}
+
+	return NULL;
+}
+
+/* Cierra todas las conexiones y libera los recursos del bucle de eventos, después de que net_loop
+   terminó */
+void net_cleanup()
+{
+	while (conns != NULL)
+	{
+		conn_destroy(conns);
+	}
+	backend->cleanup();
+	backend = NULL;
+
+	if (listen_sock != -1)
+	{
+		close(listen_sock);
+		listen_sock = -1;
+	}
+	close(wake_fd);
+	wake_fd = -1;
+	dialer_free(&dialer);
+}
+
+/* Alimenta al analizador de la conexión con 'len' bytes recibidos, procesando cada campo que se
+   complete. Devuelve 0 si todo fue bien, o -1 si el par envió datos inválidos */
+int conn_feed(struct conn *c, const uint8_t *data, size_t len)
+{
+	while (len > 0 && !c->closing)
+	{
+		if (c->got == 0 && len >= c->want)
+		{
+			/* El campo llegó entero: lo procesamos donde está, sin copiarlo */
+			c->field = data;
+			data += c->want;
+			len -= c->want;
+		}
+		else
+		{
+			/* Acumula los bytes del campo partido entre lecturas */
+			uint32_t take = c->want - c->got;
+			if (take > len)
+			{
+				take = len;
+			}
+			memcpy(c->buf + c->got, data, take);
+			c->got += take;
+			data += take;
+			len -= take;
+
+			if (c->got < c->want)
+			{
+				break;
+			}
+			c->field = c->buf;
+		}
+
+		/* El campo está completo, lo procesamos según el estado. Sus bytes se cuentan para el tipo del
+		   mensaje al que pertenecen (el byte de tipo, para el mensaje que comienza) */
+		const uint8_t *buf = c->field;
+		if (c->parse == PARSE_TYPE)
+		{
+			c->rx_type = metric_msg_type(buf[0]);
+			metrics_add(METRIC_MSGS_IN + c->rx_type, 1);
+		}
+		metrics_add(METRIC_BYTES_IN + c->rx_type, c->want);
+
+		switch (c->parse)
+		{
+		case PARSE_TYPE:
+		{
+			switch (buf[0])
+			{
+			case MSG_PEERREQ:
+			{
+				log_msg(LOG_DEBUG, c->log, "Recibida solicitud de par, enviando lista!\n");
+				/* Este hilo es el único que modifica la lista, así que publicamos los cambios
+				   pendientes antes de tomar la copia, para responder con la lista actual */
+				peerlist_publish(peerlist);
+				struct peer_payload *payload = peerlist_get(peerlist);
+				conn_send_latest(c, OUT_PEERLIST, payload->data, payload->len);
+				peer_payload_unref(payload);
+				expect(c, PARSE_TYPE, 1);
+				break;
+			}
+
+			case MSG_PEERLIST:
+			{
+				log_msg(LOG_DEBUG, c->log, "\n----------Procesando lista de pares!----------\n");
+				expect(c, PARSE_PEERLIST_SIZE, 4);
+				break;
+			}
+
+			case MSG_ARCHREQ:
+			{
+				log_msg(LOG_DEBUG, c->log, "Recibida solicitud de archivo!\n");
+				struct archive *arch = snapshot_get(&active_arch);
+				if (!c->settled)
+				{
+					log_msg(LOG_DEBUG, c->log, "La conexión todavía no está asentada, ignorando la solicitud!\n");
+				}
+				else if (!arch->size)
+				{
+					log_msg(LOG_DEBUG, c->log, "El archivo actual está vacío, ignorando la solicitud!\n");
+				}
+				else
+				{
+					log_msg(LOG_DEBUG, c->log, "Enviando archivo!\n");
+					conn_send_archive(c, arch, 0);
+				}
+				archive_unref(arch);
+				expect(c, PARSE_TYPE, 1);
+				break;
+			}
+
+			case MSG_ARCHRESP:
+			{
+				log_msg(LOG_DEBUG, c->log, "\n----------Procesando respuesta de archivo!---------\n");
+				expect(c, PARSE_ARCHIVE_SIZE, 4);
+				break;
+			}
+
+			case MSG_HELLO:
+			{
+				log_msg(LOG_DEBUG, c->log, "El par soporta sincronización por rangos!\n");
+				c->flags |= PEER_RANGE_SYNC;
+
+				/* El nodo de IP menor solo saluda por la conexión que asentó */
+				if (!c->settled && c->outgoing)
+				{
+					conn_settle(c);
+				}
+				expect(c, PARSE_TYPE, 1);
+				break;
+			}
+
+			case MSG_RANGEREQ:
+			{
+				expect(c, PARSE_RANGEREQ, 20);
+				break;
+			}
+
+			case MSG_RANGERESP:
+			{
+				log_msg(LOG_DEBUG, c->log, "\n----------Procesando respuesta de rango!---------\n");
+				expect(c, PARSE_RANGE_HEADER, 24);
+				break;
+			}
+
+			case MSG_TIP:
+			{
+				expect(c, PARSE_TIP, 20);
+				break;
+			}
+
+			default:
+			{
+				log_msg(LOG_WARN, c->log, "Tipo de mensaje desconocido, ignorando... (byte = %d)\n", buf[0]);
+				expect(c, PARSE_TYPE, 1);
+				break;
+			}
+			}
+			break;
+		}
+
+		case PARSE_PEERLIST_SIZE:
+		{
+			/* Analiza los bytes de tamaño para calcular el número de IPs en la lista */
+			c->remaining = ((buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
+			log_msg(LOG_DEBUG, c->log, "%u clientes:\n", c->remaining);
+			if (c->remaining == 0)
+			{
+				log_msg(LOG_DEBUG, c->log, "----------Lista de pares procesada!----------\n\n");
+				expect(c, PARSE_TYPE, 1);
+			}
+			else
+			{
+				expect(c, PARSE_PEERLIST_IP, 4);
+			}
+			break;
+		}
+
+		case PARSE_PEERLIST_IP:
+		{
+			process_peer_ip(c, buf);
+			if (--c->remaining == 0)
+			{
+				log_msg(LOG_DEBUG, c->log, "----------Lista de pares procesada!----------\n\n");
+				expect(c, PARSE_TYPE, 1);
+			}
+			else
+			{
+				expect(c, PARSE_PEERLIST_IP, 4);
+			}
+			break;
+		}
+
+		case PARSE_ARCHIVE_SIZE:
+		{
+			if (begin_archive(c, ((buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3])) == -1 ||
+			    (c->remaining == 0 && finish_body(c) == -1))
+			{
+				return -1;
+			}
+			break;
+		}
+
+		case PARSE_RANGE_HEADER:
+		{
+			if (begin_range(c) == -1 || (c->remaining == 0 && finish_body(c) == -1))
+			{
+				return -1;
+			}
+			break;
+		}
+
+		case PARSE_RANGEREQ:
+		{
+			process_rangereq(c);
+			expect(c, PARSE_TYPE, 1);
+			break;
+		}
+
+		case PARSE_TIP:
+		{
+			process_tip(c);
+			expect(c, PARSE_TYPE, 1);
+			break;
+		}
+
+		case PARSE_MSG_LEN:
+		{
+			/* Cada mensaje ocupa a lo sumo 255 caracteres más 32 bytes de código y hash */
+			expect(c, PARSE_MSG_BODY, buf[0] + 32);
+			break;
+		}
+
+		case PARSE_MSG_BODY:
+		{
+			if (process_body(c) == -1)
+			{
+				return -1;
+			}
+			break;
+		}
+		}
+	}
+
+	return 0;
+}
+
+/* Procesa una IP de una lista de pares, conectándose al par si no lo estamos ya */
+void process_peer_ip(struct conn *c, const uint8_t *ipbuf)
+{
+	uint32_t uip = ((ipbuf[3] << 24) | (ipbuf[2] << 16) | (ipbuf[1] << 8) | ipbuf[0]);
+	log_msg(LOG_DEBUG, c->log, "%d.%d.%d.%d\n", ipbuf[0], ipbuf[1], ipbuf[2], ipbuf[3]);
+	net_dial(uip);
+}
+
+/* Comienza a recibir una respuesta de archivo de 'usize' mensajes. Si el archivo no es más grande que
+   el activo, nunca lo usaríamos, así que lo descartamos a medida que llega */
+int begin_archive(struct conn *c, uint32_t usize)
+{
+	log_msg(LOG_DEBUG, c->log, "Número de chats: %u\n", usize);
+
+	/* Toma una referencia al archivo activo al comenzar la recepción, que usamos como referencia
+	   aunque el archivo activo sea reemplazado mientras tanto */
+	struct archive *arch = snapshot_get(&active_arch);
+
+	c->remaining = usize;
+	c->index = 0;
+	if (usize <= arch->size)
+	{
+		c->mode = BODY_DRAIN;
+		archive_unref(arch);
+	}
+	else
+	{
+		/* Los mensajes que siguen a los del archivo activo no pueden coincidir con él, así que
+		   se copian: si ni siquiera al tamaño mínimo caben en el límite, no los esperamos */
+		if (!rx_fits(c, stream_min_cost(usize - arch->size)))
+		{
+			log_msg(LOG_WARN, c->log, "El archivo anunciado no cabe en el límite de memoria, cerrando conexión.\n");
+			archive_unref(arch);
+			return -1;
+		}
+		c->mode = BODY_ARCHIVE;
+		stream_init(&c->stream, arch);
+		archive_unref(arch);
+	}
+	expect(c, PARSE_MSG_LEN, 1);
+	return 0;
+}
+
+/* Comienza a recibir una respuesta de rango con el encabezado en el búfer de la conexión. Solo nos
+   sirve si el mensaje base N coincide con nuestro mensaje N (es decir, si el par extiende nuestro
+   prefijo) y si el total es más grande que nuestro archivo; si no, descartamos los mensajes a medida
+   que llegan. El nuevo archivo se arma con nuestros primeros N mensajes, que no se vuelven a verificar,
+   más los mensajes recibidos. Devuelve 0, o -1 si el encabezado es inválido */
+int begin_range(struct conn *c)
+{
+	const uint8_t *buf = c->field;
+	uint32_t total = ((buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
+	uint32_t base = ((buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7]);
+	const uint8_t *base_md5 = buf + 8;
+
+	if (base > total)
+	{
+		log_msg(LOG_WARN, c->log, "Rango inválido (base %u, total %u), cerrando conexión.\n", base, total);
+		return -1;
+	}
+	log_msg(LOG_DEBUG, c->log, "Mensajes %u a %u\n", base + 1, total);
+
+	/* Verifica que el rango extienda nuestro archivo activo, y copia nuestro prefijo */
+	c->mode = BODY_DRAIN;
+	struct archive *arch = snapshot_get(&active_arch);
+	if (total > arch->size && base <= arch->size)
+	{
+		uint8_t zeros[16] = {0};
+		const uint8_t *our_md5 = (base == 0) ? zeros : archive_md5(arch, base);
+
+		if (memcmp(our_md5, base_md5, 16) == 0)
+		{
+			if (!rx_fits(c, stream_min_cost(total - base)))
+			{
+				log_msg(LOG_WARN, c->log, "El rango anunciado no cabe en el límite de memoria, cerrando conexión.\n");
+				archive_unref(arch);
+				return -1;
+			}
+			stream_init(&c->stream, NULL);
+			stream_prefill(&c->stream, arch, base);
+			c->mode = BODY_RANGE;
+		}
+	}
+	archive_unref(arch);
+
+	c->remaining = total - base;
+	c->index = base;
+	expect(c, PARSE_MSG_LEN, 1);
+	return 0;
+}
+
+/* Procesa el siguiente mensaje de chat (en el búfer de la conexión) del archivo o rango en recepción.
+   Usamos el archivo activo al comenzar como referencia para no hashear los mensajes de un archivo
+   completo que ya conocemos. Al primer mensaje inválido abandonamos la recepción, sin esperar el resto.
+   Devuelve 0 si es válido o se descartó, o -1 si es inválido */
+int process_body(struct conn *c)
+{
+	c->index++;
+
+	if (c->mode != BODY_DRAIN)
+	{
+		/* El archivo crece con lo que realmente llega, hasta el límite de memoria */
+		if (!rx_fits(c, stream_cost(&c->stream, c->want - 32)))
+		{
+			log_msg(LOG_WARN, c->log, "El mensaje %u supera el límite de memoria, abandonando la recepción.\n", c->index);
+			stream_abort(&c->stream);
+			rx_release(c);
+			c->mode = BODY_DRAIN;
+			return -1;
+		}
+		if (!stream_push(&c->stream, c->want - 32, c->field))
+		{
+			log_msg(LOG_WARN, c->log, "El mensaje %u es inválido, abandonando la recepción.\n", c->index);
+			stream_abort(&c->stream);
+			rx_release(c);
+			c->mode = BODY_DRAIN;
+			return -1;
+		}
+		rx_account(c);
+	}
+
+	if (--c->remaining == 0)
+	{
+		return finish_body(c);
+	}
+	expect(c, PARSE_MSG_LEN, 1);
+	return 0;
+}
+
+/* Vuelca un archivo en un registro, desde el hilo escritor de registros */
+static void dump_archive(void *arch, FILE *file)
+{
+	print_archive((struct archive *)arch, file);
+}
+
+/* Suelta la referencia al archivo volcado */
+static void release_archive(void *arch)
+{
+	archive_unref((struct archive *)arch);
+}
+
+/* Termina la recepción de un archivo o rango. Si el archivo completo es válido y sigue siendo más
+   grande que el activo, lo reemplazamos. Devuelve 0, o -1 si el archivo resultó inválido */
+int finish_body(struct conn *c)
+{
+	int mode = c->mode;
+
+	c->mode = BODY_DRAIN;
+	rx_release(c);
+	expect(c, PARSE_TYPE, 1);
+
+	if (mode == BODY_DRAIN)
+	{
+		log_msg(LOG_DEBUG, c->log, "El archivo no es más grande que el activo o no lo extiende, descartado.\n");
+		log_msg(LOG_DEBUG, c->log, "----------Respuesta procesada!----------\n\n");
+		return 0;
+	}
+
+	struct archive *new_archive = stream_finish(&c->stream);
+	if (new_archive == NULL)
+	{
+		log_msg(LOG_WARN, c->log, "El archivo recibido es inválido, abandonando la recepción.\n");
+		return -1;
+	}
+
+	if (mode == BODY_ARCHIVE)
+	{
+		log_msg(LOG_INFO, c->log, "Archivo recibido con %u mensajes.\n", new_archive->size);
+
+		/* El contenido completo solo se vuelca en el nivel de depuración, y lo formatea el escritor */
+		if (log_enabled(LOG_DEBUG))
+		{
+			log_msg(LOG_DEBUG, c->log, "Contenido del archivo recibido:\n");
+			log_dump(LOG_DEBUG, c->log, dump_archive, release_archive, archive_ref(new_archive));
+		}
+	}
+	else
+	{
+		log_msg(LOG_INFO, c->log, "Archivo extendido a %u mensajes.\n", new_archive->size);
+	}
+
+	replace_archive(new_archive);
+	log_msg(LOG_DEBUG, c->log, "----------Respuesta procesada!----------\n\n");
+	return 0;
+}
+
+/* Reemplaza el archivo activo por uno nuevo y validado, si sigue siendo más grande que el activo
+   (el hilo principal pudo haber publicado un mensaje mientras tanto, y entonces volvemos a comparar).
+   En cualquier caso suelta la referencia al nuevo archivo, que se libera si no se publicó */
+void replace_archive(struct archive *new_archive)
+{
+	uint8_t tip[21];
+	int replaced = 0;
+	struct archive *arch;
+
+	do
+	{
+		arch = snapshot_get(&active_arch);
+		if (new_archive->size <= arch->size)
+		{
+			archive_unref(arch);
+			break;
+		}
+		replaced = snapshot_publish(&active_arch, arch, new_archive);
+		archive_unref(arch);
+	} while (!replaced);
+
+	/* Anunciamos la nueva punta, para que los mensajes se propaguen sin esperar a las solicitudes
+	   periódicas. Los pares que ya la tienen simplemente la ignoran */
+	if (replaced)
+	{
+		log_msg(LOG_INFO, &log_stdout, "---------- Archivo activo reemplazado! ----------\n");
+		metrics_add(METRIC_ARCHIVES_REPLACED, 1);
+		build_tip(new_archive, MSG_TIP, tip);
+		announce_tip(tip);
+		if (archive_store != NULL)
+		{
+			store_queue(archive_store, new_archive);
+		}
+	}
+	archive_unref(new_archive);
+}
+
+/* Construye en el búfer dado (de 21 bytes) un mensaje del tipo dado con el tamaño del archivo y el
+   hash de su último mensaje. Sirve tanto para anunciar la punta (MSG_TIP) como para pedir los
+   mensajes que le siguen (MSG_RANGEREQ), que tienen el mismo formato */
+void build_tip(struct archive *arch, uint8_t type, uint8_t *buf)
+{
+	uint32_t size = arch->size;
+
+	buf[0] = type;
+	buf[1] = (size >> 24) & 0xFF;
+	buf[2] = (size >> 16) & 0xFF;
+	buf[3] = (size >> 8) & 0xFF;
+	buf[4] = size & 0xFF;
+
+	/* El hash del último mensaje (o ceros si el archivo está vacío) */
+	if (size == 0)
+	{
+		memset(buf + 5, 0, 16);
+	}
+	else
+	{
+		memcpy(buf + 5, archive_md5(arch, size), 16);
+	}
+}
+
+/* Envía la punta dada a todos los pares que soportan la extensión de rangos */
+void announce_tip(const uint8_t *tip)
+{
+	struct conn *c;
+	for (c = conns; c != NULL; c = c->next)
+	{
+		if (c->state == CONN_OPEN && c->settled && (c->flags & PEER_RANGE_SYNC))
+		{
+			conn_send_latest(c, OUT_TIP, tip, 21);
+		}
+	}
+}
+
+/* Procesa un anuncio de punta. Si el par tiene más mensajes que nosotros, le pedimos los que nos
+   faltan, salvo que ya los hayamos pedido hace poco a algún par; si tiene menos, le respondemos con
+   nuestra punta para que él nos los pida. Si ambos tienen el mismo tamaño no hay nada que hacer,
+   aunque los archivos sean distintos, porque solo adoptamos archivos más grandes */
+void process_tip(struct conn *c)
+{
+	const uint8_t *buf = c->field;
+	uint8_t reply[21];
+	uint32_t size = ((buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
+
+	if (!c->settled)
+	{
+		log_msg(LOG_DEBUG, c->log, "La conexión todavía no está asentada, ignorando la punta!\n");
+		return;
+	}
+
+	struct archive *arch = snapshot_get(&active_arch);
+	uint32_t our_size = arch->size;
+	build_tip(arch, size > our_size ? MSG_RANGEREQ : MSG_TIP, reply);
+	archive_unref(arch);
+
+	if (size > our_size)
+	{
+		time_t now = time(NULL);
+		if (size > fetch_size || now - fetch_time >= FETCH_TIMEOUT)
+		{
+			fetch_size = size;
+			fetch_time = now;
+			log_msg(LOG_DEBUG, c->log, "El par anuncia %u mensajes y tenemos %u, pidiendo los que faltan!\n", size, our_size);
+			conn_send(c, reply, 21);
+		}
+		else
+		{
+			log_msg(LOG_DEBUG, c->log, "El par anuncia %u mensajes, pero ya los pedimos a otro par!\n", size);
+		}
+	}
+	else if (size < our_size)
+	{
+		log_msg(LOG_DEBUG, c->log, "El par anuncia %u mensajes y tenemos %u, enviando nuestra punta!\n", size, our_size);
+		conn_send_latest(c, OUT_TIP, reply, 21);
+	}
+	else
+	{
+		log_msg(LOG_DEBUG, c->log, "El par anuncia el mismo tamaño que el nuestro (%u), nada que hacer!\n", size);
+	}
+}
+
+/* Procesa una solicitud de rango. Si el par ya tiene tantos mensajes como nosotros, no hay nada que
+   enviar. Si su mensaje base coincide con el nuestro, solo enviamos lo que le falta; si no, tenemos
+   archivos distintos y le enviamos el archivo completo */
+void process_rangereq(struct conn *c)
+{
+	const uint8_t *req = c->field;
+	uint32_t base = ((req[0] << 24) | (req[1] << 16) | (req[2] << 8) | req[3]);
+	log_msg(LOG_DEBUG, c->log, "Recibida solicitud de rango desde el mensaje %u!\n", base);
+	if (!c->settled)
+	{
+		log_msg(LOG_DEBUG, c->log, "La conexión todavía no está asentada, ignorando la solicitud!\n");
+		return;
+	}
+
+	struct archive *arch = snapshot_get(&active_arch);
+	if (arch->size > base)
+	{
+		uint8_t zeros[16] = {0};
+		const uint8_t *our_md5 = (base == 0) ? zeros : archive_md5(arch, base);
+
+		if (memcmp(our_md5, req + 4, 16) == 0)
+		{
+			log_msg(LOG_DEBUG, c->log, "Enviando mensajes %u a %u!\n", base + 1, arch->size);
+			send_range(c, arch, base);
+		}
+		else
+		{
+			log_msg(LOG_DEBUG, c->log, "El par tiene otro archivo, enviando archivo completo!\n");
+			conn_send_archive(c, arch, 0);
+		}
+	}
+	archive_unref(arch);
+}
+
+/* Envía a la conexión dada los mensajes del archivo que siguen al mensaje 'base', como una
+   respuesta de rango */
+void send_range(struct conn *c, struct archive *arch, uint32_t base)
+{
+	uint8_t header[25];
+
+	header[0] = MSG_RANGERESP;
+	memcpy(header + 1, arch->hdr + 1, 4);
+	header[5] = (base >> 24) & 0xFF;
+	header[6] = (base >> 16) & 0xFF;
+	header[7] = (base >> 8) & 0xFF;
+	header[8] = base & 0xFF;
+	if (base == 0)
+	{
+		memset(header + 9, 0, 16);
+	}
+	else
+	{
+		memcpy(header + 9, archive_md5(arch, base), 16);
+	}
+
+	conn_send(c, header, 25);
+	conn_send_archive(c, arch, base + 1);
+}
+
+/* Publica el archivo activo a todas las conexiones abiertas. A los pares que soportan rangos solo
+   les anunciamos la nueva punta, y ellos nos piden el mensaje nuevo si no lo recibieron ya de otro
+   par; al resto les enviamos el archivo completo */
+void publish_archive(struct archive *arch)
+{
+	struct conn *c;
+	uint8_t tip[21];
+
+	log_msg(LOG_INFO, &log_stdout, "\n----------Publicando nuevo archivo!----------\n");
+
+	build_tip(arch, MSG_TIP, tip);
+	for (c = conns; c != NULL; c = c->next)
+	{
+		if (c->state != CONN_OPEN || c->closing || !c->settled)
+		{
+			continue;
+		}
+
+		log_msg(LOG_INFO, &log_stdout, "Enviando al par en el socket %u (%zu bytes pendientes)\n", c->sock, c->out_bytes);
+		if (c->flags & PEER_RANGE_SYNC)
+		{
+			conn_send_latest(c, OUT_TIP, tip, 21);
+		}
+		else
+		{
+			conn_send_archive(c, arch, 0);
+		}
+	}
+
+	log_msg(LOG_INFO, &log_stdout, "----------Publicación completada!---------\n\n");
+}
@@ -0,0 +1,467 @@
+#ifndef NET_H
+#define NET_H
+
+/* accept4, para aceptar conexiones directamente como no bloqueantes */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+/* Cabeceras para manipulación de estructuras de datos y memoria */
+#include <stdio.h>     // Entrada/salida estándar (fprintf y demás)
+#include <stdlib.h>    // Buena y vieja biblioteca estándar
+#include <unistd.h>    // API POSIX (close, read, write, etc)
+#include <stdint.h>    // Definiciones de tipos portátiles (uint32_t, etc)
+#include <string.h>    // memset y manipulación general de cadenas
+#include <stddef.h>    // offsetof
+#include <errno.h>     // errno, EAGAIN y compañía
+#include <time.h>      // clock_gettime y time
+#include <stdatomic.h> // Bandera de publicación compartida con el hilo principal
+
+/* Cabeceras de red */
+#include <netdb.h>       // addrinfo y otras automatizaciones de red
+#include <sys/socket.h>  // SOCKETS, AMAMOS LOS SOCKETS, ¿QUIÉN NO AMA LOS SOCKETS?
+#include <arpa/inet.h>   // inet_ntoa, inet_aton y otras
+#include <sys/epoll.h>   // El bucle de eventos
+#include <sys/eventfd.h> // Para despertar al bucle de eventos desde otros hilos
+#include <sys/uio.h>     // struct iovec, para enviar varios bloques en una sola llamada
+#include <linux/errqueue.h> // Avisos de fin de los envíos sin copia (MSG_ZEROCOPY)
+
+/* Cabeceras de multi-hilo */
+#include <pthread.h> // Hilos y cosas relacionadas
+
+#include "peerlist.h"
+#include "dialer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "archive.h"
+#include "store.h"
+
+/* El puerto siempre es 51511 */
+#define TCP_PORT "51511"
+#define TCP_PORT_NUM 51511
+
+/* Enum para tipos de mensajes, para hacer el código de tratamiento de mensajes más claro.
+   Los cuatro últimos son una extensión del protocolo para sincronizar archivos por rangos:
+   MSG_HELLO     -> [tipo], anuncia que soportamos la extensión. No tiene contenido, así que los
+                    nodos que no la conocen simplemente lo ignoran como un tipo desconocido.
+   MSG_RANGEREQ  -> [tipo][N: 4 bytes][MD5 del mensaje N: 16 bytes], pide los mensajes que siguen
+                    al mensaje N, dado que nuestro mensaje N tiene ese hash.
+   MSG_RANGERESP -> [tipo][total: 4 bytes][N: 4 bytes][MD5 del mensaje N: 16 bytes][mensajes N+1 a total],
+                    con los mensajes en el mismo formato que en MSG_ARCHRESP.
+   MSG_TIP       -> [tipo][tamaño: 4 bytes][MD5 del último mensaje: 16 bytes], anuncia la punta de
+                    nuestro archivo, para que el par solo pida mensajes si su archivo es más corto.
+   Como el hash de cada mensaje cubre los 19 anteriores (incluidos sus hashes), el hash del mensaje N
+   identifica todo el prefijo hasta N. Solo enviamos estos mensajes a pares que enviaron MSG_HELLO. */
+enum
+{
+	MSG_PEERREQ = 1,
+	MSG_PEERLIST,
+	MSG_ARCHREQ,
+	MSG_ARCHRESP,
+	MSG_HELLO,
+	MSG_RANGEREQ,
+	MSG_RANGERESP,
+	MSG_TIP
+};
+
+/* Banderas de capacidades de un par, que conocemos por los mensajes que nos envía */
+#define PEER_RANGE_SYNC 1 // El par soporta la sincronización de archivos por rangos
+
+/* El bucle de eventos avanza sus temporizadores en pasos ("ticks") de 100ms. Todos los plazos
+   de las conexiones se expresan en ticks */
+#define NET_TICK_MS 100
+#define NET_TICKS(ms) ((ms) / NET_TICK_MS)
+
+/* Plazos de las conexiones: intervalo entre solicitudes de pares (5 segundos) y de archivo
+   (60 segundos), tiempo sin recibir nada tras el cual damos al par por desconectado (60 segundos)
+   y tiempo máximo para establecer una conexión saliente (medio segundo) */
+#define PEERREQ_INTERVAL NET_TICKS(5000)
+#define ARCHREQ_INTERVAL NET_TICKS(60000)
+#define RECV_TIMEOUT NET_TICKS(60000)
+#define CONNECT_TIMEOUT NET_TICKS(500)
+
+/* Tiempo máximo que una conexión saliente que no es la preferida espera el saludo del par antes de
+   asentarse (ver conn_open): el par lo demora mientras su propia conexión con nosotros está en curso,
+   hasta CONNECT_TIMEOUT, así que esperamos bastante más (2 segundos) */
+#define SETTLE_TIMEOUT NET_TICKS(2000)
+
+/* Conexiones salientes: cuántas puede haber en curso a la vez, y cuánto esperamos para volver a
+   intentar con una IP que falló (5 segundos, duplicándose con cada fallo seguido hasta 10 minutos) */
+#define DIAL_MAX_INFLIGHT 64
+#define DIAL_BACKOFF_MIN NET_TICKS(5000)
+#define DIAL_BACKOFF_MAX NET_TICKS(600000)
+
+/* Reintentos para enlazar el puerto de escucha si todavía está ocupado, cada 50 ms durante 1 segundo */
+#define BIND_RETRIES 20
+#define BIND_RETRY_US 50000
+
+/* Memoria que pueden ocupar los archivos y rangos en recepción: por par (256 MB, unos 3 millones de
+   mensajes medianos) y entre todos los pares (1 GB). Se cuenta la memoria de los segmentos propios de
+   cada recepción (ver 'held' en archive_stream), no los mensajes que coinciden con el archivo activo
+   ni los segmentos que se comparten con él. Antes de reservar se comprueba lo que costará: un
+   encabezado que anuncia más mensajes de los que caben ni al tamaño mínimo (ver stream_min_cost) se
+   rechaza sin esperarlos, y cada mensaje, lo que crecerá su segmento (ver stream_cost) */
+#define RX_PEER_LIMIT ((size_t)256 << 20)
+#define RX_TOTAL_LIMIT ((size_t)1024 << 20)
+
+/* Envíos con epoll: cuántos bloques pendientes juntamos como mucho en una sola llamada a sendmsg, y
+   a partir de cuántos bytes de archivos en una llamada vale la pena enviarlos sin copia
+   (MSG_ZEROCOPY): por debajo, fijar las páginas y procesar el aviso cuesta más que copiarlas */
+#define SEND_IOV_MAX 64
+#define ZEROCOPY_MIN (64 * 1024)
+
+/* Límite de los datos pendientes de envío a un par (128 MB, un archivo de más de un millón de
+   mensajes medianos) y tiempo que la cola puede seguir por encima antes de que cerremos la
+   conexión (30 segundos): un par que no lee lo que le enviamos no retiene archivos para siempre */
+#define OUT_QUEUE_LIMIT ((size_t)128 << 20)
+#define OUT_STALL_TIMEOUT NET_TICKS(30000)
+
+/* Segundos durante los que consideramos en curso una solicitud de rango enviada por un anuncio de
+   punta. Mientras tanto, no volvemos a pedir los mismos mensajes a otros pares que anuncien la misma
+   punta (por ejemplo, cuando un mensaje nuevo se propaga y varios pares nos lo anuncian a la vez) */
+#define FETCH_TIMEOUT 10
+
+/* Número de ranuras de la rueda de temporizadores. Un temporizador que vence más allá de una vuelta
+   completa (102,4 segundos) simplemente se revisa en cada vuelta hasta que llegue su momento */
+#define TIMER_WHEEL_SLOTS 1024
+
+/* Temporizador de la rueda: el tick en el que vence y su lugar en la lista doblemente enlazada
+   de su ranura. Un temporizador no programado tiene next == NULL */
+struct timer
+{
+	uint64_t expires;
+	struct timer *next, *prev;
+};
+
+/* Rueda de temporizadores: cada ranura es la cabeza (sin datos) de una lista circular con los
+   temporizadores que vencen en un tick congruente con ella, y 'now' es el último tick procesado */
+struct timer_wheel
+{
+	struct timer slots[TIMER_WHEEL_SLOTS];
+	uint64_t now;
+};
+
+/* Estados de una conexión: conectando (solo las salientes, esperando a que connect() termine) o abierta */
+enum
+{
+	CONN_CONNECTING,
+	CONN_OPEN
+};
+
+/* Estados del analizador incremental de mensajes. Cada estado espera una cantidad fija de bytes,
+   que se acumulan en el búfer de la conexión antes de procesarlos */
+enum
+{
+	PARSE_TYPE,          // 1 byte, el tipo del siguiente mensaje
+	PARSE_PEERLIST_SIZE, // 4 bytes, el número de IPs de una lista de pares
+	PARSE_PEERLIST_IP,   // 4 bytes, una IP de la lista de pares
+	PARSE_ARCHIVE_SIZE,  // 4 bytes, el número de mensajes de una respuesta de archivo
+	PARSE_RANGE_HEADER,  // 24 bytes, el encabezado de una respuesta de rango
+	PARSE_RANGEREQ,      // 20 bytes, el contenido de una solicitud de rango
+	PARSE_TIP,           // 20 bytes, el contenido de un anuncio de punta
+	PARSE_MSG_LEN,       // 1 byte, la longitud de un mensaje de chat
+	PARSE_MSG_BODY       // Longitud + 32 bytes, un mensaje de chat con su código y su hash
+};
+
+/* Qué hacemos con los mensajes de chat de un archivo o rango que estamos recibiendo */
+enum
+{
+	BODY_DRAIN,   // Los descartamos, no nos interesan
+	BODY_ARCHIVE, // Los validamos para armar un archivo completo
+	BODY_RANGE    // Los validamos para extender nuestro archivo
+};
+
+/* Tipos de los mensajes pendientes de envío. Un mensaje de un tipo distinto de OUT_PLAIN reemplaza
+   al pendiente del mismo tipo si todavía no se empezó a enviar, porque el par solo necesita el más
+   nuevo: un archivo completo, una lista de pares o un anuncio de punta */
+enum
+{
+	OUT_PLAIN,
+	OUT_ARCHIVE,
+	OUT_PEERLIST,
+	OUT_TIP
+};
+
+/* Un bloque de datos pendientes de envío a una conexión, que no se mueve ni se modifica hasta
+   terminar de enviarse, para que el backend pueda enviarlo en segundo plano. Los mensajes cortos
+   (conn_send) se copian en el propio bloque; los archivos (conn_send_archive) no se copian: el bloque
+   apunta a los bytes del archivo y guarda una referencia a él ('arch'), que es inmutable. Los bloques
+   de un mensaje reemplazable llevan su tipo, y el primero está marcado con 'start' */
+struct out_chunk
+{
+	struct out_chunk *next;
+	size_t len, off;
+	const uint8_t *ptr;
+	struct archive *arch;
+	uint8_t kind, start;
+	uint8_t data[];
+};
+
+/* Una referencia a un archivo enviado con MSG_ZEROCOPY, que mantenemos hasta que el kernel avise
+   que terminó de usar sus páginas (el aviso identifica cada llamada por su número de secuencia) */
+struct zc_hold
+{
+	uint32_t seq;
+	struct archive *arch;
+};
+
+/* Una conexión con un par. Todas las conexiones pertenecen al hilo del bucle de eventos, que es el
+   único que las lee o modifica. Guardamos el estado del analizador de mensajes (lo que falta por
+   recibir del mensaje actual), los datos pendientes de envío (cuando el socket no acepta todo de una
+   vez) y los plazos de las solicitudes periódicas y del tiempo de espera, en ticks */
+struct conn
+{
+	int sock;
+	uint32_t ip;
+	int state;
+	int outgoing;
+	uint8_t flags;
+	int closing;
+	struct log_target *log;
+	char name[16];
+	struct sockaddr_in addr;
+
+	/* Analizador: estado, bytes esperados y recibidos del campo actual, y dónde está el campo una
+	   vez completo: en los datos recibidos si llegó entero en una lectura, o en el búfer, donde se
+	   juntan los campos que quedan partidos entre dos lecturas. 'rx_type' es el tipo del mensaje
+	   actual para las métricas (ver metric_msg_type) */
+	int parse;
+	uint8_t rx_type;
+	uint8_t buf[287];
+	uint32_t want, got;
+	const uint8_t *field;
+
+	/* Archivo o rango en recepción: mensajes restantes, índice del siguiente, qué hacemos con ellos,
+	   el archivo en construcción y los bytes que ocupa, ya sumados al total de todas las conexiones */
+	uint32_t remaining, index;
+	int mode;
+	struct archive_stream stream;
+	size_t rx_held;
+
+	/* Datos pendientes de envío, en orden, cuántos bytes suman y, si superan OUT_QUEUE_LIMIT, hasta
+	   cuándo esperamos a que bajen antes de cerrar la conexión (0 si no lo superan) */
+	struct out_chunk *out_head, *out_tail;
+	size_t out_bytes;
+	uint64_t out_deadline;
+
+	/* Envíos sin copia de epoll: si el socket los admite, el número de secuencia de la siguiente
+	   llamada y los archivos que el kernel todavía puede estar leyendo (capacidad 'zc_cap') */
+	int zerocopy;
+	uint32_t zc_seq;
+	struct zc_hold *zc_holds;
+	uint32_t zc_count, zc_cap;
+
+	/* Temporizador y plazos */
+	struct timer timer;
+	uint64_t next_peerreq, next_archreq, rx_deadline;
+
+	/* Si la conexión ya no puede cerrarse por duplicada, y solo entonces lleva tráfico de archivos, y
+	   hasta cuándo esperamos el saludo del par para asentarla (0 si no lo esperamos) */
+	int settled;
+	uint64_t settle_deadline;
+
+	/* Estado propio de cada backend: los eventos registrados en epoll, o las operaciones de
+	   io_uring en curso (todas, y los envíos de la cadena actual), si la conexión ya se cerró
+	   pero aún tiene operaciones en curso, y si tiene envíos por preparar */
+	uint32_t events;
+	uint32_t inflight, send_inflight;
+	int dead, dirty;
+	struct conn *dirty_next;
+
+	struct conn *next, *prev;
+};
+
+/* Un backend de red: el mecanismo con el que el bucle de eventos espera y realiza la E/S de los
+   sockets. Elegimos uno al iniciar, igual que los núcleos de MD5. Todas sus funciones se llaman
+   desde el hilo del bucle de eventos (o antes de lanzarlo):
+   init    -> prepara el backend para el socket de escucha (-1 si no hay) y el eventfd dado.
+              Devuelve 0, o -1 si el sistema no lo soporta.
+   watch   -> comienza a recibir datos de una conexión recién abierta.
+   connect -> inicia la conexión saliente a c->addr. Devuelve 0, o -1 si falló de inmediato.
+   send    -> envía los 'n' fragmentos de 'iov' a la conexión, después de sus datos pendientes. Si
+              'arch' no es NULL, son segmentos de ese archivo y no hace falta copiarlos; si no, es un
+              solo mensaje. Todos se encolan antes de empezar a enviar.
+   release -> deja de atender la conexión, cierra su socket y la libera (ahora, o cuando terminen
+              sus operaciones en curso).
+   wait    -> espera eventos a lo sumo 'timeout' milisegundos y los atiende.
+   cleanup -> libera todos los recursos del backend. */
+struct net_backend
+{
+	const char *name;
+	int (*init)(int listen_sock, int wake_fd);
+	void (*watch)(struct conn *c);
+	int (*connect)(struct conn *c);
+	void (*send)(struct conn *c, const struct iovec *iov, uint32_t n, struct archive *arch);
+	void (*release)(struct conn *c);
+	void (*wait)(int timeout);
+	void (*cleanup)();
+};
+
+/* Los backends disponibles: epoll (siempre disponible) e io_uring (Linux 6.0 o superior) */
+extern const struct net_backend epoll_backend;
+extern const struct net_backend uring_backend;
+
+/* Número de llamadas al sistema de red hechas por el hilo del bucle de eventos, solo para comparar
+   los backends en las pruebas de rendimiento */
+extern uint64_t net_syscalls;
+
+/* La lista de pares conectados. Solo la modifica el hilo del bucle de eventos; los demás hilos leen
+   su representación publicada con peerlist_get, sin bloqueos */
+extern struct peer_list *peerlist;
+
+/* El archivo activo actual, que se reemplaza entero en lugar de modificarse */
+extern struct snapshot active_arch;
+
+/* Almacenamiento en disco del archivo activo, o NULL si no se guarda */
+extern struct store *archive_store;
+
+/* Dirección IP pública del dispositivo local, para evitar intentos de conexión a sí mismo */
+extern uint32_t myaddr;
+
+/* Resuelve la IP o nombre de host dado a una dirección IPv4 en 'ip' (orden de bytes de red).
+   Devuelve 0 si tuvo éxito, o -1 si no pudo resolverlo. */
+int resolve_peer(char *host, uint32_t *ip);
+
+/* Inicializa un socket TCP que se enlaza a la dirección local y devuelve su
+   ID de descriptor de archivo. Este socket se utilizará para aceptar conexiones entrantes
+   de otros pares. Devuelve -1 si falla. */
+int init_incoming_socket();
+
+/* Elige el backend de red por nombre: "epoll", "uring" o "auto" (io_uring si el sistema lo
+   soporta, si no epoll, que es lo predeterminado). Debe llamarse antes de net_init.
+   Devuelve 0, o -1 si el nombre no es válido. */
+int net_set_backend(const char *name);
+
+/* Fija la memoria que pueden ocupar los archivos y rangos en recepción, por par y entre todos los
+   pares (en bytes). Debe llamarse antes de net_init; si no, se usan RX_PEER_LIMIT y RX_TOTAL_LIMIT. */
+void net_set_rx_limits(size_t peer, size_t total);
+
+/* Devuelve el nombre del backend de red en uso, para informes */
+const char *net_backend_name();
+
+/* Inicializa el bucle de eventos: crea el socket de escucha, el eventfd con el que otros hilos lo
+   despiertan y el backend de red elegido, cambiando a epoll si el sistema no soporta io_uring.
+   Debe llamarse antes que cualquier otra función de este módulo.
+   Devuelve 0 si tuvo éxito, o -1 si no se pudo crear el bucle de eventos. */
+int net_init();
+
+/* Inicia una conexión no bloqueante con el par de la IP dada, salvo que sea nuestra propia IP o que
+   ya tengamos una conexión con ella. Solo puede llamarse desde el hilo del bucle de eventos, o
+   antes de lanzarlo. Devuelve 0 si la conexión está en curso o establecida, o -1 si no. */
+int net_dial(uint32_t ip);
+
+/* Implementa el trabajo del hilo del bucle de eventos: espera eventos de todos los sockets con el
+   backend de red, acepta conexiones entrantes, completa las salientes, recibe y procesa los mensajes
+   de los pares a medida que llegan, envía los datos pendientes y dispara los temporizadores. Se
+   ejecuta hasta que se llame a net_stop, y es el único hilo que trata con los pares, sin importar
+   cuántos haya. */
+void *net_loop();
+
+/* Pide al bucle de eventos que termine. Puede llamarse desde cualquier hilo. */
+void net_stop();
+
+/* Cierra todas las conexiones y libera los recursos del bucle de eventos, después de que net_loop
+   terminó. Después se puede volver a llamar a net_init. */
+void net_cleanup();
+
+/* Pide al bucle de eventos que publique el archivo activo a todos los pares. Puede llamarse desde
+   cualquier hilo, después de publicar el nuevo archivo en active_arch. */
+void net_publish();
+
+/* Funciones con las que los backends avisan de sus eventos al resto del bucle de eventos */
+
+/* Crea y abre una conexión para un socket entrante aceptado desde la IP dada */
+void accept_conn(int sock, uint32_t ip);
+
+/* Completa una conexión saliente en curso: la abre si 'err' es 0, o la cierra si no */
+void conn_connected(struct conn *c, int err);
+
+/* Entrega 'n' bytes recibidos por la conexión a su analizador. Si 'n' es 0, el par cerró la conexión,
+   y si es negativo, hubo un error (-n es el código de errno) */
+void conn_received(struct conn *c, const uint8_t *data, ssize_t n);
+
+/* Agrega un nuevo bloque con 'len' bytes de 'data' al final de los datos pendientes de la conexión.
+   Si 'arch' es NULL los datos se copian; si no, son parte de ese archivo y el bloque solo toma una
+   referencia */
+void conn_queue(struct conn *c, const uint8_t *data, size_t len, struct archive *arch);
+
+/* Descarta los primeros 'n' bytes de los datos pendientes de la conexión, que ya se enviaron */
+void conn_sent(struct conn *c, size_t n);
+
+/* Libera todos los datos pendientes de la conexión */
+void conn_free_chunks(struct conn *c);
+
+/* Atiende un despertar del bucle de eventos, después de que el backend leyó el eventfd */
+void handle_wake();
+
+/* Encola 'len' bytes de 'data' para enviarlos a la conexión dada. Intenta enviarlos de inmediato,
+   y guarda lo que el socket no acepte para enviarlo cuando vuelva a tener espacio. */
+void conn_send(struct conn *c, const void *data, size_t len);
+
+/* Como conn_send, para un mensaje del tipo dado (OUT_PEERLIST u OUT_TIP) que reemplaza al pendiente
+   del mismo tipo, si todavía no se empezó a enviar */
+void conn_send_latest(struct conn *c, int kind, const void *data, size_t len);
+
+/* Como conn_send, para la representación en cadena del archivo dado a partir del mensaje 'from'
+   (comenzando en 1, o 0 para enviarla entera): en lugar de copiar los segmentos del archivo, el
+   envío toma una referencia al archivo hasta terminar. Un archivo entero reemplaza al archivo
+   entero pendiente, si todavía no se empezó a enviar */
+void conn_send_archive(struct conn *c, struct archive *arch, uint32_t from);
+
+/* Alimenta al analizador de la conexión con 'len' bytes recibidos, procesando cada campo que se
+   complete sin copiarlo, salvo que quede partido entre dos lecturas. Devuelve 0 si todo fue bien,
+   o -1 si el par envió datos inválidos y hay que cerrarla. */
+int conn_feed(struct conn *c, const uint8_t *data, size_t len);
+
+/* Procesa una IP de una lista de pares, conectándose al par si no lo estamos ya. */
+void process_peer_ip(struct conn *c, const uint8_t *ipbuf);
+
+/* Comienza a recibir una respuesta de archivo de 'usize' mensajes. Si el archivo no es más grande que
+   el activo, nunca lo usaríamos, así que lo descartamos a medida que llega; si no, lo validamos
+   mensaje a mensaje, usando el archivo activo como referencia mientras no sea reemplazado.
+   Devuelve 0, o -1 si los mensajes nuevos anunciados no caben en el límite de memoria. */
+int begin_archive(struct conn *c, uint32_t usize);
+
+/* Comienza a recibir una respuesta de rango con el encabezado en el búfer de la conexión: si los mensajes
+   extienden nuestro archivo activo, arma el nuevo archivo con nuestro prefijo y los valida a medida
+   que llegan; si no, los descarta. Devuelve 0, o -1 si el encabezado es inválido o si los mensajes
+   anunciados no caben en el límite de memoria. */
+int begin_range(struct conn *c);
+
+/* Procesa el siguiente mensaje de chat (en el búfer de la conexión) del archivo o rango en recepción.
+   Devuelve 0 si es válido o se descartó, o -1 si es inválido o supera el límite de memoria y hay
+   que cerrar la conexión. */
+int process_body(struct conn *c);
+
+/* Termina la recepción de un archivo o rango: si lo estábamos armando, lo reemplaza por el activo
+   si sigue siendo más grande. Devuelve 0, o -1 si el archivo resultó inválido. */
+int finish_body(struct conn *c);
+
+/* Reemplaza el archivo activo por el archivo validado dado si sigue siendo más grande que el activo,
+   o lo elimina en caso contrario. Si lo reemplaza, anuncia la nueva punta a los pares. */
+void replace_archive(struct archive *new_archive);
+
+/* Construye un mensaje de 21 bytes del tipo dado (MSG_TIP o MSG_RANGEREQ) con el tamaño del archivo
+   dado y el hash de su último mensaje. */
+void build_tip(struct archive *arch, uint8_t type, uint8_t *buf);
+
+/* Envía la punta dada (21 bytes) a todos los pares que soportan la extensión de rangos. */
+void announce_tip(const uint8_t *tip);
+
+/* Procesa un anuncio de punta (en el búfer de la conexión): pide los mensajes que faltan si el par
+   tiene un archivo más largo, o responde con nuestra punta si lo tiene más corto. */
+void process_tip(struct conn *c);
+
+/* Procesa una solicitud de rango (en el búfer de la conexión): envía los mensajes que siguen al
+   mensaje base si nuestro mensaje base coincide, o el archivo completo si no. */
+void process_rangereq(struct conn *c);
+
+/* Envía a la conexión dada una respuesta de rango con los mensajes del archivo dado que siguen al
+   mensaje 'base'. */
+void send_range(struct conn *c, struct archive *arch, uint32_t base);
+
+/* Publica el archivo dado (el activo) a todas las conexiones abiertas: a los pares que soportan rangos
+   solo les anunciamos la nueva punta, y al resto les enviamos el archivo completo. */
+void publish_archive(struct archive *arch);
+
+#endif
@@ -0,0 +1,619 @@
+#include "net.h"
+#include <linux/io_uring.h> // Estructuras y constantes de io_uring
+#include <sys/syscall.h>    // syscall, porque no dependemos de liburing
+#include <sys/mman.h>       // mmap, para compartir los anillos con el núcleo
+
+/* Backend de red basado en io_uring. En lugar de esperar a que cada socket esté listo y luego
+   hacer una llamada al sistema por cada lectura o escritura, dejamos operaciones pendientes en un
+   anillo compartido con el núcleo, que las completa por su cuenta y deja los resultados en otro
+   anillo. Una sola llamada a io_uring_enter por vuelta del bucle envía todas las operaciones nuevas
+   y espera resultados, sin importar cuántos pares haya:
+   - El socket de escucha tiene un accept "multishot", que entrega cada conexión entrante sin
+     volver a pedirlo.
+   - Cada conexión tiene un recv multishot que toma búferes de un anillo de búferes provistos,
+     compartido por todas las conexiones, y los devolvemos apenas procesamos su contenido.
+   - Los bloques pendientes de envío de una conexión se envían como una cadena de SEND enlazados,
+     que el núcleo ejecuta en orden. Solo hay una cadena en curso por conexión; lo que se encola
+     mientras tanto va en la siguiente. Los bloques de archivos apuntan al archivo, así que el
+     núcleo lo lee directamente, sin copiarlo antes a un búfer propio.
+   Necesita Linux 6.0 o superior; al iniciar verificamos que todo funcione, y si no, el bucle de
+   eventos usa epoll. Usamos las llamadas al sistema directamente, sin liburing. */
+
+/* Tamaño del anillo de envío y del de resultados */
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+
+/* Búferes provistos para las recepciones: cantidad (potencia de 2), tamaño y grupo */
+#define URING_BUFS 256
+#define URING_BUF_SIZE 16384
+#define URING_BGID 0
+
+/* Máximo de SEND enlazados en una cadena */
+#define URING_MAX_CHAIN 32
+
+/* Identificadores (user_data) de las operaciones: valores fijos para las que no pertenecen a una
+   conexión, y el puntero a la conexión más una etiqueta en sus 3 bits bajos para las demás */
+#define UD_IGNORE 0
+#define UD_ACCEPT 1
+#define UD_WAKE 2
+#define UD_PROBE 3
+#define UD_RECV 1
+#define UD_SEND 2
+#define UD_CONNECT 3
+#define UD_TAGS 7
+
+/* Estado del anillo: los punteros a los campos compartidos con el núcleo, la cola local del
+   anillo de envío, el anillo de búferes provistos, las conexiones con envíos por preparar y
+   cuántas conexiones cerradas esperan a que terminen sus operaciones */
+static struct
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+	unsigned tail;
+
+	struct io_uring_buf_ring *br;
+	uint8_t *bufs;
+	unsigned br_tail;
+
+	int listen_sock, wake_fd, stopping;
+	uint64_t wake_val;
+	struct conn *dirty;
+	unsigned zombies;
+} ring;
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+	net_syscalls++;
+	return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/* Publica las operaciones preparadas y devuelve cuántas faltan por enviar al núcleo */
+static unsigned sq_publish()
+{
+	__atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+	return ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Se asegura de que haya 'n' lugares libres en el anillo de envío, enviando lo preparado si hace falta */
+static void sq_reserve(unsigned n)
+{
+	if (ring.sq_entries - (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)) < n)
+	{
+		sys_enter(sq_publish(), 0, 0, NULL, 0);
+	}
+}
+
+/* Devuelve la siguiente entrada libre del anillo de envío, en blanco */
+static struct io_uring_sqe *get_sqe()
+{
+	sq_reserve(1);
+	unsigned idx = ring.tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[idx] = idx;
+	ring.tail++;
+	return sqe;
+}
+
+/* Devuelve el búfer provisto 'bid' al anillo de búferes, para que el núcleo lo vuelva a usar */
+static void recycle_buf(unsigned bid)
+{
+	struct io_uring_buf *buf = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(ring.bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ring.br_tail++;
+	__atomic_store_n(&ring.br->tail, (uint16_t)ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept()
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring.listen_sock;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = UD_ACCEPT;
+}
+
+static void arm_wake()
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = ring.wake_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&ring.wake_val;
+	sqe->len = sizeof(ring.wake_val);
+	sqe->user_data = UD_WAKE;
+}
+
+/* Prepara un recv multishot sobre el socket dado, que toma búferes del anillo de búferes provistos */
+static void prep_recv(struct io_uring_sqe *sqe, int sock, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sock;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = user_data;
+}
+
+static void arm_recv(struct conn *c)
+{
+	prep_recv(get_sqe(), c->sock, (uint64_t)(uintptr_t)c | UD_RECV);
+	c->inflight++;
+}
+
+/* Prepara la cadena de SEND enlazados con los bloques pendientes de la conexión. MSG_WAITALL hace que
+   el núcleo reintente los envíos parciales; si aun así un envío queda incompleto, el resto de la
+   cadena se cancela y la rehacemos desde el primer byte sin enviar */
+static void prep_sends(struct conn *c)
+{
+	struct out_chunk *chunk;
+	unsigned n = 0, i;
+
+	for (chunk = c->out_head; chunk != NULL && n < URING_MAX_CHAIN; chunk = chunk->next)
+	{
+		n++;
+	}
+
+	sq_reserve(n);
+	for (chunk = c->out_head, i = 0; i < n; chunk = chunk->next, i++)
+	{
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = c->sock;
+		sqe->addr = (uint64_t)(uintptr_t)(chunk->ptr + chunk->off);
+		sqe->len = chunk->len - chunk->off;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->flags = (i + 1 < n) ? IOSQE_IO_LINK : 0;
+		sqe->user_data = (uint64_t)(uintptr_t)c | UD_SEND;
+	}
+	c->send_inflight = n;
+	c->inflight += n;
+}
+
+/* Marca la conexión para preparar sus envíos antes de la próxima llamada a io_uring_enter */
+static void mark_dirty(struct conn *c)
+{
+	if (!c->dirty)
+	{
+		c->dirty = 1;
+		c->dirty_next = ring.dirty;
+		ring.dirty = c;
+	}
+}
+
+/* Cierra el socket de una conexión y la libera, cuando ya no tiene operaciones en curso */
+static void finalize(struct conn *c)
+{
+	close(c->sock);
+	net_syscalls++;
+	conn_free_chunks(c);
+	free(c);
+}
+
+/* Procesa un resultado del anillo */
+static void handle_cqe(struct io_uring_cqe *cqe)
+{
+	uint64_t ud = cqe->user_data;
+	int res = cqe->res;
+	unsigned flags = cqe->flags;
+
+	if (ud == UD_IGNORE || ud == UD_PROBE)
+	{
+		return;
+	}
+
+	if (ud == UD_ACCEPT)
+	{
+		if (res >= 0)
+		{
+			struct sockaddr_in peeraddr;
+			socklen_t peersize = sizeof(peeraddr);
+			net_syscalls++;
+			if (ring.stopping || getpeername(res, (struct sockaddr *)&peeraddr, &peersize) == -1)
+			{
+				close(res);
+			}
+			else
+			{
+				accept_conn(res, peeraddr.sin_addr.s_addr);
+			}
+		}
+		else if (res != -ECANCELED)
+		{
+			fprintf(stderr, "Error, no se pudo aceptar la conexión del par!\n");
+		}
+
+		if (!(flags & IORING_CQE_F_MORE) && !ring.stopping)
+		{
+			arm_accept();
+		}
+		return;
+	}
+
+	if (ud == UD_WAKE)
+	{
+		if (ring.stopping)
+		{
+			return;
+		}
+		if (res > 0)
+		{
+			handle_wake();
+		}
+		arm_wake();
+		return;
+	}
+
+	struct conn *c = (struct conn *)(uintptr_t)(ud & ~(uint64_t)UD_TAGS);
+	switch (ud & UD_TAGS)
+	{
+	case UD_RECV:
+	{
+		if (flags & IORING_CQE_F_BUFFER)
+		{
+			unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (!c->dead && res > 0)
+			{
+				conn_received(c, ring.bufs + (size_t)bid * URING_BUF_SIZE, res);
+			}
+			recycle_buf(bid);
+		}
+		else if (!c->dead && res != -ENOBUFS)
+		{
+			conn_received(c, NULL, res);
+		}
+
+		/* El recv multishot terminó: si fue por falta de búferes (o por otra razón sin que la
+		   conexión se cerrara), lo volvemos a pedir */
+		if (!(flags & IORING_CQE_F_MORE))
+		{
+			c->inflight--;
+			if (!c->dead && !c->closing && (res > 0 || res == -ENOBUFS))
+			{
+				arm_recv(c);
+			}
+		}
+		break;
+	}
+
+	case UD_SEND:
+	{
+		c->inflight--;
+		c->send_inflight--;
+		if (!c->dead)
+		{
+			if (res > 0)
+			{
+				conn_sent(c, res);
+			}
+			else if (res < 0 && res != -ECANCELED)
+			{
+				log_msg(LOG_WARN, c->log, "Error al enviar al par, ¿tubo roto?\n");
+				c->closing = 1;
+			}
+
+			if (c->send_inflight == 0 && c->out_head != NULL)
+			{
+				mark_dirty(c);
+			}
+		}
+		break;
+	}
+
+	case UD_CONNECT:
+	{
+		c->inflight--;
+		if (!c->dead)
+		{
+			conn_connected(c, res < 0 ? -res : 0);
+		}
+		break;
+	}
+	}
+
+	if (c->dead && c->inflight == 0 && !c->dirty)
+	{
+		ring.zombies--;
+		finalize(c);
+	}
+}
+
+/* Procesa todos los resultados disponibles */
+static void reap_cqes()
+{
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail)
+	{
+		struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+		head++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		handle_cqe(&cqe);
+	}
+}
+
+/* Espera un solo resultado y lo devuelve en 'out'. Solo se usa al verificar el soporte del núcleo */
+static int wait_one(struct io_uring_cqe *out)
+{
+	unsigned head = *ring.cq_head;
+	while (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+	{
+		if (sys_enter(sq_publish(), 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+		{
+			return -1;
+		}
+	}
+	*out = ring.cqes[head & *ring.cq_mask];
+	__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Verifica que el núcleo soporte recv multishot con búferes provistos: recibe un byte por un par de
+   sockets locales y espera que el recv siga activo, y luego cierra el par */
+static int probe_multishot()
+{
+	struct io_uring_cqe cqe;
+	int sv[2], ok = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+	{
+		return 0;
+	}
+
+	prep_recv(get_sqe(), sv[0], UD_PROBE);
+	if (write(sv[1], "x", 1) == 1 && wait_one(&cqe) == 0)
+	{
+		ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE) && (cqe.flags & IORING_CQE_F_BUFFER);
+		if (cqe.flags & IORING_CQE_F_BUFFER)
+		{
+			recycle_buf(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+
+		/* Al cerrar el otro extremo el recv termina con 0 bytes */
+		shutdown(sv[1], SHUT_WR);
+		while (ok && (cqe.flags & IORING_CQE_F_MORE) && wait_one(&cqe) == 0)
+		{
+			if (cqe.flags & IORING_CQE_F_BUFFER)
+			{
+				recycle_buf(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			}
+		}
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	return ok;
+}
+
+static void uring_cleanup();
+
+static int uring_init(int lsock, int wfd)
+{
+	struct io_uring_params p;
+	unsigned i;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.listen_sock = lsock;
+	ring.wake_fd = wfd;
+
+	/* COOP_TASKRUN evita interrumpir al hilo por cada resultado; si el núcleo no lo conoce,
+	   lo intentamos sin él */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = URING_CQ_ENTRIES;
+	ring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd == -1)
+	{
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_CQ_ENTRIES;
+		ring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	}
+	if (ring.fd == -1)
+	{
+		return -1;
+	}
+
+	unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+	if ((p.features & needed) != needed)
+	{
+		close(ring.fd);
+		return -1;
+	}
+
+	/* Mapea los anillos compartidos con el núcleo */
+	ring.sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring.cq_map_len > ring.sq_map_len)
+	{
+		ring.sq_map_len = ring.cq_map_len;
+	}
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring.sq_map = mmap(NULL, ring.sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.sqes = (struct io_uring_sqe *)mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sq_map == MAP_FAILED || ring.sqes == MAP_FAILED)
+	{
+		close(ring.fd);
+		return -1;
+	}
+	ring.cq_map = ring.sq_map;
+
+	uint8_t *sq = (uint8_t *)ring.sq_map, *cq = (uint8_t *)ring.cq_map;
+	ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.sq_entries = p.sq_entries;
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring.tail = *ring.sq_tail;
+
+	/* Registra el anillo de búferes provistos y le entrega todos los búferes */
+	ring.br = (struct io_uring_buf_ring *)mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+											   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	ring.bufs = (uint8_t *)malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring.br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (ring.br == MAP_FAILED || syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		if (ring.br == MAP_FAILED)
+		{
+			ring.br = NULL;
+		}
+		uring_cleanup();
+		return -1;
+	}
+	for (i = 0; i < URING_BUFS; i++)
+	{
+		recycle_buf(i);
+	}
+
+	if (!probe_multishot())
+	{
+		uring_cleanup();
+		return -1;
+	}
+
+	if (ring.listen_sock != -1)
+	{
+		arm_accept();
+	}
+	arm_wake();
+	return 0;
+}
+
+static void uring_watch(struct conn *c)
+{
+	arm_recv(c);
+}
+
+static int uring_connect(struct conn *c)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = c->sock;
+	sqe->addr = (uint64_t)(uintptr_t)&c->addr;
+	sqe->off = sizeof(c->addr);
+	sqe->user_data = (uint64_t)(uintptr_t)c | UD_CONNECT;
+	c->inflight++;
+	return 0;
+}
+
+static void uring_send(struct conn *c, const struct iovec *iov, uint32_t n, struct archive *arch)
+{
+	uint32_t i;
+	for (i = 0; i < n; i++)
+	{
+		conn_queue(c, (const uint8_t *)iov[i].iov_base, iov[i].iov_len, arch);
+	}
+	mark_dirty(c);
+}
+
+static void uring_release(struct conn *c)
+{
+	c->dead = 1;
+	if (c->inflight == 0 && !c->dirty)
+	{
+		finalize(c);
+		return;
+	}
+
+	/* Cancela todas las operaciones sobre el socket; la conexión se libera cuando terminen */
+	ring.zombies++;
+	if (c->inflight > 0)
+	{
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = c->sock;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = UD_IGNORE;
+		shutdown(c->sock, SHUT_RDWR);
+		net_syscalls++;
+	}
+}
+
+static void uring_wait(int timeout)
+{
+	/* Prepara las cadenas de envío de las conexiones que encolaron datos */
+	while (ring.dirty != NULL)
+	{
+		struct conn *c = ring.dirty;
+		ring.dirty = c->dirty_next;
+		c->dirty = 0;
+
+		if (c->dead)
+		{
+			if (c->inflight == 0)
+			{
+				ring.zombies--;
+				finalize(c);
+			}
+			continue;
+		}
+		if (c->send_inflight == 0 && c->out_head != NULL && c->state == CONN_OPEN)
+		{
+			prep_sends(c);
+		}
+	}
+
+	/* Envía todo lo preparado y espera al menos un resultado, o hasta que se acabe el tiempo */
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	sys_enter(sq_publish(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+	reap_cqes();
+}
+
+static void uring_cleanup()
+{
+	int i;
+
+	/* Espera un poco a que terminen las operaciones de las conexiones cerradas, para liberarlas */
+	ring.stopping = 1;
+	for (i = 0; i < 100 && ring.zombies > 0; i++)
+	{
+		uring_wait(10);
+	}
+
+	if (ring.bufs != NULL)
+	{
+		free(ring.bufs);
+	}
+	if (ring.br != NULL)
+	{
+		munmap(ring.br, URING_BUFS * sizeof(struct io_uring_buf));
+	}
+	munmap(ring.sqes, ring.sqes_len);
+	munmap(ring.sq_map, ring.sq_map_len);
+	close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+}
+
+const struct net_backend uring_backend = {
+	"io_uring",
+	uring_init,
+	uring_watch,
+	uring_connect,
+	uring_send,
+	uring_release,
+	uring_wait,
+	uring_cleanup};
@@ -1,4 +1,5 @@
 #include "peerlist.h"
+#include "hazard.h"
 
 /* Este archivo implementa una estructura de datos de lista y sus funciones asociadas.
    La implementación específica de la lista contenida aquí está destinada a almacenar la lista de
@@ -6,162 +7,279 @@
    como mantener una representación en cadena pre-computada de la misma, para que la construcción
    de paquetes de red que contienen la lista sea razonablemente rápida.
 
-   NOTA: Una tabla hash o incluso un conjunto ordenado (usando un árbol) definitivamente
-   habrían sido mejores opciones para almacenar la lista de pares, pero sus implementaciones
-   habrían sido más laboriosas, y dado que es poco probable que el tamaño de la lista crezca
-   significativamente, no vale la pena el esfuerzo. */
+   Los pares se guardan en un arreglo denso, en el mismo orden que sus IPs en la representación en
+   cadena, y se buscan con dos tablas hash (por IP y por socket). Al agregar un par su IP se escribe
+   al final de la cadena; al eliminarlo, el último par ocupa su lugar en el arreglo y en la cadena,
+   así que ninguna operación recorre la lista ni reconstruye la cadena.
 
-/* Recomputa la representación en cadena de la lista, para actualizar los pares conectados después
-   de la eliminación o adición de un par */
-void list_to_str(struct peer_list *list)
-{
-	uint8_t *buf;
-	uint32_t size;
+   Para responder a otros hilos sin bloquear la lista, la cadena se publica como una copia inmutable
+   con contador de referencias detrás de un puntero atómico, con el mismo esquema que el snapshot de
+   archivos: los lectores la protegen con un puntero de riesgo mientras toman su referencia, y el
+   escritor retira la copia anterior sin esperarlos (ver hazard.h). */
 
-	/* Obtiene el tamaño de la lista */
-	size = list->size;
+/* Tamaño inicial de los índices */
+#define PEERLIST_MIN_SLOTS 16
 
-	/* Libera la cadena antigua y asigna memoria para la nueva */
-	free(list->str);
-	buf = (uint8_t *)malloc((5 + (size * 4)) * sizeof(uint8_t));
+/* Dispersa una clave de 32 bits (IP o socket) con el hash multiplicativo de Fibonacci, mezclando
+   los bits altos del producto con los bajos, que son los que elige la máscara */
+static uint32_t hash_key(uint32_t key)
+{
+	uint32_t h = key * 0x9E3779B1u;
+	return h ^ (h >> 16);
+}
 
-	/* El primer byte es el tipo de mensaje (2), los otros cuatro bytes son el número de pares */
-	buf[0] = 2;
-	buf[1] = (size >> 24) & 0xFF;
-	buf[2] = (size >> 16) & 0xFF;
-	buf[3] = (size >> 8) & 0xFF;
-	buf[4] = size & 0xFF;
-
-	/* Ahora, para cada nodo en la lista, convierte la IP de entero a arreglo de bytes,
-	   en orden de bytes de red */
-	struct node *aux = list->head->next;
-	uint32_t i;
-	for (i = 5; i < (5 + (size * 4)); i += 4)
+/* Devuelve la ranura del índice donde está la clave dada, o la ranura vacía donde iría */
+static uint32_t slot_find(const struct peer_slot *table, uint32_t mask, uint32_t key)
+{
+	uint32_t i = hash_key(key) & mask;
+	while (table[i].used && table[i].key != key)
 	{
-		buf[i + 3] = (aux->ip >> 24) & 0xFF;
-		buf[i + 2] = (aux->ip >> 16) & 0xFF;
-		buf[i + 1] = (aux->ip >> 8) & 0xFF;
-		buf[i] = aux->ip & 0xFF;
-
-		aux = aux->next;
+		i = (i + 1) & mask;
 	}
-
-	list->str = buf;
+	return i;
 }
 
-/* Agrega una IP dada a la lista de pares conectados y actualiza el tamaño de la lista
-   y su representación en cadena en consecuencia */
-void add_peer(struct peer_list *list, uint32_t ip, uint32_t sock)
+/* Vacía la ranura 'i' del índice. Como el sondeo es lineal, en lugar de dejar una marca de borrado
+   movemos hacia atrás las claves siguientes que ya no podrían encontrarse, hasta la primera ranura
+   vacía: una clave de la ranura j puede ocupar la ranura i si i está entre su ranura ideal y j */
+static void slot_delete(struct peer_slot *table, uint32_t mask, uint32_t i)
 {
-	struct node *aux;
+	uint32_t j = i;
+	for (;;)
+	{
+		j = (j + 1) & mask;
+		if (!table[j].used)
+		{
+			break;
+		}
+		uint32_t home = hash_key(table[j].key) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].used = 0;
+}
 
-	aux = list->last;
+/* Duplica el tamaño de los índices, volviendo a insertar todas las claves */
+static void grow_index(struct peer_list *list)
+{
+	uint32_t old_mask = list->mask, mask = 2 * old_mask + 1, i;
+	struct peer_slot *by_sock = (struct peer_slot *)calloc(mask + 1, sizeof(struct peer_slot));
 
-	aux->next = (struct node *)malloc(sizeof(struct node));
-	aux->next->ip = ip;
-	aux->next->sock = sock;
-	aux->next->next = NULL;
-	list->last = aux->next;
+	for (i = 0; i <= old_mask; i++)
+	{
+		if (list->by_sock[i].used)
+		{
+			by_sock[slot_find(by_sock, mask, list->by_sock[i].key)] = list->by_sock[i];
+		}
+	}
+	free(list->by_sock);
+	list->by_sock = by_sock;
 
-	list->size += 1;
+	free(list->by_ip);
+	list->by_ip = (struct peer_slot *)calloc(mask + 1, sizeof(struct peer_slot));
+	for (i = 0; i < list->size; i++)
+	{
+		struct peer_slot *slot = &list->by_ip[slot_find(list->by_ip, mask, list->peers[i].ip)];
+		slot->key = list->peers[i].ip;
+		slot->val = i;
+		slot->used = 1;
+	}
+	list->mask = mask;
+}
 
-	list_to_str(list);
+/* Escribe el número de pares en el encabezado de la representación en cadena */
+static void str_size(struct peer_list *list)
+{
+	uint32_t size = list->size;
+	list->str[1] = (size >> 24) & 0xFF;
+	list->str[2] = (size >> 16) & 0xFF;
+	list->str[3] = (size >> 8) & 0xFF;
+	list->str[4] = size & 0xFF;
 }
 
-/* Elimina una IP dada de la lista de pares conectados y actualiza el tamaño de la lista
+/* Agrega una IP dada a la lista de pares conectados y actualiza el tamaño de la lista
    y su representación en cadena en consecuencia */
-void remove_peer(struct peer_list *list, uint32_t ip)
+void add_peer(struct peer_list *list, uint32_t ip, uint32_t sock)
 {
-	struct node *prev;
+	/* Las tablas nunca pasan de la mitad de su capacidad; cada par tiene un solo socket */
+	if (2 * (list->size + 1) > list->mask + 1)
+	{
+		grow_index(list);
+	}
 
-	prev = list->head;
+	struct peer_slot *sslot = &list->by_sock[slot_find(list->by_sock, list->mask, sock)];
+	sslot->key = sock;
+	sslot->val = ip;
+	sslot->used = 1;
 
-	/* Intenta encontrar la IP en la lista, si la encontramos, rompe el bucle con prev = nodo anterior */
-	while (prev != list->last)
+	/* Si ya estamos conectados con la IP, la nueva conexión reemplaza a la anterior */
+	struct peer_slot *slot = &list->by_ip[slot_find(list->by_ip, list->mask, ip)];
+	if (slot->used)
 	{
-		if (prev->next->ip == ip)
+		struct peer *peer = &list->peers[slot->val];
+		if (peer->sock != sock)
 		{
-			break;
+			slot_delete(list->by_sock, list->mask, slot_find(list->by_sock, list->mask, peer->sock));
+			peer->sock = sock;
 		}
-		prev = prev->next;
+		return;
+	}
+
+	if (list->size == list->cap)
+	{
+		list->cap *= 2;
+		list->peers = (struct peer *)realloc(list->peers, list->cap * sizeof(struct peer));
+		list->str = (uint8_t *)realloc(list->str, 5 + (list->cap * 4));
 	}
 
-	/* Si la IP no está en la lista, retorna */
-	if (prev->next == NULL)
+	slot->key = ip;
+	slot->val = list->size;
+	slot->used = 1;
+	list->peers[list->size].ip = ip;
+	list->peers[list->size].sock = sock;
+
+	/* Convierte la IP de entero a arreglo de bytes, en orden de bytes de red, al final de la cadena */
+	uint8_t *buf = list->str + 5 + (list->size * 4);
+	buf[3] = (ip >> 24) & 0xFF;
+	buf[2] = (ip >> 16) & 0xFF;
+	buf[1] = (ip >> 8) & 0xFF;
+	buf[0] = ip & 0xFF;
+
+	list->size += 1;
+	str_size(list);
+	list->dirty = 1;
+}
+
+/* Elimina la IP dada, conectada por el socket dado, de la lista de pares conectados, actualizando el
+   tamaño y la representación en cadena */
+void remove_peer(struct peer_list *list, uint32_t ip, uint32_t sock)
+{
+	/* Si la conexión no está en la lista (por ejemplo, una conexión duplicada que se cerró antes de
+	   agregarla, o que otra reemplazó), retorna sin tocar la del par */
+	uint32_t i = slot_find(list->by_sock, list->mask, sock);
+	if (!list->by_sock[i].used || list->by_sock[i].val != ip)
 	{
 		return;
 	}
+	slot_delete(list->by_sock, list->mask, i);
 
-	/* Obtiene el puntero al nodo que se va a eliminar y actualiza el puntero de prev */
-	struct node *to_remove = prev->next;
+	i = slot_find(list->by_ip, list->mask, ip);
 
-	prev->next = to_remove->next;
+	uint32_t pos = list->by_ip[i].val;
+	slot_delete(list->by_ip, list->mask, i);
 
-	/* Si estamos eliminando el último nodo, actualiza el puntero */
-	if (to_remove == list->last)
+	/* El último par ocupa el lugar del eliminado, en el arreglo y en la cadena */
+	uint32_t last = list->size - 1;
+	if (pos != last)
 	{
-		list->last = prev;
+		list->peers[pos] = list->peers[last];
+		memcpy(list->str + 5 + (pos * 4), list->str + 5 + (last * 4), 4);
+		list->by_ip[slot_find(list->by_ip, list->mask, list->peers[pos].ip)].val = pos;
 	}
 
-	/* Libera la memoria y actualiza el tamaño de la lista */
-	free(to_remove);
 	list->size -= 1;
-
-	/* Actualiza la representación en cadena de la lista */
-	list_to_str(list);
+	str_size(list);
+	list->dirty = 1;
 }
 
 /* Devuelve 1 si la IP dada está actualmente en la lista de pares conectados, 0
    en caso contrario. Obviamente se usa para verificar si ya estamos conectados a una IP */
 int is_connected(struct peer_list *list, uint32_t ip)
 {
-	struct node *aux;
-
-	aux = list->head;
+	return list->by_ip[slot_find(list->by_ip, list->mask, ip)].used;
+}
 
-	/* Busca la IP en la lista, devuelve 1 si la encuentra */
-	while (aux != NULL)
+/* Devuelve el par conectado por el socket dado, o NULL si no hay ninguno */
+struct peer *find_peer_by_sock(struct peer_list *list, uint32_t sock)
+{
+	struct peer_slot *slot = &list->by_sock[slot_find(list->by_sock, list->mask, sock)];
+	if (!slot->used)
 	{
-		if (aux->ip == ip)
-		{
-			return 1;
-		}
-		aux = aux->next;
+		return NULL;
 	}
+	return &list->peers[list->by_ip[slot_find(list->by_ip, list->mask, slot->val)].val];
+}
+
+/* Copia la representación en cadena actual de la lista, con una referencia para el llamador */
+static struct peer_payload *payload_copy(struct peer_list *list)
+{
+	uint32_t len = 5 + (4 * list->size);
+	struct peer_payload *payload = (struct peer_payload *)malloc(sizeof(struct peer_payload) + len);
 
-	/* Si llegamos aquí, no está en la lista */
-	return 0;
+	atomic_init(&payload->refs, 1);
+	payload->len = len;
+	memcpy(payload->data, list->str, len);
+	return payload;
 }
 
-/* Imprime una lista de pares conectados. Solo para fines de depuración */
-void print_list(struct peer_list *list)
+void peer_payload_unref(struct peer_payload *payload)
 {
-	struct node *aux;
+	if (atomic_fetch_sub(&payload->refs, 1) == 1)
+	{
+		free(payload);
+	}
+}
 
-	fprintf(stderr, "Lista de pares [tamaño %u]:\n", list->size);
+/* Suelta la referencia de la lista a una copia retirada, ver hazard_retire */
+static void release_retired(void *payload)
+{
+	peer_payload_unref((struct peer_payload *)payload);
+}
 
-	/* Lista vacía, retorna */
-	if (list->head == list->last)
+/* Hay un solo escritor, así que no hace falta comparar antes de reemplazar el puntero. La copia
+   anterior se retira: si algún lector la está tomando, se suelta más adelante */
+void peerlist_publish(struct peer_list *list)
+{
+	if (!list->dirty)
 	{
 		return;
 	}
+	list->dirty = 0;
 
-	/* La cabeza se deja vacía intencionalmente, comenzamos a imprimir desde el nodo 2 */
-	aux = list->head->next;
+	struct peer_payload *old = atomic_exchange(&list->payload, payload_copy(list));
+	hazard_retire(old, release_retired);
+}
 
-	/* Imprime todos los nodos, luego el último */
-	while (aux != list->last)
+/* El lector anota la copia como puntero de riesgo antes de tomar su referencia, y la vuelve a leer
+   para confirmar que el escritor todavía no la había retirado al anotarla */
+struct peer_payload *peerlist_get(struct peer_list *list)
+{
+	int slot = hazard_claim();
+	struct peer_payload *payload = atomic_load(&list->payload), *again;
+	for (;;)
 	{
-		/* Como esto es solo para depuración, no nos molestamos en convertir a cadena */
-		fprintf(stderr, "%u[%u] -> ", aux->ip, aux->sock);
-		aux = aux->next;
+		hazard_set(slot, payload);
+		again = atomic_load(&list->payload);
+		if (again == payload)
+		{
+			break;
+		}
+		payload = again;
 	}
-	fprintf(stderr, "%u[%u]\n", aux->ip, aux->sock);
+	atomic_fetch_add(&payload->refs, 1);
+	hazard_release(slot);
+	return payload;
 }
 
-/* Inicializa una estructura de lista de pares. Inicialmente, la lista tiene tamaño 0,
-   y los nodos último y cabeza son los mismos (sin datos). Su representación en cadena es
-   también un puntero NULL */
+/* Imprime una lista de pares conectados. Solo para fines de depuración */
+void print_list(struct peer_list *list)
+{
+	uint32_t i;
+
+	fprintf(stderr, "Lista de pares [tamaño %u]:\n", list->size);
+
+	/* Como esto es solo para depuración, no nos molestamos en convertir a cadena */
+	for (i = 0; i < list->size; i++)
+	{
+		fprintf(stderr, "%u[%u]%s", list->peers[i].ip, list->peers[i].sock, (i + 1 < list->size) ? " -> " : "\n");
+	}
+}
+
+/* Inicializa una estructura de lista de pares. Inicialmente, la lista tiene tamaño 0, y su
+   representación en cadena es un mensaje MSG_PEERLIST sin IPs */
 struct peer_list *init_list()
 {
 	struct peer_list *newlist;
@@ -169,12 +287,32 @@ struct peer_list *init_list()
 	newlist = (struct peer_list *)malloc(sizeof(struct peer_list));
 
 	newlist->size = 0;
-	newlist->head = (struct node *)malloc(sizeof(struct node));
-	newlist->head->next = NULL;
-	newlist->head->ip = 0;
-	newlist->last = newlist->head;
+	newlist->cap = PEERLIST_MIN_SLOTS / 2;
+	newlist->peers = (struct peer *)malloc(newlist->cap * sizeof(struct peer));
+
+	/* El primer byte es el tipo de mensaje (2), los otros cuatro bytes son el número de pares */
+	newlist->str = (uint8_t *)malloc(5 + (newlist->cap * 4));
+	newlist->str[0] = 2;
+	str_size(newlist);
 
-	newlist->str = NULL;
+	newlist->mask = PEERLIST_MIN_SLOTS - 1;
+	newlist->by_ip = (struct peer_slot *)calloc(PEERLIST_MIN_SLOTS, sizeof(struct peer_slot));
+	newlist->by_sock = (struct peer_slot *)calloc(PEERLIST_MIN_SLOTS, sizeof(struct peer_slot));
+
+	atomic_init(&newlist->payload, payload_copy(newlist));
+	newlist->dirty = 0;
 
 	return newlist;
 }
+
+/* Libera una lista de pares y toda su memoria */
+void free_list(struct peer_list *list)
+{
+	free(list->peers);
+	free(list->str);
+	free(list->by_ip);
+	free(list->by_sock);
+	peer_payload_unref(atomic_load(&list->payload));
+	hazard_collect();
+	free(list);
+}
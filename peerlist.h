@@ -1,48 +1,98 @@
 #include <stdio.h>  // para imprimir información de depuración
 #include <stdlib.h> // mallocs, frees y demás
 #include <stdint.h> // tipos de tamaño portátil (uint8_t, uint32_t, etc.)
+#include <string.h> // memcpy, para mover IPs dentro de la representación en cadena
+#include <stdatomic.h> // publicación de la representación en cadena sin bloqueos
 
-/* Estructura que representa un nodo en una lista de pares conectados. Almacenamos las IPs como
-   enteros sin signo de 4 bytes para una comparación más rápida. Esto es seguro porque todas las IPs
-   están garantizadas como IPv4. También almacenamos el socket asociado con ese par,
-   para que podamos transmitir mensajes iterando a través de la lista */
-struct node
+/* Estructura que representa un par conectado. Almacenamos las IPs como enteros sin signo de 4 bytes
+   para una comparación más rápida. Esto es seguro porque todas las IPs están garantizadas como IPv4.
+   También almacenamos el socket de la conexión con ese par: con cada IP hay a lo sumo una, porque
+   la red cierra las duplicadas */
+struct peer
 {
   uint32_t ip;
   uint32_t sock;
-  struct node *next;
 };
 
-/* Estructura que representa toda una lista de pares, con punteros a los primeros y
-   últimos nodos, tamaño (en número de nodos) y representación en cadena, para una construcción
-   de mensajes más rápida */
+/* Ranura de un índice de la lista de pares: la clave (IP o socket), el valor (la posición del par en
+   el arreglo denso, o su IP) y si está ocupada */
+struct peer_slot
+{
+  uint32_t key, val;
+  uint8_t used;
+};
+
+/* Copia inmutable de la representación en cadena de la lista de pares (el mensaje MSG_PEERLIST
+   completo, de 'len' bytes), tal como se publicó en algún momento. Se libera cuando su contador de
+   referencias 'refs' llega a 0; mientras tanto cualquier hilo puede leerla sin bloquear a nadie */
+struct peer_payload
+{
+  atomic_uint refs;
+  uint32_t len;
+  uint8_t data[];
+};
+
+/* Estructura que representa toda una lista de pares:
+   peers    -> arreglo denso con los pares, en el mismo orden que sus IPs en 'str' (capacidad 'cap')
+   size     -> número de pares
+   str      -> representación en cadena (el mensaje MSG_PEERLIST completo), que se actualiza en su
+               lugar al agregar o eliminar un par, en lugar de reconstruirse
+   by_ip    -> índice por IP: tabla hash de direccionamiento abierto con sondeo lineal, que guarda
+               la posición de cada par en 'peers'
+   by_sock  -> índice por socket, con el mismo formato, que guarda la IP del par de cada conexión
+   mask     -> tamaño de los índices menos 1 (siempre son potencias de 2, con a lo sumo la mitad de
+               las ranuras ocupadas, para que las búsquedas sondeen pocas ranuras)
+   payload  -> copia publicada de 'str', para los lectores (ver peerlist_get)
+   dirty    -> si la lista cambió desde la última publicación
+   Solo un hilo (el del bucle de red) modifica la lista; los demás solo leen la copia publicada */
 struct peer_list
 {
-  struct node *head, *last;
-  uint32_t size;
+  struct peer *peers;
+  uint32_t size, cap;
   uint8_t *str;
+  struct peer_slot *by_ip, *by_sock;
+  uint32_t mask;
+  _Atomic(struct peer_payload *) payload;
+  uint8_t dirty;
 };
 
-/* Recomputa la representación en cadena de la lista, para actualizar los pares conectados después
-   de la eliminación o adición de un par */
-void list_to_str(struct peer_list *list);
-
-/* Agrega una IP dada a la lista de pares conectados y actualiza el tamaño de la lista
-   y su representación en cadena en consecuencia */
+/* Agrega una IP dada, conectada por el socket dado, a la lista de pares conectados y actualiza el
+   tamaño de la lista y su representación en cadena en consecuencia. Si la IP ya estaba en la lista,
+   la nueva conexión reemplaza a la anterior */
 void add_peer(struct peer_list *list, uint32_t ip, uint32_t sock);
 
-/* Elimina una IP dada de la lista de pares conectados y actualiza el tamaño de la lista
-   y su representación en cadena en consecuencia */
-void remove_peer(struct peer_list *list, uint32_t ip);
+/* Elimina la IP dada, conectada por el socket dado, de la lista de pares conectados y actualiza el
+   tamaño de la lista y su representación en cadena en consecuencia. Si esa conexión no estaba en la
+   lista (por ejemplo, porque otra la reemplazó), no hace nada */
+void remove_peer(struct peer_list *list, uint32_t ip, uint32_t sock);
 
 /* Devuelve 1 si la IP dada está actualmente en la lista de pares conectados, 0
    en caso contrario. Obviamente se usa para verificar si ya estamos conectados a una IP */
 int is_connected(struct peer_list *list, uint32_t ip);
 
+/* Devuelve el par conectado por el socket dado, o NULL si no hay ninguno. El puntero sirve hasta la
+   próxima modificación de la lista */
+struct peer *find_peer_by_sock(struct peer_list *list, uint32_t sock);
+
+/* Publica la representación en cadena actual de la lista, si cambió desde la última publicación.
+   Solo debe llamarla el hilo que modifica la lista; agrupar varios cambios en una sola publicación
+   evita copiar la cadena en cada uno */
+void peerlist_publish(struct peer_list *list);
+
+/* Devuelve la última representación en cadena publicada, con una referencia que el llamador debe
+   soltar con peer_payload_unref. Puede llamarse desde cualquier hilo, nunca bloquea y nunca ve una
+   lista a medio modificar */
+struct peer_payload *peerlist_get(struct peer_list *list);
+
+/* Suelta una referencia a una representación publicada, liberándola si era la última */
+void peer_payload_unref(struct peer_payload *payload);
+
 /* Imprime una lista de pares conectados. Solo para fines de depuración */
 void print_list(struct peer_list *list);
 
-/* Inicializa una estructura de lista de pares. Inicialmente, la lista tiene tamaño 0,
-   y los nodos último y cabeza son los mismos (sin datos). Su representación en cadena es
-   también un puntero NULL */
+/* Inicializa una estructura de lista de pares. Inicialmente, la lista tiene tamaño 0, y su
+   representación en cadena es un mensaje MSG_PEERLIST sin IPs */
 struct peer_list *init_list();
+
+/* Libera una lista de pares y toda su memoria */
+void free_list(struct peer_list *list);
@@ -0,0 +1,591 @@
+#include "archive.h"
+#include "store.h"
+#include <fcntl.h>    // open y sus banderas
+#include <sys/mman.h> // mmap, para cargar el fichero de datos sin leerlo en partes
+#include <sys/stat.h> // fstat, para conocer el tamaño del fichero de datos
+#include <stddef.h>   // offsetof
+#include <errno.h>    // ETIMEDOUT, al esperar el plazo del punto de control
+
+/* Encabezado del fichero de índice, que guarda el punto de control. Se escribe de una sola vez en
+   el primer bloque del fichero, y 'check' permite descartar un encabezado escrito a medias.
+   'index_check' es la suma de verificación de los 'count' offsets que siguen al encabezado, para
+   poder usarlos al cargar sin comprobarlos contra los datos */
+#define STORE_MAGIC "CHATIDX2"
+#define STORE_HEADER_SIZE 64
+
+struct store_header
+{
+  uint8_t magic[8];
+  uint32_t count;
+  uint32_t len;
+  uint8_t last_md5[16];
+  uint32_t index_check;
+  uint32_t check;
+};
+
+/* Valor inicial de FNV-1a, la suma de verificación de 0 bytes */
+#define FNV_BASIS 2166136261u
+
+/* Extiende la suma de verificación FNV-1a 'h' con 'len' bytes */
+static uint32_t fnv1a(uint32_t h, const void *buf, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)buf;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* Suma de verificación de los campos del encabezado anteriores a 'check' */
+static uint32_t header_check(const struct store_header *hdr)
+{
+  return fnv1a(FNV_BASIS, hdr, offsetof(struct store_header, check));
+}
+
+/* Escribe 'len' bytes en el offset dado, reintentando las escrituras parciales */
+static int write_all(int fd, const void *buf, size_t len, off_t off)
+{
+  const uint8_t *p = (const uint8_t *)buf;
+
+  while (len > 0)
+  {
+    ssize_t n = pwrite(fd, p, len, off);
+    if (n == -1)
+    {
+      return -1;
+    }
+    p += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+int store_parse_sync(const char *name, enum store_sync *policy)
+{
+  if (strcmp(name, "always") == 0)
+  {
+    *policy = STORE_SYNC_ALWAYS;
+  }
+  else if (strcmp(name, "interval") == 0)
+  {
+    *policy = STORE_SYNC_INTERVAL;
+  }
+  else if (strcmp(name, "never") == 0)
+  {
+    *policy = STORE_SYNC_NEVER;
+  }
+  else
+  {
+    return -1;
+  }
+  return 0;
+}
+
+/* Agrega el offset de un mensaje al índice en memoria */
+static void push_offset(struct store *st, uint32_t off)
+{
+  if (st->count == st->cap)
+  {
+    st->cap = st->cap ? st->cap * 2 : 1024;
+    st->offsets = (uint32_t *)realloc(st->offsets, st->cap * sizeof(uint32_t));
+  }
+  st->offsets[st->count++] = off;
+  st->index_hash = fnv1a(st->index_hash, &off, sizeof(off));
+}
+
+/* Escribe el punto de control con el estado actual. Si 'durable', primero sincroniza los datos con el
+   disco, para que el punto de control nunca apunte a datos que no llegaron al disco, y luego el índice */
+static int checkpoint(struct store *st, int durable)
+{
+  struct store_header hdr;
+
+  if (durable && fdatasync(st->data_fd) == -1)
+  {
+    return -1;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, STORE_MAGIC, 8);
+  hdr.count = st->count;
+  hdr.len = st->len;
+  memcpy(hdr.last_md5, st->last_md5, 16);
+  hdr.index_check = st->index_hash;
+  hdr.check = header_check(&hdr);
+  if (write_all(st->idx_fd, &hdr, sizeof(hdr), 0) == -1)
+  {
+    return -1;
+  }
+
+  if (durable && fdatasync(st->idx_fd) == -1)
+  {
+    return -1;
+  }
+
+  st->synced = st->count;
+  st->last_sync = time(NULL);
+  return 0;
+}
+
+/* Lee el punto de control del índice y lo verifica contra los datos mapeados en 'map' (de 'dlen'
+   bytes). Si los offsets guardados tienen la suma de verificación del punto de control se usan tal
+   cual, sin leer los datos: basta con que el último mensaje termine donde dice el punto de control y
+   tenga su hash. Si no, se reconstruyen siguiendo las longitudes de los mensajes (sin hashear nada),
+   y se vuelven a escribir. Deja el estado del punto de control en 'st', o uno vacío si no es válido */
+static void load_checkpoint(struct store *st, const uint8_t *map, uint32_t dlen)
+{
+  struct store_header hdr;
+  uint32_t i, off = 0;
+
+  if (pread(st->idx_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, STORE_MAGIC, 8) != 0 ||
+      hdr.check != header_check(&hdr) || hdr.len > dlen || hdr.count > hdr.len / 33)
+  {
+    return;
+  }
+
+  st->cap = hdr.count ? hdr.count : 1;
+  st->offsets = (uint32_t *)malloc(st->cap * sizeof(uint32_t));
+  ssize_t want = (ssize_t)hdr.count * sizeof(uint32_t);
+  int index_ok = pread(st->idx_fd, st->offsets, want, STORE_HEADER_SIZE) == want &&
+                 fnv1a(FNV_BASIS, st->offsets, want) == hdr.index_check;
+
+  if (index_ok && hdr.count > 0)
+  {
+    uint32_t last = st->offsets[hdr.count - 1];
+    index_ok = st->offsets[0] == 0 && last < hdr.len && hdr.len - last == (uint32_t)map[last] + 33;
+  }
+  else if (index_ok && hdr.len != 0)
+  {
+    index_ok = 0;
+  }
+
+  if (!index_ok)
+  {
+    for (i = 0; i < hdr.count; i++)
+    {
+      if (off >= hdr.len || hdr.len - off < (uint32_t)map[off] + 33)
+      {
+        st->count = 0;
+        return;
+      }
+      st->offsets[i] = off;
+      off += map[off] + 33;
+    }
+    if (off != hdr.len)
+    {
+      st->count = 0;
+      return;
+    }
+  }
+  if (hdr.count > 0 && memcmp(map + hdr.len - 16, hdr.last_md5, 16) != 0)
+  {
+    st->count = 0;
+    return;
+  }
+
+  st->count = hdr.count;
+  st->len = hdr.len;
+  memcpy(st->last_md5, hdr.last_md5, 16);
+  st->synced = hdr.count;
+  st->index_hash = fnv1a(FNV_BASIS, st->offsets, want);
+
+  if (!index_ok)
+  {
+    fprintf(stderr, "El índice del almacenamiento no coincide con los datos, reconstruyéndolo.\n");
+    write_all(st->idx_fd, st->offsets, want, STORE_HEADER_SIZE);
+  }
+}
+
+/* Arma un archivo con los primeros 'st->count' mensajes de los datos mapeados, que ya están
+   validados. Sus segmentos llenos apuntan al mapeo, así que anota en 'st->mapped' hasta dónde no se
+   puede tocar el fichero de datos */
+static struct archive *build_loaded(struct store *st, struct archive_mapping *mapping, const uint8_t *map)
+{
+  uint32_t full = st->count - st->count % ARCHIVE_SEG_MSGS;
+
+  if (st->count == 0)
+  {
+    return init_archive();
+  }
+  st->mapped = full ? ((full < st->count) ? st->offsets[full] : st->len) : 0;
+  return archive_map(mapping, map, st->offsets, st->count, st->len);
+}
+
+/* Valida los mensajes completos escritos después del punto de control (entre 'st->len' y 'dlen') a
+   continuación del archivo cargado. Si todos son válidos, devuelve el archivo extendido y agrega sus
+   offsets al índice en memoria; si no, devuelve NULL y los descarta todos */
+static struct archive *load_tail(struct store *st, struct archive *base, const uint8_t *map, uint32_t dlen)
+{
+  struct archive_stream stream;
+  uint32_t off = st->len, count = st->count, index_hash = st->index_hash;
+
+  stream_init(&stream, NULL);
+  stream_prefill(&stream, base, base->size);
+  while (off < dlen && dlen - off >= (uint32_t)map[off] + 33)
+  {
+    if (!stream_push(&stream, map[off], map + off + 1))
+    {
+      stream_abort(&stream);
+      st->count = count;
+      st->index_hash = index_hash;
+      return NULL;
+    }
+    push_offset(st, off);
+    off += map[off] + 33;
+  }
+
+  struct archive *arch = stream_finish(&stream);
+  if (arch == NULL)
+  {
+    st->count = count;
+    st->index_hash = index_hash;
+    return NULL;
+  }
+
+  st->len = off;
+  memcpy(st->last_md5, map + off - 16, 16);
+  return arch;
+}
+
+/* Trabajo del hilo escritor: guarda los archivos encolados hasta que se le pida terminar, y antes
+   de terminar guarda el que haya quedado pendiente. Con la política periódica, store_save solo
+   escribe el punto de control si pasaron STORE_SYNC_SECONDS desde el anterior; si después no llega
+   nada más, el hilo lo escribe cuando se cumple ese plazo, para que lo guardado no quede sin
+   sincronizar hasta el cierre. Solo este hilo modifica el almacenamiento, así que puede leer
+   'count' y 'synced' sin tomar 'lock' */
+static void *store_writer(void *arg)
+{
+  struct store *st = (struct store *)arg;
+
+  pthread_mutex_lock(&st->queue_lock);
+  for (;;)
+  {
+    while (st->queued == NULL && !st->stopping)
+    {
+      if (st->policy != STORE_SYNC_INTERVAL || st->synced == st->count)
+      {
+        pthread_cond_wait(&st->wake, &st->queue_lock);
+        continue;
+      }
+
+      struct timespec deadline = {st->last_sync + STORE_SYNC_SECONDS, 0};
+      if (pthread_cond_timedwait(&st->wake, &st->queue_lock, &deadline) == ETIMEDOUT)
+      {
+        pthread_mutex_unlock(&st->queue_lock);
+        store_sync(st);
+        pthread_mutex_lock(&st->queue_lock);
+      }
+    }
+    if (st->queued == NULL)
+    {
+      break;
+    }
+
+    struct archive *arch = st->queued;
+    st->queued = NULL;
+    pthread_mutex_unlock(&st->queue_lock);
+    store_save(st, arch);
+    archive_unref(arch);
+    pthread_mutex_lock(&st->queue_lock);
+  }
+  pthread_mutex_unlock(&st->queue_lock);
+  return NULL;
+}
+
+struct store *store_open(const char *path, enum store_sync policy, struct archive **loaded)
+{
+  struct store *st = (struct store *)calloc(1, sizeof(struct store));
+  char *idx_path = (char *)malloc(strlen(path) + 5);
+  struct stat sb;
+
+  sprintf(idx_path, "%s.idx", path);
+  st->path = strdup(path);
+  st->policy = policy;
+  st->index_hash = FNV_BASIS;
+  st->data_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  st->idx_fd = open(idx_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  free(idx_path);
+  pthread_mutex_init(&st->lock, NULL);
+
+  if (st->data_fd == -1 || st->idx_fd == -1 || fstat(st->data_fd, &sb) == -1 || (uint64_t)sb.st_size > UINT32_MAX - 5)
+  {
+    if (st->data_fd != -1)
+    {
+      close(st->data_fd);
+    }
+    if (st->idx_fd != -1)
+    {
+      close(st->idx_fd);
+    }
+    free(st->path);
+    free(st);
+    return NULL;
+  }
+
+  /* Mapea los datos y carga lo que cubre el punto de control, sin hashearlo ni copiarlo */
+  uint32_t dlen = (uint32_t)sb.st_size;
+  uint8_t *map = NULL;
+  if (dlen > 0)
+  {
+    map = (uint8_t *)mmap(NULL, dlen, PROT_READ, MAP_PRIVATE, st->data_fd, 0);
+    if (map == MAP_FAILED)
+    {
+      map = NULL;
+      dlen = 0;
+    }
+  }
+  load_checkpoint(st, map, dlen);
+  struct archive_mapping *mapping = (map != NULL) ? archive_mapping_new(map, sb.st_size) : NULL;
+  struct archive *arch = build_loaded(st, mapping, map);
+
+  /* Lo que se escribió después del punto de control (o todo, si no había un punto de control válido)
+     sí se valida, y si no es válido o está incompleto se descarta */
+  if (dlen > st->len)
+  {
+    struct archive *extended = load_tail(st, arch, map, dlen);
+    if (extended != NULL)
+    {
+      archive_unref(arch);
+      arch = extended;
+    }
+  }
+  if (mapping != NULL)
+  {
+    archive_mapping_unref(mapping);
+  }
+
+  /* Deja los ficheros exactamente con lo cargado, y un punto de control que lo cubra todo */
+  if (dlen > st->len && ftruncate(st->data_fd, st->len) == -1)
+  {
+    fprintf(stderr, "No se pudo truncar el almacenamiento!\n");
+  }
+  if (st->count > st->synced)
+  {
+    write_all(st->idx_fd, st->offsets + st->synced, (st->count - st->synced) * sizeof(uint32_t),
+              STORE_HEADER_SIZE + (off_t)st->synced * sizeof(uint32_t));
+  }
+  if (ftruncate(st->idx_fd, STORE_HEADER_SIZE + (off_t)st->count * sizeof(uint32_t)) == -1 ||
+      checkpoint(st, policy != STORE_SYNC_NEVER) == -1)
+  {
+    fprintf(stderr, "No se pudo escribir el punto de control del almacenamiento!\n");
+  }
+
+  /* Las escrituras siguientes las hace el hilo escritor */
+  pthread_mutex_init(&st->queue_lock, NULL);
+  pthread_cond_init(&st->wake, NULL);
+  st->writing = pthread_create(&st->writer, NULL, store_writer, st) == 0;
+
+  *loaded = arch;
+  return st;
+}
+
+/* Lee el hash del mensaje guardado número 'i' (comenzando en 1) */
+static int stored_md5(struct store *st, uint32_t i, uint8_t *md5)
+{
+  uint32_t end = (i == st->count) ? st->len : st->offsets[i];
+  return pread(st->data_fd, md5, 16, end - 16) == 16 ? 0 : -1;
+}
+
+/* Devuelve cuántos mensajes del principio comparten el archivo guardado y 'arch'. Como el hash de cada
+   mensaje depende del mensaje anterior (con su hash), dos archivos con el mismo hash en el mismo
+   mensaje tienen el mismo prefijo hasta ahí, así que basta una búsqueda binaria sobre los hashes */
+static uint32_t common_prefix(struct store *st, struct archive *arch)
+{
+  uint32_t lo = 0, hi = st->count;
+  uint8_t md5[16];
+
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    if (mid <= arch->size && stored_md5(st, mid, md5) == 0 && memcmp(archive_md5(arch, mid), md5, 16) == 0)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+/* Reemplaza el fichero de datos por uno nuevo y vacío. El archivo cargado al iniciar sigue viendo el
+   fichero anterior a través de su mapeo, que se mantiene mientras exista alguno de sus segmentos */
+static int replace_data(struct store *st)
+{
+  char *tmp_path = (char *)malloc(strlen(st->path) + 7);
+  sprintf(tmp_path, "%s.nuevo", st->path);
+
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1 || rename(tmp_path, st->path) == -1)
+  {
+    if (fd != -1)
+    {
+      close(fd);
+      unlink(tmp_path);
+    }
+    free(tmp_path);
+    return -1;
+  }
+  free(tmp_path);
+
+  close(st->data_fd);
+  st->data_fd = fd;
+  st->mapped = 0;
+  return 0;
+}
+
+int store_save(struct store *st, struct archive *arch)
+{
+  int rv = 0;
+  uint32_t dlen = arch->len - 5;
+
+  pthread_mutex_lock(&st->lock);
+  if (arch->size <= st->count)
+  {
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+  }
+
+  /* Si el nuevo archivo no extiende al guardado, volvemos al prefijo común. El punto de control se
+     retrocede antes de truncar, para que nunca cubra datos que ya no existen. Los bytes mapeados al
+     iniciar no se pueden truncar: si el prefijo común no los cubre, se empieza un fichero nuevo */
+  if (st->count > 0 && memcmp(archive_md5(arch, st->count), st->last_md5, 16) != 0)
+  {
+    uint32_t keep = common_prefix(st, arch);
+
+    st->len = keep ? ((keep == st->count) ? st->len : st->offsets[keep]) : 0;
+    int fresh = st->len < st->mapped;
+    if (fresh)
+    {
+      keep = 0;
+      st->len = 0;
+    }
+    st->count = keep;
+    st->index_hash = fnv1a(FNV_BASIS, st->offsets, (size_t)keep * sizeof(uint32_t));
+    memset(st->last_md5, 0, 16);
+    if (keep > 0)
+    {
+      memcpy(st->last_md5, archive_md5(arch, keep), 16);
+    }
+    if (st->synced > keep && checkpoint(st, st->policy != STORE_SYNC_NEVER) == -1)
+    {
+      rv = -1;
+    }
+    if ((fresh ? replace_data(st) : ftruncate(st->data_fd, st->len)) == -1 ||
+        ftruncate(st->idx_fd, STORE_HEADER_SIZE + (off_t)keep * sizeof(uint32_t)) == -1)
+    {
+      rv = -1;
+    }
+  }
+
+  /* Si no se pudo empezar el fichero nuevo, no se escribe sobre los bytes mapeados */
+  if (st->len < st->mapped)
+  {
+    pthread_mutex_unlock(&st->lock);
+    fprintf(stderr, "Error al guardar el archivo en el almacenamiento!\n");
+    return -1;
+  }
+
+  /* Agrega los mensajes nuevos a los datos, segmento a segmento, y sus offsets al índice */
+  uint32_t first = st->count, off = st->len, n = archive_iov(arch, first + 1, NULL), i;
+  struct iovec *iov = (struct iovec *)malloc(n * sizeof(struct iovec));
+  archive_iov(arch, first + 1, iov);
+  for (i = 0; i < n; i++)
+  {
+    if (write_all(st->data_fd, iov[i].iov_base, iov[i].iov_len, off) == -1)
+    {
+      rv = -1;
+    }
+    off += iov[i].iov_len;
+  }
+  free(iov);
+  for (i = first + 1; i <= arch->size; i++)
+  {
+    push_offset(st, message_offset(arch, i) - 5);
+  }
+  if (write_all(st->idx_fd, st->offsets + first, (st->count - first) * sizeof(uint32_t),
+                STORE_HEADER_SIZE + (off_t)first * sizeof(uint32_t)) == -1)
+  {
+    rv = -1;
+  }
+  st->len = dlen;
+  memcpy(st->last_md5, archive_md5(arch, arch->size), 16);
+
+  /* Y actualiza el punto de control según la política */
+  if (st->policy == STORE_SYNC_ALWAYS ||
+      (st->policy == STORE_SYNC_INTERVAL && time(NULL) - st->last_sync >= STORE_SYNC_SECONDS))
+  {
+    rv = checkpoint(st, 1) == -1 ? -1 : rv;
+  }
+  else if (st->policy == STORE_SYNC_NEVER)
+  {
+    rv = checkpoint(st, 0) == -1 ? -1 : rv;
+  }
+  pthread_mutex_unlock(&st->lock);
+
+  if (rv == -1)
+  {
+    fprintf(stderr, "Error al guardar el archivo en el almacenamiento!\n");
+  }
+  return rv;
+}
+
+void store_queue(struct store *st, struct archive *arch)
+{
+  if (!st->writing)
+  {
+    store_save(st, arch);
+    return;
+  }
+
+  /* El archivo activo solo crece, así que uno más chico que el pendiente ya no hace falta guardarlo */
+  pthread_mutex_lock(&st->queue_lock);
+  if (st->queued == NULL || arch->size > st->queued->size)
+  {
+    if (st->queued != NULL)
+    {
+      archive_unref(st->queued);
+    }
+    st->queued = archive_ref(arch);
+    pthread_cond_signal(&st->wake);
+  }
+  pthread_mutex_unlock(&st->queue_lock);
+}
+
+void store_sync(struct store *st)
+{
+  pthread_mutex_lock(&st->lock);
+  if (checkpoint(st, st->policy != STORE_SYNC_NEVER) == -1)
+  {
+    /* Se reintenta en el próximo plazo, no enseguida */
+    st->last_sync = time(NULL);
+    fprintf(stderr, "No se pudo escribir el punto de control del almacenamiento!\n");
+  }
+  pthread_mutex_unlock(&st->lock);
+}
+
+void store_close(struct store *st)
+{
+  if (st->writing)
+  {
+    pthread_mutex_lock(&st->queue_lock);
+    st->stopping = 1;
+    pthread_cond_signal(&st->wake);
+    pthread_mutex_unlock(&st->queue_lock);
+    pthread_join(st->writer, NULL);
+  }
+  pthread_mutex_destroy(&st->queue_lock);
+  pthread_cond_destroy(&st->wake);
+
+  store_sync(st);
+  close(st->data_fd);
+  close(st->idx_fd);
+  pthread_mutex_destroy(&st->lock);
+  free(st->offsets);
+  free(st->path);
+  free(st);
+}
@@ -0,0 +1,100 @@
+#include <stdint.h>  // tipos portátiles (uint8_t, uint32_t, etc...)
+#include <pthread.h> // mutex que serializa las escrituras, e hilo que las hace
+#include <time.h>    // time_t, para la política de sincronización periódica
+
+/* Almacenamiento persistente del archivo activo, para que el nodo no tenga que descargar y volver a
+   validar todo el archivo al reiniciar. Usa dos ficheros:
+   - el de datos ("ruta"), con los mensajes del archivo tal como se envían (sin el tipo ni el
+     tamaño), al que solo se agregan mensajes al final. Solo se trunca si el archivo activo es
+     reemplazado por uno que no extiende al guardado;
+   - el de índice ("ruta.idx"), con un encabezado que guarda el último punto de control (cuántos
+     mensajes y bytes de datos están validados y sincronizados con el disco, el hash del último y
+     una suma de verificación de los offsets que cubre) seguido del offset de cada mensaje dentro del
+     fichero de datos.
+   Al iniciar, el fichero de datos se mapea en memoria y los mensajes hasta el punto de control se
+   cargan sin volver a hashearlos ni a recorrerlos: los offsets del índice indican dónde empieza cada
+   uno, y los segmentos del archivo cargado apuntan al fichero mapeado en lugar de copiarlo. Solo los
+   mensajes que se escribieron después del punto de control (si los hay) se validan.
+   Los hilos del nodo no escriben en el disco: encolan el archivo a guardar con store_queue, y un
+   hilo escritor lo guarda, así que un disco lento no detiene al bucle de eventos ni al minado. */
+
+/* Política de sincronización con el disco:
+   STORE_SYNC_ALWAYS   -> fdatasync tras cada escritura, el punto de control siempre está al día
+   STORE_SYNC_INTERVAL -> fdatasync como mucho una vez cada STORE_SYNC_SECONDS segundos, y a más
+                          tardar STORE_SYNC_SECONDS segundos después de la última escritura
+   STORE_SYNC_NEVER    -> el sistema operativo decide cuándo escribir en el disco */
+enum store_sync
+{
+  STORE_SYNC_ALWAYS,
+  STORE_SYNC_INTERVAL,
+  STORE_SYNC_NEVER
+};
+
+#define STORE_SYNC_SECONDS 1
+
+/* Estructura de un almacenamiento abierto. Descripción breve de sus campos:
+   path            -> ruta del fichero de datos
+   data_fd, idx_fd -> descriptores de los ficheros de datos e índice
+   policy          -> política de sincronización
+   count, len      -> mensajes y bytes de datos escritos
+   offsets         -> offset de cada mensaje en el fichero de datos (capacidad 'cap')
+   index_hash      -> suma de verificación de los 'count' offsets, que se extiende al agregar uno
+   mapped          -> bytes del principio del fichero de datos a los que apuntan los segmentos del
+                      archivo cargado al iniciar, que no se pueden truncar ni sobrescribir
+   last_md5        -> hash del último mensaje escrito
+   synced          -> mensajes escritos hasta el último punto de control
+   last_sync       -> momento del último punto de control
+   lock            -> serializa las escrituras, que pueden venir de varios hilos
+   queued          -> archivo pendiente de guardar por el hilo escritor, o NULL
+   writer          -> el hilo escritor, si 'writing'; 'stopping' le pide que termine tras guardar
+                      lo pendiente. También escribe el punto de control que la política de
+                      sincronización periódica tenga pendiente
+   queue_lock      -> protege 'queued' y 'stopping', y 'wake' despierta al hilo escritor */
+struct store
+{
+  char *path;
+  int data_fd, idx_fd;
+  enum store_sync policy;
+  uint32_t count, len;
+  uint32_t *offsets, cap;
+  uint32_t index_hash, mapped;
+  uint8_t last_md5[16];
+  uint32_t synced;
+  time_t last_sync;
+  pthread_mutex_t lock;
+  struct archive *queued;
+  pthread_t writer;
+  int writing, stopping;
+  pthread_mutex_t queue_lock;
+  pthread_cond_t wake;
+};
+
+struct archive;
+
+/* Convierte el nombre de una política ("always", "interval" o "never") a su valor. Devuelve 0, o -1
+   si el nombre no es válido */
+int store_parse_sync(const char *name, enum store_sync *policy);
+
+/* Abre (o crea) el almacenamiento en la ruta dada y carga el archivo guardado en 'loaded' (con una
+   referencia para el llamador; un archivo vacío si no había nada guardado). Devuelve el
+   almacenamiento, o NULL si no se pudieron abrir los ficheros */
+struct store *store_open(const char *path, enum store_sync policy, struct archive **loaded);
+
+/* Guarda el archivo dado, que debe ser más grande que el guardado (los archivos más pequeños o del
+   mismo tamaño se ignoran, porque el archivo activo solo crece). Si extiende al archivo guardado solo
+   se escriben los mensajes nuevos; si no, se trunca hasta el prefijo común, salvo que eso corte los
+   mensajes mapeados al iniciar: entonces se escribe el archivo entero en un fichero de datos nuevo,
+   que reemplaza al anterior. Devuelve 0, o -1 si hubo un error de escritura */
+int store_save(struct store *st, struct archive *arch);
+
+/* Encola el archivo dado para que el hilo escritor lo guarde con store_save, sin esperar a que se
+   escriba. Si ya había otro pendiente solo se guarda el más grande. Si el hilo escritor no pudo
+   lanzarse, lo guarda directamente */
+void store_queue(struct store *st, struct archive *arch);
+
+/* Sincroniza con el disco lo escrito y actualiza el punto de control */
+void store_sync(struct store *st);
+
+/* Espera a que el hilo escritor guarde lo pendiente, sincroniza y cierra el almacenamiento, liberando
+   su memoria */
+void store_close(struct store *st);